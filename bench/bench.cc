@@ -1,122 +1,1277 @@
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "bench_util.h"
+#include "histogram.h"
 #include "include/engine.h"
+#include "perf_counters.h"
+#include "results.h"
+#include "timeline.h"
+#include "workload.h"
 #include "zipf.h"
 
 #define MAX_THREAD 64
-#define OP_PER_THREAD 200000ull
-#define KEY_SPACE (OP_PER_THREAD * 4)
-#define KEY_SIZE 8
-#define VALUE_SIZE 16
-#define VALUE_BUFFER 5000
-
-static_assert(VALUE_BUFFER > VALUE_SIZE);
-// key size is not configurable.
-static_assert(KEY_SIZE == 8);
 
 using namespace polar_race;
 
-int threadNR = 1;
-int readNR = 100;
-bool isSkew = 0;
+// A key distribution with its skew
+struct DistSpec {
+    KeyDist dist;
+    double theta;
+};
+
+struct BenchConfig {
+    int threads = 1;
+    int read_ratio = 100;
+    // Every combination of these is run, repeats times; threads,
+    // read_ratio and keys hold the one running
+    std::vector<int> thread_counts;
+    std::vector<int> read_ratios;
+    std::vector<DistSpec> dists;
+    int repeats = 1;
+    std::string results;    // .json or .csv summary of every combination
+    int key_size = 8;
+    ValueSizeGen value_size;
+    ValueSizeGen preload_value_size;
+    KeyDistConfig keys;
+    uint64_t preload = 0;  // keys written before the timed run
+    uint64_t ops = 200000;  // per thread, unless running for a duration
+    double duration = 0;    // seconds
+    std::string latency_csv;  // full latency distributions go here
+    OpMix mix;
+    int max_scan = 100;     // keys per scan, at most
+    std::vector<const YcsbWorkload *> ycsb;  // run these instead of the mix
+    double rate = 0;        // ops/s over all threads; 0 is closed loop
+    bool poisson = true;    // arrivals, otherwise evenly spaced
+    std::vector<double> sweep;  // rates to run one after the other
+    std::vector<std::string> engines;  // each runs everything; none is
+                                       // the library's default engine
+    Options options;        // what the engine is opened with
+    bool perf = false;      // count hardware events in the run phase
+    bool stats = false;     // print the engine's statistics after a phase
+    std::string timeline;   // ops and latency per interval go here
+    double interval_ms = 10;
+    std::string recovery;   // "kill" or "clean": recovery instead of the
+                            // workloads, at each of recovery_keys
+    std::vector<uint64_t> recovery_keys;
+};
+
+// Filled in by one bench thread
+struct ThreadStats {
+    uint64_t ops = 0;
+    uint64_t scanned = 0;  // records the scans returned
+    Histogram latency[kOpTypes];  // rdtsc ticks
+    PerfCounts perf;
+};
+
+BenchConfig cfg;
 
 Engine *engine = NULL;
 
+// Of the running phase, with --timeline
+Timeline *timeline = NULL;
+FILE *timelineFile = NULL;
+
+// Keys written so far, for the latest distribution
+std::atomic<uint64_t> insertedKeys(0);
+std::atomic<bool> stopRun(false);
+
 void usage() {
     fprintf(stderr,
-            "Usage: ./bench thread_num[1-64] read_ratio[0-100] isSkew[0|1] \n");
+            "Usage: ./bench [--flag=value ...]\n"
+            "       ./bench thread_num[1-64] read_ratio[0-100] isSkew[0|1]\n"
+            "\n"
+            "  --threads=N               worker threads, 1-64 (1)\n"
+            "  --read_ratio=P            percent of reads, the rest are "
+            "writes (100)\n"
+            "  --key_size=N              key bytes (8)\n"
+            "  --value_size=SPEC         N, fixed:N, uniform:A-B or "
+            "hist:FILE (16)\n"
+            "  --key_space=N             distinct keys (800000)\n"
+            "  --preload=N               keys written before the run, spread "
+            "over the key space (key_space / 100)\n"
+            "  --preload_value_size=SPEC value sizes of those (4096, or 16 "
+            "with --recovery)\n"
+            "  --ops=N                   operations per thread (200000)\n"
+            "  --duration=S              run for S seconds instead of a "
+            "number of ops\n"
+            "  --distribution=NAME       uniform, zipf, latest, sequential or "
+            "hotspot (uniform),\n"
+            "                            zipf and latest may add :THETA, "
+            "e.g. zipf:0.9\n"
+            "  --theta=X                 zipf skew for zipf and latest, "
+            "in [0, 1) (0.99)\n"
+            "  --hot_fraction=X          hotspot: share of the key space "
+            "that is hot (0.2)\n"
+            "  --hot_op_fraction=X       hotspot: share of the ops that go "
+            "to it (0.8)\n"
+            "  --latency_csv=FILE        write every latency bucket of every "
+            "op type to FILE\n"
+            "  --workload=LIST           YCSB core workloads to run, e.g. "
+            "a,b,f or all\n"
+            "  --max_scan=N              longest YCSB scan, in keys (100)\n"
+            "  --rate=N                  open loop: offer N ops/s over all "
+            "threads, and time\n"
+            "                            each op from when it was due\n"
+            "  --arrival=NAME            poisson or constant gaps between "
+            "ops (poisson)\n"
+            "  --sweep=N,N,...           open loop at each rate in turn, on "
+            "the same data\n"
+            "  --engine=LIST             engines to run the workload on in "
+            "turn, e.g.\n"
+            "                            engine_example,engine_race, or all; "
+            "the library's\n"
+            "                            default engine otherwise\n"
+            "  --perf                    count cycles, instructions, cache "
+            "and TLB misses\n"
+            "                            and context switches per op in the "
+            "run phase\n"
+            "  --stats                   print the engine's statistics after "
+            "every phase\n"
+            "  --repeats=N               run everything N times, for "
+            "confidence intervals (1)\n"
+            "  --results=FILE            summary of every run, JSON if FILE "
+            "ends in .json,\n"
+            "                            CSV otherwise\n"
+            "  --timeline=FILE           ops/s and p50/p99/max latency of "
+            "every interval of\n"
+            "                            every phase, as CSV, to find stalls\n"
+            "  --interval_ms=X           length of a timeline interval (10)\n"
+            "  --recovery=MODE           instead of the workloads, load keys "
+            "in a child process\n"
+            "                            that is killed at a random write "
+            "(kill) or closes the\n"
+            "                            engine (clean), then time Open, "
+            "the first read and\n"
+            "                            the way back to steady throughput\n"
+            "  --recovery_keys=N,N,...   keys to load for --recovery\n"
+            "                            (1000000,10000000,100000000), "
+            "about 24 MB, 240 MB\n"
+            "                            and 2.4 GB of 8-byte keys and "
+            "16-byte values\n"
+            "\n"
+            "--threads, --read_ratio and --distribution take lists, e.g. "
+            "--threads=1,2,4 or\n"
+            "--threads=1-64 for the powers of two in between, and every "
+            "combination is run.\n"
+            "\n"
+            "A histogram file has one \"size weight\" pair per line.\n"
+            "\n"
+            "A YCSB workload loads key_space keys, then runs its own mix and "
+            "distribution,\nwhich replace --read_ratio and --distribution; "
+            "values default to 1000 bytes:\n");
+    for (const YcsbWorkload &w : ycsb_workloads) {
+        fprintf(stderr, "  %s  %-18s read %3d%%, update %2d%%, insert %d%%, "
+                "scan %2d%%, rmw %2d%%\n", w.name, w.about,
+                w.mix.percent[kOpRead], w.mix.percent[kOpUpdate],
+                w.mix.percent[kOpInsert], w.mix.percent[kOpScan],
+                w.mix.percent[kOpReadModifyWrite]);
+    }
     exit(-1);
 }
 
+// Matches "--name=value"
+static bool flag(const char *arg, const char *name, std::string *value) {
+    size_t n = strlen(name);
+    if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, n) != 0 ||
+        arg[2 + n] != '=') {
+        return false;
+    }
+    *value = arg + 3 + n;
+    return true;
+}
+
+static uint64_t parse_uint(const std::string &s) {
+    char *end;
+    unsigned long long v = strtoull(s.c_str(), &end, 10);
+    if (s.empty() || *end != 0) usage();
+    return v;
+}
+
+static double parse_double(const std::string &s) {
+    char *end;
+    double v = strtod(s.c_str(), &end);
+    if (s.empty() || *end != 0) usage();
+    return v;
+}
+
+static void parse_workloads(const std::string &list) {
+    if (list == "all") {
+        for (const YcsbWorkload &w : ycsb_workloads) cfg.ycsb.push_back(&w);
+        return;
+    }
+    std::istringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        const YcsbWorkload *w = find_ycsb_workload(name);
+        if (w == NULL) {
+            fprintf(stderr, "unknown workload: %s\n", name.c_str());
+            usage();
+        }
+        cfg.ycsb.push_back(w);
+    }
+}
+
+static void parse_rates(const std::string &list) {
+    std::istringstream rates(list);
+    std::string rate;
+    while (std::getline(rates, rate, ',')) {
+        double r = parse_double(rate);
+        if (r <= 0) usage();
+        cfg.sweep.push_back(r);
+    }
+}
+
+static void parse_engines(const std::string &list) {
+    std::vector<std::string> known = Engine::Engines();
+    if (list == "all") {
+        cfg.engines = known;
+        return;
+    }
+    std::istringstream names(list);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+        if (std::find(known.begin(), known.end(), name) == known.end()) {
+            fprintf(stderr, "unknown engine: %s, this build has:",
+                    name.c_str());
+            for (auto &k : known) fprintf(stderr, " %s", k.c_str());
+            fprintf(stderr, "\n");
+            usage();
+        }
+        cfg.engines.push_back(name);
+    }
+}
+
+// "A,B,..." or "A-B", which is A and the powers of two after it up to B
+static void parse_ints(const std::string &list, std::vector<int> *out) {
+    out->clear();
+    size_t dash = list.find('-');
+    if (dash != std::string::npos) {
+        int lo = parse_uint(list.substr(0, dash));
+        int hi = parse_uint(list.substr(dash + 1));
+        if (lo <= 0 || hi < lo) usage();
+        out->push_back(lo);
+        for (int v = 1; v < hi; v *= 2) {
+            if (v > lo) out->push_back(v);
+        }
+        if (hi > lo) out->push_back(hi);
+        return;
+    }
+    std::istringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ',')) out->push_back(parse_uint(item));
+}
+
+static void parse_dists(const std::string &list) {
+    cfg.dists.clear();
+    std::istringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        DistSpec d = {kUniform, cfg.keys.theta};
+        size_t colon = item.find(':');
+        if (!parse_key_dist(item.substr(0, colon), &d.dist)) usage();
+        if (colon != std::string::npos) {
+            d.theta = parse_double(item.substr(colon + 1));
+        }
+        cfg.dists.push_back(d);
+    }
+}
+
+template <class T>
+static std::string join(const std::vector<T> &v) {
+    std::string s;
+    for (auto &x : v) s += (s.empty() ? "" : ",") + std::to_string(x);
+    return s;
+}
+
+static std::string dist_label(const DistSpec &d) {
+    std::string s = key_dist_names[d.dist];
+    if (d.dist == kZipf || d.dist == kLatest) {
+        char theta[16];
+        snprintf(theta, sizeof(theta), ":%.2f", d.theta);
+        s += theta;
+    }
+    return s;
+}
+
+// The read/write mix of cfg.read_ratio; writes add new keys under the
+// latest distribution
+static void set_mix() {
+    cfg.mix = OpMix();
+    cfg.mix.percent[kOpRead] = cfg.read_ratio;
+    cfg.mix.percent[cfg.keys.dist == kLatest ? kOpInsert : kOpUpdate] =
+        100 - cfg.read_ratio;
+}
+
+static void parse_sizes(ValueSizeGen *gen, const std::string &spec) {
+    std::string err;
+    if (!gen->parse(spec, &err)) {
+        fprintf(stderr, "%s\n", err.c_str());
+        usage();
+    }
+}
+
 void parseArgs(int argc, char **argv) {
-    if (argc != 4) {
+    cfg.keys.key_space = 800000;
+    std::string value_size, preload_value_size;
+    bool preload_set = false;
+    std::string dists;
+
+    if (argc == 4 && strncmp(argv[1], "--", 2) != 0) {
+        // The original positional form
+        cfg.thread_counts.push_back(std::atoi(argv[1]));
+        cfg.read_ratios.push_back(std::atoi(argv[2]));
+        int k = std::atoi(argv[3]);
+        if (k != 0 && k != 1) usage();
+        dists = k ? "zipf" : "uniform";
+    } else {
+        for (int i = 1; i < argc; ++i) {
+            std::string v;
+            if (flag(argv[i], "threads", &v)) {
+                parse_ints(v, &cfg.thread_counts);
+            } else if (flag(argv[i], "read_ratio", &v)) {
+                parse_ints(v, &cfg.read_ratios);
+            } else if (flag(argv[i], "key_size", &v)) {
+                cfg.key_size = parse_uint(v);
+            } else if (flag(argv[i], "value_size", &v)) {
+                value_size = v;
+            } else if (flag(argv[i], "key_space", &v)) {
+                cfg.keys.key_space = parse_uint(v);
+            } else if (flag(argv[i], "preload", &v)) {
+                cfg.preload = parse_uint(v);
+                preload_set = true;
+            } else if (flag(argv[i], "preload_value_size", &v)) {
+                preload_value_size = v;
+            } else if (flag(argv[i], "ops", &v)) {
+                cfg.ops = parse_uint(v);
+            } else if (flag(argv[i], "duration", &v)) {
+                cfg.duration = parse_double(v);
+            } else if (flag(argv[i], "distribution", &v)) {
+                dists = v;
+            } else if (flag(argv[i], "theta", &v)) {
+                cfg.keys.theta = parse_double(v);
+            } else if (flag(argv[i], "hot_fraction", &v)) {
+                cfg.keys.hot_fraction = parse_double(v);
+            } else if (flag(argv[i], "hot_op_fraction", &v)) {
+                cfg.keys.hot_op_fraction = parse_double(v);
+            } else if (flag(argv[i], "latency_csv", &v)) {
+                cfg.latency_csv = v;
+            } else if (flag(argv[i], "workload", &v)) {
+                parse_workloads(v);
+            } else if (flag(argv[i], "max_scan", &v)) {
+                cfg.max_scan = parse_uint(v);
+            } else if (flag(argv[i], "rate", &v)) {
+                cfg.rate = parse_double(v);
+            } else if (flag(argv[i], "arrival", &v)) {
+                if (v != "poisson" && v != "constant") usage();
+                cfg.poisson = v == "poisson";
+            } else if (flag(argv[i], "sweep", &v)) {
+                parse_rates(v);
+            } else if (flag(argv[i], "engine", &v)) {
+                parse_engines(v);
+            } else if (strcmp(argv[i], "--perf") == 0) {
+                cfg.perf = true;
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                cfg.stats = true;
+            } else if (flag(argv[i], "repeats", &v)) {
+                cfg.repeats = parse_uint(v);
+            } else if (flag(argv[i], "results", &v)) {
+                cfg.results = v;
+            } else if (flag(argv[i], "timeline", &v)) {
+                cfg.timeline = v;
+            } else if (flag(argv[i], "interval_ms", &v)) {
+                cfg.interval_ms = parse_double(v);
+            } else if (flag(argv[i], "recovery", &v)) {
+                if (v != "kill" && v != "clean") usage();
+                cfg.recovery = v;
+            } else if (flag(argv[i], "recovery_keys", &v)) {
+                std::istringstream items(v);
+                std::string item;
+                while (std::getline(items, item, ',')) {
+                    cfg.recovery_keys.push_back(parse_uint(item));
+                }
+            } else {
+                fprintf(stderr, "unknown argument: %s\n", argv[i]);
+                usage();
+            }
+        }
+    }
+    // After --theta, which is the default skew of the distributions
+    parse_dists(dists.empty() ? "uniform" : dists);
+    if (cfg.thread_counts.empty()) cfg.thread_counts.push_back(1);
+    if (cfg.read_ratios.empty()) cfg.read_ratios.push_back(100);
+    cfg.threads = cfg.thread_counts[0];
+    cfg.read_ratio = cfg.read_ratios[0];
+    cfg.keys.dist = cfg.dists[0].dist;
+    cfg.keys.theta = cfg.dists[0].theta;
+
+    if (!cfg.ycsb.empty()) {
+        // YCSB loads every record with values like the ones it writes
+        if (value_size.empty()) value_size = "1000";
+        preload_value_size = value_size;
+        cfg.preload = cfg.keys.key_space;
+    } else if (!preload_set) {
+        cfg.preload = cfg.keys.key_space / 100;
+    }
+    if (value_size.empty()) value_size = "16";
+    if (preload_value_size.empty()) {
+        // Recovery loads up to 100M keys by default, small values keep
+        // that within reach of a test machine
+        preload_value_size = cfg.recovery.empty() ? "4096" : "16";
+    }
+    parse_sizes(&cfg.value_size, value_size);
+    parse_sizes(&cfg.preload_value_size, preload_value_size);
+
+    for (int t : cfg.thread_counts) {
+        if (t <= 0 || t > MAX_THREAD) usage();
+    }
+    for (int r : cfg.read_ratios) {
+        if (r < 0 || r > 100) usage();
+    }
+    for (const DistSpec &d : cfg.dists) {
+        if (d.theta < 0 || d.theta >= 1) usage();
+    }
+    if (cfg.repeats <= 0 || cfg.interval_ms <= 0) usage();
+    if (cfg.key_size <= 0 || cfg.keys.key_space == 0 ||
+        cfg.keys.key_space > max_key_space(cfg.key_size) ||
+        cfg.preload > cfg.keys.key_space)
+        usage();
+    if (cfg.keys.hot_fraction <= 0 || cfg.keys.hot_fraction > 1 ||
+        cfg.keys.hot_op_fraction < 0 || cfg.keys.hot_op_fraction > 1)
         usage();
+    if (cfg.duration < 0 || cfg.max_scan <= 0 || cfg.rate < 0) usage();
+    if (!cfg.recovery.empty()) {
+        if (cfg.recovery_keys.empty()) {
+            cfg.recovery_keys = {1000000, 10000000, 100000000};
+        }
+        for (uint64_t n : cfg.recovery_keys) {
+            if (n == 0 || n > max_key_space(cfg.key_size)) usage();
+        }
+        // Long enough to see the throughput settle
+        if (cfg.duration == 0) cfg.duration = 5;
+        if (!cfg.ycsb.empty() || !cfg.sweep.empty()) usage();
     }
-    threadNR = std::atoi(argv[1]);
-    readNR = std::atoi(argv[2]);
-    int k = std::atoi(argv[3]);
-    isSkew = k;
 
-    if (threadNR <= 0 || threadNR > MAX_THREAD) usage();
-    if (readNR < 0 || readNR > 100) usage();
-    if (k != 0 && k != 1) usage();
+    set_mix();
+
+    if (cfg.rate > 0 || !cfg.sweep.empty()) {
+        fprintf(stdout, "open loop, %s arrivals",
+                cfg.poisson ? "poisson" : "constant");
+        if (cfg.sweep.empty()) fprintf(stdout, " at %.0f ops/s", cfg.rate);
+        fprintf(stdout, "\n");
+    }
+    if (!cfg.recovery.empty()) {
+        fprintf(stdout,
+                "recovery after %s, keys: %s, thread_num: %d, read ratio: "
+                "%d%%\nkey size: %d, value size: %s\n",
+                cfg.recovery == "kill" ? "a kill" : "a clean close",
+                join(cfg.recovery_keys).c_str(), cfg.threads, cfg.read_ratio,
+                cfg.key_size, preload_value_size.c_str());
+        return;
+    }
+    if (!cfg.ycsb.empty()) {
+        fprintf(stdout, "ycsb workloads:");
+        for (const YcsbWorkload *w : cfg.ycsb) fprintf(stdout, " %s", w->name);
+        fprintf(stdout,
+                ", thread_num: %s\nkey size: %d, value size: %s, records: "
+                "%llu, max scan: %d\n",
+                join(cfg.thread_counts).c_str(), cfg.key_size,
+                value_size.c_str(),
+                (unsigned long long)cfg.keys.key_space, cfg.max_scan);
+        return;
+    }
 
-    fprintf(stdout, "thread_num: %d, read ratio: %d%%, isSkew: %s\n", threadNR,
-            readNR, isSkew ? "true" : "false");
+    std::string dist_list;
+    for (const DistSpec &d : cfg.dists) {
+        dist_list += (dist_list.empty() ? "" : ",") + dist_label(d);
+    }
+    fprintf(stdout, "thread_num: %s, read ratio: %s%%, distribution: %s\n",
+            join(cfg.thread_counts).c_str(), join(cfg.read_ratios).c_str(),
+            dist_list.c_str());
+    fprintf(stdout,
+            "key size: %d, value size: %s, key space: %llu, preload: %llu "
+            "keys\n",
+            cfg.key_size, value_size.c_str(),
+            (unsigned long long)cfg.keys.key_space,
+            (unsigned long long)cfg.preload);
 }
 
-void bench_thread(int id) {
-    struct zipf_gen_state state;
-    unsigned int seed = asm_rdtsc() + id;
+// Random bytes to take values from
+static std::string value_pool(size_t size) {
+    std::string pool(size + 1, 0);
+    gen_random(&pool[0], size);
+    pool.resize(size);
+    return pool;
+}
 
-    char v[VALUE_BUFFER];
+// Id of the i-th preloaded key. They are spread over the key space,
+// except for the latest distribution, which counts keys from 0 up.
+static uint64_t preload_id(uint64_t i) {
+    if (cfg.keys.dist == kLatest) return i;
+    return (unsigned __int128)i * cfg.keys.key_space / cfg.preload;
+}
+
+// Writes this thread's share of the preload
+void load_thread(int id, zipf_gen_state, ThreadStats *stats) {
+    uint64_t begin = cfg.preload * id / cfg.threads;
+    uint64_t end = cfg.preload * (id + 1) / cfg.threads;
+    uint64_t rng = (asm_rdtsc() + id) | 1;
+    std::string pool = value_pool(cfg.preload_value_size.max());
+    std::vector<char> key(cfg.key_size);
+    Timeline::Cursor cursor;
+    for (uint64_t i = begin; i < end; ++i) {
+        make_key(preload_id(i), key.data(), cfg.key_size);
+        PolarString k(key.data(), cfg.key_size);
+        PolarString v(pool.data(), cfg.preload_value_size.next(&rng));
+        uint64_t start = asm_rdtsc();
+        engine->Write(k, v);
+        uint64_t done = asm_rdtsc();
+        stats->latency[kOpInsert].record(done - start);
+        if (timeline != NULL) timeline->record(&cursor, done, done - start);
+    }
+    if (timeline != NULL) timeline->flush(&cursor);
+    stats->ops = end - begin;
+}
+
+// Counts what a scan returns
+class ScanCounter : public Visitor {
+public:
+    uint64_t records = 0;
+
+    void Visit(const PolarString &key, const PolarString &value) override {
+        records++;
+    }
+};
+
+void bench_thread(int id, zipf_gen_state zipf, ThreadStats *stats) {
+    unsigned int seed = asm_rdtsc() + id;
+    KeyChooser chooser(cfg.keys, zipf, id, cfg.threads, &insertedKeys,
+                       asm_rdtsc() >> 17);
+    uint64_t rng = (asm_rdtsc() + id) | 1;
+    std::string pool = value_pool(cfg.value_size.max());
+    std::vector<char> key(cfg.key_size), scan_end(cfg.key_size);
     std::string value;
-    gen_random(v, VALUE_SIZE);
-    mehcached_zipf_init(&state, KEY_SPACE, isSkew ? 0.99 : 0,
-                        asm_rdtsc() >> 17);
-    for (int i = 0; i < OP_PER_THREAD; ++i) {
-        bool isRead = (rand_r(&seed) % 100) < readNR;
-        uint64_t key = mehcached_zipf_next(&state);
-        PolarString k((char *)&key, sizeof(uint64_t));
-        if (isRead) {
-            engine->Read(k, &value);
+    ScanCounter scanned;
+
+    // Open loop: every op has a time it is due, and a late engine makes
+    // the ops behind it late too, which is what their latency shows
+    double gap = cfg.rate > 0 ? tsc_per_ns() * 1e9 * cfg.threads / cfg.rate
+                              : 0;
+    double due = asm_rdtsc();
+    Timeline::Cursor cursor;
+
+    PerfCounters perf;
+    if (cfg.perf) perf.start();
+    uint64_t i = 0;
+    for (; cfg.duration > 0 ? !stopRun.load(std::memory_order_relaxed)
+                            : i < cfg.ops;
+         ++i) {
+        OpType op = cfg.mix.pick(rand_r(&seed) % 100);
+        uint64_t id =
+            op == kOpInsert ? chooser.next_insert() : chooser.next_read();
+        make_key(id, key.data(), cfg.key_size);
+        PolarString k(key.data(), cfg.key_size);
+        PolarString v(pool.data(), op == kOpRead || op == kOpScan
+                                       ? 0
+                                       : cfg.value_size.next(&rng));
+        if (op == kOpScan) {
+            // Ids are dense after the load, so this covers that many keys
+            make_key(id + 1 + xorshift64(&rng) % cfg.max_scan,
+                     scan_end.data(), cfg.key_size);
+        }
+        uint64_t start;
+        if (gap > 0) {
+            due += arrival_gap(gap, cfg.poisson, &rng);
+            wait_tsc(due);
+            start = due;
         } else {
-            engine->Write(k, v);
+            start = asm_rdtsc();
+        }
+        switch (op) {
+            case kOpRead:
+                engine->Read(k, &value);
+                break;
+            case kOpScan:
+                engine->Range(k, PolarString(scan_end.data(), cfg.key_size),
+                              scanned);
+                break;
+            case kOpReadModifyWrite:
+                engine->Read(k, &value);
+                engine->Write(k, v);
+                break;
+            default:
+                engine->Write(k, v);
+                break;
         }
+        uint64_t done = asm_rdtsc();
+        stats->latency[op].record(done - start);
+        if (timeline != NULL) timeline->record(&cursor, done, done - start);
     }
+    if (cfg.perf) stats->perf = perf.stop();
+    if (timeline != NULL) timeline->flush(&cursor);
+    stats->ops = i;
+    stats->scanned = scanned.records;
 }
 
-int main(int argc, char **argv) {
-    parseArgs(argc, argv);
+// Percentile table of the merged latencies, in microseconds, and every
+// bucket to |csv| if there is one
+void print_latency(const std::string &phase,
+                   const std::vector<ThreadStats> &stats, FILE *csv) {
+    const double ticks_per_us = tsc_per_ns() * 1000;
+    printf("%-8s %12s %10s %10s %10s %10s %10s %10s\n", "latency", "count",
+           "avg(us)", "p50", "p90", "p99", "p99.9", "max");
+    for (int op = 0; op < kOpTypes; ++op) {
+        Histogram h;
+        for (auto &s : stats) h.merge(s.latency[op]);
+        if (h.count() == 0) continue;
+        printf("%-8s %12llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+               op_names[op], (unsigned long long)h.count(),
+               h.mean() / ticks_per_us, h.percentile(50) / ticks_per_us,
+               h.percentile(90) / ticks_per_us,
+               h.percentile(99) / ticks_per_us,
+               h.percentile(99.9) / ticks_per_us, h.max() / ticks_per_us);
+        if (csv != NULL) {
+            h.write_csv(csv, (phase + "," + op_names[op]).c_str(),
+                        ticks_per_us);
+        }
+    }
+}
 
-#ifdef MOCK_NVM
-    system("mkdir -p /tmp/ramdisk/data");
-    std::string engine_path =
-        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
-#else
-    std::string engine_path = "/dev/dax0.0";
-#endif
-    printf("open engine_path: %s\n", engine_path.c_str());
+// Events per op over every thread. They include the bench's own work of
+// picking keys and timing, which the closed loop keeps small.
+void print_perf(const std::string &phase,
+                const std::vector<ThreadStats> &stats, uint64_t total) {
+    PerfCounts sum;
+    for (size_t i = 0; i < stats.size(); ++i) sum.merge(stats[i].perf, i == 0);
+    printf("[%s] per op:", phase.c_str());
+    bool any = false;
+    for (int e = 0; e < kPerfEvents; ++e) {
+        if (sum.valid[e]) {
+            printf(" %s %.3f", perf_event_names[e],
+                   total == 0 ? 0 : (double)sum.value[e] / total);
+            any = true;
+        } else {
+            printf(" %s n/a", perf_event_names[e]);
+        }
+    }
+    if (sum.valid[kPerfCycles] && sum.valid[kPerfInstructions] &&
+        sum.value[kPerfCycles] > 0) {
+        printf(", ipc %.2f",
+               (double)sum.value[kPerfInstructions] / sum.value[kPerfCycles]);
+    }
+    printf("\n");
+    if (sum.error != 0) {
+        printf("[%s] %s counters unavailable: %s\n", phase.c_str(),
+               any ? "some" : "all", strerror(sum.error));
+    }
+}
 
-    RetCode ret = Engine::Open(engine_path, &engine);
-    assert(ret == kSucc);
+// Every interval of the phase that just ended at |end| to the timeline
+// file, and the intervals whose throughput fell below half the median,
+// which is where to look for stalls. The last interval is cut short by
+// the end of the phase and left out of the count.
+void print_timeline(const std::string &phase, const Timeline &tl,
+                    uint64_t end) {
+    const double ticks_per_us = tsc_per_ns() * 1000;
+    const double interval_s = tl.interval() / (ticks_per_us * 1e6);
+    size_t full = (end - tl.start()) / tl.interval();
+    size_t n = std::max(tl.size(), full + 1);
+    for (size_t i = 0; timelineFile != NULL && i < n; ++i) {
+        fprintf(timelineFile, "%s,%.3f,%llu,%.0f,%.3f,%.3f,%.3f\n",
+                phase.c_str(), i * interval_s * 1000,
+                (unsigned long long)tl.ops(i), tl.ops(i) / interval_s,
+                tl.percentile(i, 50) / ticks_per_us,
+                tl.percentile(i, 99) / ticks_per_us,
+                tl.max(i) / ticks_per_us);
+    }
+    if (full == 0) return;
 
-    char v[5000];
-    gen_random(v, 4096);
-    for (int i = 0; i < KEY_SPACE; i += 100) {
-        uint64_t key = i;
-        PolarString k((char *)&key, sizeof(uint64_t));
-        engine->Write(k, v);
+    std::vector<uint64_t> ops;
+    for (size_t i = 0; i < full; ++i) ops.push_back(tl.ops(i));
+    std::vector<uint64_t> sorted = ops;
+    std::sort(sorted.begin(), sorted.end());
+    uint64_t median = sorted[full / 2];
+    size_t stalls = 0, worst = 0;
+    for (size_t i = 0; i < full; ++i) {
+        if (ops[i] * 2 < median) stalls++;
+        if (ops[i] < ops[worst]) worst = i;
     }
-    delete engine;
+    printf("[%s] timeline: %zu intervals of %.0fms, ops/s median %.0f min "
+           "%.0f at %.0fms, %zu below half the median\n",
+           phase.c_str(), full, interval_s * 1000, median / interval_s,
+           ops[worst] / interval_s, worst * interval_s * 1000, stalls);
+}
 
-    std::thread ths[MAX_THREAD];
+typedef void (*PhaseFn)(int id, zipf_gen_state zipf, ThreadStats *stats);
+
+struct PhaseResult {
+    double throughput;  // ops/s
+    Histogram latency;  // of every op type
+    uint64_t scans = 0;
+    uint64_t scanned = 0;  // records the scans returned
+};
 
+// Runs |fn| on every thread against the open engine, for cfg.duration if
+// |timed|, and reports the phase. Counts into |tl| if there is one.
+PhaseResult run_threads(const std::string &phase, PhaseFn fn, bool timed,
+                        FILE *csv, Timeline *tl) {
+    zipf_gen_state zipf = prepare_zipf(cfg.keys, insertedKeys);
+    std::vector<ThreadStats> stats(cfg.threads);
+    std::thread ths[MAX_THREAD];
+    stopRun = false;
     timespec s, e;
 
     clock_gettime(CLOCK_REALTIME, &s);
-    ret = Engine::Open(engine_path, &engine);
-    assert(ret == kSucc);
-    for (int i = 0; i < threadNR; ++i) {
-        ths[i] = std::thread(bench_thread, i);
+    timeline = tl;
+    for (int i = 0; i < cfg.threads; ++i) {
+        ths[i] = std::thread(fn, i, zipf, &stats[i]);
+    }
+    if (timed && cfg.duration > 0) {
+        std::this_thread::sleep_for(
+            std::chrono::duration<double>(cfg.duration));
+        stopRun = true;
     }
 
-    for (int i = 0; i < threadNR; ++i) {
+    uint64_t total = 0;
+    for (int i = 0; i < cfg.threads; ++i) {
         ths[i].join();
+        total += stats[i].ops;
     }
+    uint64_t end = asm_rdtsc();
     clock_gettime(CLOCK_REALTIME, &e);
+    timeline = NULL;
 
     double us = (e.tv_sec - s.tv_sec) * 1000000 +
                 (double)(e.tv_nsec - s.tv_nsec) / 1000;
-    printf("%d thread, %llu operations per thread, time: %lfus\n", threadNR,
-           OP_PER_THREAD, us);
-    printf("throughput %lf operations/s\n",
-           1ull * (threadNR * OP_PER_THREAD) * 1000000 / us);
+    printf("[%s] %d thread, %llu operations in total, time: %lfus\n",
+           phase.c_str(), cfg.threads, (unsigned long long)total, us);
+    printf("[%s] throughput %lf operations/s\n", phase.c_str(),
+           total * 1000000 / us);
+    if (cfg.perf && timed) print_perf(phase, stats, total);
+    if (tl != NULL) print_timeline(phase, *tl, end);
+    print_latency(phase, stats, csv);
+
+    PhaseResult result;
+    result.throughput = total * 1000000 / us;
+    for (auto &t : stats) {
+        for (auto &h : t.latency) result.latency.merge(h);
+        result.scans += t.latency[kOpScan].count();
+        result.scanned += t.scanned;
+    }
+    if (result.scans > 0) {
+        printf("[%s] scans: %llu, %.2f records per scan\n", phase.c_str(),
+               (unsigned long long)result.scans,
+               (double)result.scanned / result.scans);
+    }
+    if (result.scans > 0 && result.scanned == 0) {
+        // e.g. engine_race, whose Range is still a stub
+        printf("[%s] warning: no scan returned a record, so the scan "
+               "latencies time an engine that does not scan\n",
+               phase.c_str());
+    }
+    return result;
+}
+
+static double elapsed_ms(uint64_t from, uint64_t to) {
+    return (to - from) / (tsc_per_ns() * 1e6);
+}
 
+// What the engine counted since it was opened, and its slowest recent
+// operations if the library records them
+void print_stats(const std::string &phase) {
+    std::string stats;
+    RetCode ret = engine->GetProperty("polar.stats", &stats);
+    if (ret != kSucc) {
+        printf("[%s] engine statistics unavailable: %d\n", phase.c_str(), ret);
+        return;
+    }
+    std::istringstream lines(stats);
+    std::string line;
+    while (std::getline(lines, line)) {
+        printf("[%s] %s\n", phase.c_str(), line.c_str());
+    }
+    // Only in a library built with FLIGHT_RECORDER=1
+    std::string slow;
+    if (engine->GetProperty("polar.slow_ops", &slow) == kSucc) {
+        std::istringstream slow_lines(slow);
+        while (std::getline(slow_lines, line)) {
+            printf("[%s] %s\n", phase.c_str(), line.c_str());
+        }
+    }
+}
+
+// Opens the engine at |path|, runs the phase on it and closes it again.
+// Opening is reported on its own and is not part of the phase's time.
+PhaseResult run_phase(const std::string &phase, const std::string &path,
+                      PhaseFn fn, bool timed, FILE *csv) {
+    uint64_t start = asm_rdtsc();
+    RetCode ret = Engine::Open(path, cfg.options, &engine);
+    assert(ret == kSucc);
+    uint64_t opened = asm_rdtsc();
+    printf("[%s] open: %.3fms\n", phase.c_str(), elapsed_ms(start, opened));
+
+    // Starts once the engine is open, so the first interval is all ops
+    Timeline tl(opened, tsc_per_ns() * cfg.interval_ms * 1e6);
+    PhaseResult result = run_threads(phase, fn, timed, csv,
+                                     cfg.timeline.empty() ? NULL : &tl);
+    if (cfg.stats) print_stats(phase);
     delete engine;
+    engine = NULL;
+    return result;
+}
+
+// Offered against achieved load and the latency at each rate. Past the
+// knee the engine falls behind, and the latency keeps growing with the
+// length of the run.
+void print_sweep(const std::vector<PhaseResult> &results) {
+    const double ticks_per_us = tsc_per_ns() * 1000;
+    printf("\n%-12s %12s %10s %10s %10s %10s\n", "offered", "achieved",
+           "p50(us)", "p99", "p99.9", "max");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const PhaseResult &r = results[i];
+        printf("%-12.0f %12.0f %10.2f %10.2f %10.2f %10.2f%s\n",
+               cfg.sweep[i], r.throughput,
+               r.latency.percentile(50) / ticks_per_us,
+               r.latency.percentile(99) / ticks_per_us,
+               r.latency.percentile(99.9) / ticks_per_us,
+               r.latency.max() / ticks_per_us,
+               r.throughput < cfg.sweep[i] * 0.95 ? "  saturated" : "");
+    }
+}
+
+// Loads |path| with the preload, then runs the workload on it, at each
+// rate of a sweep
+std::vector<PhaseResult> run_workload(const std::string &name,
+                                      const std::string &path, FILE *csv) {
+    std::string prefix = name.empty() ? "" : name + "/";
+    std::vector<PhaseResult> results;
+    insertedKeys = 0;
+    if (cfg.preload > 0) {
+        run_phase(prefix + "load", path, load_thread, false, csv);
+    }
+    insertedKeys = cfg.preload;
+    if (cfg.sweep.empty()) {
+        results.push_back(
+            run_phase(prefix + "run", path, bench_thread, true, csv));
+    } else {
+        for (double rate : cfg.sweep) {
+            cfg.rate = rate;
+            char phase[64];
+            snprintf(phase, sizeof(phase), "run@%.0f", rate);
+            results.push_back(
+                run_phase(prefix + phase, path, bench_thread, true, csv));
+        }
+        print_sweep(results);
+    }
+    system((std::string("rm -rf ") + path).c_str());
+    return results;
+}
 
-    system((std::string("rm -rf ") + engine_path).c_str());
+// How this binary was built, next to Engine::BuildFlags() for the library
+static std::string bench_build() {
+    std::string s;
+#ifdef MOCK_NVM
+    s += "MOCK_NVM=1";
+#else
+    s += "MOCK_NVM=0";
+#endif
+#ifdef NDEBUG
+    s += " NDEBUG=1";
+#else
+    s += " NDEBUG=0";
+#endif
+#ifdef __OPTIMIZE__
+    s += " OPTIMIZE=1";
+#else
+    s += " OPTIMIZE=0";
+#endif
+    return s;
+}
+
+// Runs the workload cfg describes cfg.repeats times, then summarizes every
+// rate over the repeats: throughput as a mean with its 95% confidence
+// interval, latency percentiles of all the ops together and the spread of
+// p99 from run to run. |label| names the point in the grid, |workload| and
+// |dist| what it ran.
+void run_point(const std::string &label, const std::string &workload,
+               const std::string &dist, const std::string &path, FILE *csv,
+               ResultsFile *results, std::vector<std::string> *summary) {
+    std::vector<std::vector<PhaseResult>> runs;
+    for (int r = 0; r < cfg.repeats; ++r) {
+        std::string name = label;
+        if (cfg.repeats > 1) {
+            name += (name.empty() ? "rep" : "/rep") + std::to_string(r + 1);
+        }
+        runs.push_back(run_workload(name, path, csv));
+    }
+
+    const double ticks_per_us = tsc_per_ns() * 1000;
+    std::string engine = cfg.options.engine;
+    if (engine.empty() && !Engine::Engines().empty()) {
+        engine = Engine::Engines()[0];
+    }
+    for (size_t i = 0; i < runs[0].size(); ++i) {
+        std::vector<double> throughput, p99;
+        Histogram latency;
+        uint64_t scans = 0, scanned = 0;
+        for (auto &run : runs) {
+            throughput.push_back(run[i].throughput);
+            p99.push_back(run[i].latency.percentile(99) / ticks_per_us);
+            latency.merge(run[i].latency);
+            scans += run[i].scans;
+            scanned += run[i].scanned;
+        }
+        double rate = cfg.sweep.empty() ? cfg.rate : cfg.sweep[i];
+        Estimate ops(throughput), p99_us(p99);
+
+        char line[256];
+        std::string point = label.empty() ? "run" : label;
+        if (!cfg.sweep.empty()) point += "@" + std::to_string((long long)rate);
+        snprintf(line, sizeof(line),
+                 "%-32s %12.0f %10.0f %10.2f %10.2f %10.2f %10.2f%s",
+                 point.c_str(), ops.mean, ops.ci95,
+                 latency.percentile(50) / ticks_per_us,
+                 latency.percentile(99) / ticks_per_us, p99_us.ci95,
+                 latency.percentile(99.9) / ticks_per_us,
+                 scans > 0 && scanned == 0 ? "  scans empty" : "");
+        summary->push_back(line);
+
+        if (results == NULL) continue;
+        ResultRow row;
+        row.add("engine", engine);
+        row.add("workload", workload);
+        row.add("distribution", dist);
+        bool skewed = cfg.keys.dist == kZipf || cfg.keys.dist == kLatest;
+        row.add("theta", skewed ? cfg.keys.theta : 0);
+        row.add("read_ratio", cfg.mix.percent[kOpRead]);
+        row.add("threads", cfg.threads);
+        row.add("rate", rate);
+        row.add("repeats", cfg.repeats);
+        row.add("throughput", ops);
+        row.add("p50_us", latency.percentile(50) / ticks_per_us);
+        row.add("p99_us", latency.percentile(99) / ticks_per_us);
+        row.add("p999_us", latency.percentile(99.9) / ticks_per_us);
+        row.add("max_us", latency.max() / ticks_per_us);
+        row.add("run_p99_us", p99_us);
+        row.add("records_per_scan",
+                scans == 0 ? 0 : (double)scanned / scans);
+        row.add("engine_build", std::string(Engine::BuildFlags()));
+        row.add("bench_build", bench_build());
+        results->write(row);
+    }
+}
+
+// Writes keys 0 to |keys| - 1 in order from one thread of a child process,
+// which closes the engine at the end, or, if |crash|, is killed with
+// SIGKILL at a random write. Returns the writes that returned.
+static uint64_t load_in_child(const std::string &path, uint64_t keys,
+                              bool crash) {
+    void *shared = mmap(NULL, sizeof(std::atomic<uint64_t>),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    assert(shared != MAP_FAILED);
+    std::atomic<uint64_t> *written = new (shared) std::atomic<uint64_t>(0);
+    uint64_t rng = asm_rdtsc() | 1;
+    uint64_t kill_at = 1 + xorshift64(&rng) % keys;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        Engine *child = NULL;
+        if (Engine::Open(path, cfg.options, &child) != kSucc) _exit(1);
+        std::string pool = value_pool(cfg.preload_value_size.max());
+        std::vector<char> key(cfg.key_size);
+        for (uint64_t i = 0; i < keys; ++i) {
+            make_key(i, key.data(), cfg.key_size);
+            child->Write(PolarString(key.data(), cfg.key_size),
+                         PolarString(pool.data(),
+                                     cfg.preload_value_size.next(&rng)));
+            written->store(i + 1, std::memory_order_release);
+        }
+        delete child;
+        _exit(0);
+    }
+
+    int status = 0;
+    bool exited = false;
+    if (crash) {
+        // Checked every 100us, so the kill lands a few writes late; what
+        // counts is the number that returned
+        while (!exited && written->load(std::memory_order_acquire) < kill_at) {
+            exited = waitpid(pid, &status, WNOHANG) == pid;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        if (!exited) kill(pid, SIGKILL);
+    }
+    if (!exited) waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "loading %s failed\n", path.c_str());
+        exit(1);
+    }
+    uint64_t n = written->load();
+    munmap(shared, sizeof(std::atomic<uint64_t>));
+    return n;
+}
+
+struct RecoveryResult {
+    uint64_t written;    // keys the child wrote
+    double open_ms;      // in Engine::Open
+    double read_ms;      // from Open to the first read that found its key
+    double steady_ms;    // from Open to steady throughput
+    double steady_ops;   // the steady throughput, ops/s
+};
+
+// Throughput from the second half of the run is taken as steady, and
+// reached at the first interval from which the next five average at least
+// 90% of it
+static double steady_state(const Timeline &tl, double *steady_ops) {
+    const double interval_s = tl.interval() / (tsc_per_ns() * 1e9);
+    size_t full = tl.size() > 0 ? tl.size() - 1 : 0;  // the last is cut short
+    if (full == 0) {
+        *steady_ops = 0;
+        return 0;
+    }
+    std::vector<uint64_t> tail;
+    for (size_t i = full / 2; i < full; ++i) tail.push_back(tl.ops(i));
+    std::sort(tail.begin(), tail.end());
+    double steady = tail[tail.size() / 2];
+    *steady_ops = steady / interval_s;
+
+    const size_t window = 5;
+    for (size_t i = 0; i < full; ++i) {
+        size_t end = std::min(full, i + window);
+        double sum = 0;
+        for (size_t j = i; j < end; ++j) sum += tl.ops(j);
+        if (sum / (end - i) >= 0.9 * steady) return i * interval_s * 1000;
+    }
+    return full * interval_s * 1000;
+}
+
+// Loads |keys| keys, crashes or closes, then reopens the engine and runs
+// the mix on what was written for cfg.duration
+RecoveryResult run_recovery_round(const std::string &phase,
+                                  const std::string &path, uint64_t keys,
+                                  FILE *csv) {
+    RecoveryResult result;
+    result.written = load_in_child(path, keys, cfg.recovery == "kill");
+    printf("[%s] %s after %llu of %llu writes\n", phase.c_str(),
+           cfg.recovery == "kill" ? "killed" : "closed",
+           (unsigned long long)result.written, (unsigned long long)keys);
+
+    uint64_t start = asm_rdtsc();
+    RetCode ret = Engine::Open(path, cfg.options, &engine);
+    assert(ret == kSucc);
+    uint64_t opened = asm_rdtsc();
+
+    // Keys written before the crash, in random order, until one is found
+    uint64_t rng = asm_rdtsc() | 1;
+    std::vector<char> key(cfg.key_size);
+    std::string value;
+    uint64_t found = 0;
+    for (int tries = 0; result.written > 0 && tries < 1000; ++tries) {
+        make_key(xorshift64(&rng) % result.written, key.data(), cfg.key_size);
+        if (engine->Read(PolarString(key.data(), cfg.key_size), &value) ==
+            kSucc) {
+            found = asm_rdtsc();
+            break;
+        }
+    }
+    result.open_ms = elapsed_ms(start, opened);
+    result.read_ms = found == 0 ? -1 : elapsed_ms(start, found);
+
+    cfg.keys.key_space = cfg.preload = std::max<uint64_t>(1, result.written);
+    insertedKeys = cfg.preload;
+    Timeline tl(opened, tsc_per_ns() * cfg.interval_ms * 1e6);
+    run_threads(phase + "/run", bench_thread, true, csv, &tl);
+    if (cfg.stats) print_stats(phase);
+    delete engine;
+    engine = NULL;
+    system((std::string("rm -rf ") + path).c_str());
+
+    result.steady_ms = result.open_ms + steady_state(tl, &result.steady_ops);
+    printf("[%s] open %.3fms, first read %.3fms, steady %.0f ops/s at "
+           "%.1fms\n",
+           phase.c_str(), result.open_ms, result.read_ms, result.steady_ops,
+           result.steady_ms);
+    return result;
+}
+
+// Every size of cfg.recovery_keys, cfg.repeats times
+void run_recovery(const std::string &label, const std::string &path,
+                  FILE *csv, ResultsFile *results,
+                  std::vector<std::string> *summary) {
+    std::string engine = cfg.options.engine;
+    if (engine.empty() && !Engine::Engines().empty()) {
+        engine = Engine::Engines()[0];
+    }
+    for (uint64_t keys : cfg.recovery_keys) {
+        std::string point = (label.empty() ? "" : label + "/") + "recovery-" +
+                            cfg.recovery + "/" + std::to_string(keys);
+        std::vector<double> written, open, read, steady, steady_ops;
+        for (int r = 0; r < cfg.repeats; ++r) {
+            std::string phase = point;
+            if (cfg.repeats > 1) phase += "/rep" + std::to_string(r + 1);
+            RecoveryResult res = run_recovery_round(phase, path, keys, csv);
+            written.push_back(res.written);
+            open.push_back(res.open_ms);
+            read.push_back(res.read_ms);
+            steady.push_back(res.steady_ms);
+            steady_ops.push_back(res.steady_ops);
+        }
+        Estimate open_ms(open), read_ms(read), steady_ms(steady),
+            ops(steady_ops);
+
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "%-32s %12.0f %10.2f %10.2f %10.2f %10.2f %12.0f",
+                 point.c_str(), Estimate(written).mean, open_ms.mean,
+                 open_ms.ci95, read_ms.mean, steady_ms.mean, ops.mean);
+        summary->push_back(line);
+
+        if (results == NULL) continue;
+        ResultRow row;
+        row.add("engine", engine);
+        row.add("workload", "recovery-" + cfg.recovery);
+        row.add("keys", keys);
+        row.add("threads", cfg.threads);
+        row.add("read_ratio", cfg.mix.percent[kOpRead]);
+        row.add("repeats", cfg.repeats);
+        row.add("written", Estimate(written));
+        row.add("open_ms", open_ms);
+        row.add("first_read_ms", read_ms);
+        row.add("steady_ms", steady_ms);
+        row.add("steady_ops", ops);
+        row.add("engine_build", std::string(Engine::BuildFlags()));
+        row.add("bench_build", bench_build());
+        results->write(row);
+    }
+}
+
+// Path of a point in the grid, with only the dimensions that vary
+static std::string grid_label(const std::vector<std::string> &parts) {
+    std::string s;
+    for (auto &p : parts) {
+        if (!p.empty()) s += (s.empty() ? "" : "/") + p;
+    }
+    return s;
+}
+
+int main(int argc, char **argv) {
+    parseArgs(argc, argv);
+
+#ifdef MOCK_NVM
+    system("mkdir -p /tmp/ramdisk/data");
+    std::string engine_path =
+        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
+#else
+    std::string engine_path = "/dev/dax0.0";
+#endif
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    FILE *csv = NULL;
+    if (!cfg.latency_csv.empty()) {
+        csv = fopen(cfg.latency_csv.c_str(), "w");
+        if (csv == NULL) {
+            perror(cfg.latency_csv.c_str());
+        } else {
+            fprintf(csv, "phase,op,low_us,high_us,count,cumulative\n");
+        }
+    }
+    if (!cfg.timeline.empty()) {
+        timelineFile = fopen(cfg.timeline.c_str(), "w");
+        if (timelineFile == NULL) {
+            perror(cfg.timeline.c_str());
+        } else {
+            fprintf(timelineFile,
+                    "phase,start_ms,ops,ops_per_s,p50_us,p99_us,max_us\n");
+        }
+    }
+    std::unique_ptr<ResultsFile> results;
+    if (!cfg.results.empty()) results.reset(new ResultsFile(cfg.results));
+    tsc_per_ns();
+
+    // Every engine, workload, distribution, read ratio and thread count.
+    // Phases are named after the ones that vary. YCSB workloads bring
+    // their own distribution and mix.
+    std::vector<std::string> engines = cfg.engines;
+    if (engines.empty()) engines.push_back("");
+    std::vector<std::string> summary;
+    for (const std::string &e : engines) {
+        cfg.options.engine = e;
+        std::string engine = engines.size() > 1 ? e : "";
+        if (!engine.empty()) printf("\nengine %s\n", e.c_str());
+        auto each_thread_count = [&](const std::string &prefix,
+                                     const std::string &workload,
+                                     const std::string &dist) {
+            for (int t : cfg.thread_counts) {
+                cfg.threads = t;
+                std::string threads;
+                if (cfg.thread_counts.size() > 1) {
+                    threads = "t" + std::to_string(t);
+                }
+                run_point(grid_label({prefix, threads}), workload, dist,
+                          engine_path, csv, results.get(), &summary);
+            }
+        };
+        if (!cfg.recovery.empty()) {
+            run_recovery(engine, engine_path, csv, results.get(), &summary);
+            continue;
+        }
+        if (cfg.ycsb.empty()) {
+            for (const DistSpec &d : cfg.dists) {
+                cfg.keys.dist = d.dist;
+                cfg.keys.theta = d.theta;
+                for (int r : cfg.read_ratios) {
+                    cfg.read_ratio = r;
+                    set_mix();
+                    std::string dist, ratio;
+                    if (cfg.dists.size() > 1) dist = dist_label(d);
+                    if (cfg.read_ratios.size() > 1) {
+                        ratio = "r" + std::to_string(r);
+                    }
+                    each_thread_count(grid_label({engine, dist, ratio}),
+                                      "mix", key_dist_names[d.dist]);
+                }
+            }
+        }
+        for (const YcsbWorkload *w : cfg.ycsb) {
+            printf("\nworkload %s: %s\n", w->name, w->about);
+            cfg.mix = w->mix;
+            cfg.keys.dist = w->dist;
+            cfg.keys.scramble = true;
+            each_thread_count(
+                grid_label({engine, std::string("ycsb-") + w->name}),
+                std::string("ycsb-") + w->name, key_dist_names[w->dist]);
+        }
+    }
+
+    // Only worth a table when there is more than one run to compare
+    if (!cfg.recovery.empty()) {
+        printf("\n%-32s %12s %10s %10s %10s %10s %12s\n", "point",
+               "written", "open(ms)", "+-ci95", "1st read", "steady",
+               "steady ops/s");
+        for (auto &line : summary) printf("%s\n", line.c_str());
+    } else if (summary.size() > 1 || cfg.repeats > 1) {
+        printf("\n%-32s %12s %10s %10s %10s %10s %10s\n", "point", "ops/s",
+               "+-ci95", "p50(us)", "p99", "+-ci95", "p99.9");
+        for (auto &line : summary) printf("%s\n", line.c_str());
+    }
 
+    if (csv != NULL) fclose(csv);
+    if (timelineFile != NULL) fclose(timelineFile);
     return 0;
 }
@@ -1,10 +1,13 @@
 #ifndef __ASM_H__
 #define __ASM_H__
 
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <string>
+#include <thread>
+#include <time.h>
 
 inline void printf_(const std::string &s) {
     printf("\033[1;32;40m%s\033[0m\n", s.c_str());
@@ -16,6 +19,43 @@ inline unsigned long long asm_rdtsc(void) {
     return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
 }
 
+// rdtsc ticks per nanosecond, measured against the monotonic clock
+inline double calibrate_tsc() {
+    timespec s, e;
+    clock_gettime(CLOCK_MONOTONIC, &s);
+    unsigned long long t0 = asm_rdtsc();
+    double ns;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &e);
+        ns = (e.tv_sec - s.tv_sec) * 1e9 + (e.tv_nsec - s.tv_nsec);
+    } while (ns < 50e6);
+    return (asm_rdtsc() - t0) / ns;
+}
+
+// Calibrated on first use
+inline double tsc_per_ns() {
+    static const double rate = calibrate_tsc();
+    return rate;
+}
+
+// Returns once the TSC reaches |tsc|. Sleeps through most of long waits,
+// as a sleep can overshoot by a good part of 100us, and yields for the
+// rest, so the wakeup is on time without starving other threads that
+// share the core.
+inline void wait_tsc(unsigned long long tsc) {
+    for (;;) {
+        unsigned long long now = asm_rdtsc();
+        if (now >= tsc) return;
+        double ns = (tsc - now) / tsc_per_ns();
+        if (ns > 300000) {
+            std::this_thread::sleep_for(
+                std::chrono::nanoseconds((long long)ns - 200000));
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
 thread_local unsigned int rand_seed = asm_rdtsc();
 inline void gen_random(char *s, const int len) {
     static const char alphanum[] =
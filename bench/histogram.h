@@ -0,0 +1,108 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// Latency histogram in the style of HdrHistogram: values below 64 have a
+// bucket each, above that every power of two is cut into 64 buckets, so
+// any value is known to within 1/64 (1.6%) over the whole uint64 range
+// with a fixed 30KB of counters. Values are whatever the caller records,
+// usually rdtsc ticks; only the report converts them.
+//
+// Not thread safe: keep one per thread and merge them at the end.
+class Histogram {
+public:
+    static const int kSubBits = 6;
+    static const uint64_t kSub = 1ull << kSubBits;
+    static const int kBuckets = kSub + (64 - kSubBits) * kSub;
+
+    Histogram() { clear(); }
+
+    void clear() {
+        memset(counts_, 0, sizeof(counts_));
+        count_ = 0;
+        sum_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+    }
+
+    void record(uint64_t v) {
+        counts_[index(v)]++;
+        count_++;
+        sum_ += v;
+        min_ = std::min(min_, v);
+        max_ = std::max(max_, v);
+    }
+
+    void merge(const Histogram &other) {
+        for (int i = 0; i < kBuckets; ++i) counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ == 0 ? 0 : min_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ == 0 ? 0 : (double)sum_ / count_; }
+
+    // Smallest recorded value such that at least |p| percent of the values
+    // are not above it, to within the bucket width
+    uint64_t percentile(double p) const {
+        if (count_ == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100 * count_ + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, count_));
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(bucket_high(i), max_);
+        }
+        return max_;
+    }
+
+    // One "low,high,count,cumulative fraction" line per non-empty bucket,
+    // with values divided by |scale|
+    void write_csv(FILE *out, const char *label, double scale) const {
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            if (counts_[i] == 0) continue;
+            seen += counts_[i];
+            fprintf(out, "%s,%.3f,%.3f,%llu,%.9f\n", label,
+                    bucket_low(i) / scale, bucket_high(i) / scale,
+                    (unsigned long long)counts_[i], (double)seen / count_);
+        }
+    }
+
+private:
+    uint64_t counts_[kBuckets];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+
+    static int index(uint64_t v) {
+        if (v < kSub) return (int)v;
+        int e = 63 - __builtin_clzll(v);  // >= kSubBits
+        return kSub + (e - kSubBits) * kSub +
+               (int)((v >> (e - kSubBits)) - kSub);
+    }
+
+    static uint64_t bucket_low(int i) {
+        if (i < (int)kSub) return i;
+        int e = (i - kSub) / kSub + kSubBits;
+        uint64_t sub = (i - kSub) % kSub;
+        return (kSub + sub) << (e - kSubBits);
+    }
+
+    static uint64_t bucket_high(int i) {
+        if (i < (int)kSub) return i;
+        int e = (i - kSub) / kSub + kSubBits;
+        return bucket_low(i) + (1ull << (e - kSubBits)) - 1;
+    }
+};
+
+#endif /* __HISTOGRAM_H__ */
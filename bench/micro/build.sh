@@ -0,0 +1,5 @@
+#!/bin/bash
+
+# Build the library with both engines first:
+#   make TARGET_ENGINE="engine_example engine_race"
+g++ -std=c++11 -O2 -o micro -g -I../.. micro.cc -L../../lib -lengine -lpthread -DMOCK_NVM
@@ -0,0 +1,260 @@
+// Micro-benchmarks of the engines' hot-path kernels, each timed on its
+// own. Needs a library built with both engines:
+//
+//   make TARGET_ENGINE="engine_example engine_race"
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bench/micro/micro.h"
+#include "bench/workload.h"
+#include "bench/zipf.h"
+#include "engine_example/door_plate.h"
+#include "engine_example/util.h"
+#include "engine_race/BPlusTree.h"
+#include "include/polar_string.h"
+
+using namespace polar_race;
+
+namespace polar_race {
+namespace engine_race {
+// engine_race/util.h shares its include guard with engine_example's
+uint32_t StrHash(const char *s, int size);
+}  // namespace engine_race
+}  // namespace polar_race
+
+MicroConfig cfg;
+
+void usage() {
+    fprintf(stderr,
+            "Usage: ./micro [--flag=value ...] [filter]\n"
+            "\n"
+            "  filter           only kernels whose name contains it\n"
+            "  --reps=N         timed repetitions per kernel (15)\n"
+            "  --rep_ms=X       length of one repetition (20)\n"
+            "  --warmup_ms=X    warmup per kernel (100)\n");
+    exit(-1);
+}
+
+void parseArgs(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        if (strncmp(a, "--reps=", 7) == 0) {
+            cfg.reps = atoi(a + 7);
+        } else if (strncmp(a, "--rep_ms=", 9) == 0) {
+            cfg.rep_ms = atof(a + 9);
+        } else if (strncmp(a, "--warmup_ms=", 12) == 0) {
+            cfg.warmup_ms = atof(a + 12);
+        } else if (strncmp(a, "--", 2) == 0) {
+            usage();
+        } else {
+            cfg.filter = a;
+        }
+    }
+    if (cfg.reps <= 0 || cfg.rep_ms <= 0 || cfg.warmup_ms < 0) usage();
+}
+
+// |n| distinct keys of |size| bytes, in order
+static std::vector<std::string> make_keys(size_t n, int size) {
+    std::vector<std::string> keys(n, std::string(size, 0));
+    for (size_t i = 0; i < n; ++i) {
+        make_key(i * 2 + 1, &keys[i][0], size);
+    }
+    return keys;
+}
+
+// Lookups cycle through this many probe keys, a power of two
+static const size_t kProbes = 1024;
+
+// lower_bound over a full node, as bplus_tree does on every level
+void bench_node_search(MicroSuite *suite) {
+    using namespace b_plus_tree;
+    std::vector<std::string> keys = make_keys(childSize, 16);
+    std::vector<std::string> probes = make_keys(kProbes, 16);
+    static leafNode leaf;
+    static internalNode node;
+    for (int i = 0; i < childSize; ++i) {
+        memcpy(leaf.children[i].key, keys[i].data(), keys[i].size());
+        memcpy(node.children[i].key, keys[i].data(), keys[i].size());
+    }
+    leaf.n = node.n = childSize;
+
+    suite->run("node/leaf_lower_bound", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const std::string &p = probes[i & (kProbes - 1)];
+            keep(std::lower_bound(leaf.children, leaf.children + leaf.n,
+                                  PolarString(p)));
+        }
+    });
+    suite->run("node/internal_lower_bound", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            const std::string &p = probes[i & (kProbes - 1)];
+            keep(std::lower_bound(node.children, node.children + node.n,
+                                  PolarString(p)));
+        }
+    });
+}
+
+// Reading and writing whole nodes through the tree file, the way
+// bplus_tree moves every node in and out
+void bench_node_io(MicroSuite *suite) {
+    using namespace b_plus_tree;
+    std::string path = "/tmp/micro-btree-" + std::to_string(getpid());
+    // init reads the file before it creates one
+    FILE *f = fopen(path.c_str(), "w");
+    if (f != NULL) fclose(f);
+    bplus_tree tree;
+    if (f == NULL || tree.init(path.c_str()) != kSucc) {
+        fprintf(stderr, "can not create %s\n", path.c_str());
+        return;
+    }
+    static leafNode leaf;
+    static internalNode node;
+    off_t leaf_at = tree.getMeta().leaf_offset;
+    off_t node_at = tree.getMeta().root_offset;
+    tree.disk_read(&leaf, leaf_at);
+    tree.disk_read(&node, node_at);
+
+    suite->run("node/leaf_read", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) keep(tree.disk_read(&leaf, leaf_at));
+    });
+    suite->run("node/leaf_write", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tree.disk_write(&leaf, leaf_at));
+        }
+    });
+    suite->run("node/internal_read", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) keep(tree.disk_read(&node, node_at));
+    });
+    suite->run("node/internal_write", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            keep(tree.disk_write(&node, node_at));
+        }
+    });
+    unlink(path.c_str());
+}
+
+void bench_compare(MicroSuite *suite) {
+    for (int size : {8, 16, 64, 256}) {
+        std::string a(size, 'k'), b = a, c = a, e = a;
+        b[0] = 'a';         // differs at once
+        c[size - 1] = 'a';  // differs at the end
+        PolarString pa(a), pb(b), pc(c), pe(e);
+        std::string s = std::to_string(size);
+        suite->run("compare/equal_" + s, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                keep(pa);
+                keep(pa.compare(pe));
+            }
+        });
+        suite->run("compare/first_byte_" + s, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                keep(pa);
+                keep(pa.compare(pb));
+            }
+        });
+        suite->run("compare/last_byte_" + s, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                keep(pa);
+                keep(pa.compare(pc));
+            }
+        });
+    }
+}
+
+void bench_hash(MicroSuite *suite) {
+    for (int size : {8, 16, 32, 256}) {
+        std::vector<std::string> keys = make_keys(kProbes, size);
+        std::string s = std::to_string(size);
+        suite->run("hash/example_" + s, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                const std::string &k = keys[i & (kProbes - 1)];
+                keep(StrHash(k.data(), k.size()));
+            }
+        });
+        suite->run("hash/race_" + s, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                const std::string &k = keys[i & (kProbes - 1)];
+                keep(engine_race::StrHash(k.data(), k.size()));
+            }
+        });
+    }
+}
+
+// Stores the same location for every key
+class FixedWriter : public LocationWriter {
+public:
+    RetCode Write(const Location *current, Location *l) override {
+        *l = Location(1, 0, 100);
+        return kSucc;
+    }
+};
+
+// Hash and probe. Splits keep the load factor of a grown table near its
+// limit, so what changes with the size is mostly where the buckets sit in
+// the cache hierarchy; the smallest table has not split yet and is
+// lightly loaded.
+void bench_door_plate(MicroSuite *suite) {
+    for (size_t count : {1000, 100000, 2000000}) {
+        for (int size : {8, 16}) {  // inline and arena keys
+            DoorPlate plate;
+            if (plate.Init() != kSucc) return;
+            FixedWriter writer;
+            std::vector<std::string> keys = make_keys(count, size);
+            for (auto &k : keys) plate.AddOrUpdate(k, &writer);
+
+            // Probes in random order; misses fall between the keys
+            uint64_t rng = 88172645463325252ull;
+            std::vector<std::string> hits, misses;
+            for (size_t i = 0; i < kProbes; ++i) {
+                hits.push_back(keys[xorshift64(&rng) % count]);
+                std::string miss(size, 0);
+                make_key(xorshift64(&rng) % count * 2, &miss[0], size);
+                misses.push_back(miss);
+            }
+            std::string s = std::to_string(count) + "_keys_" +
+                            std::to_string(size) + "b";
+            Location l;
+            suite->run("door_plate/find_hit_" + s, [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    keep(plate.Find(hits[i & (kProbes - 1)], &l));
+                }
+            });
+            suite->run("door_plate/find_miss_" + s, [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    keep(plate.Find(misses[i & (kProbes - 1)], &l));
+                }
+            });
+        }
+    }
+}
+
+void bench_zipf(MicroSuite *suite) {
+    for (double theta : {0.0, 0.5, 0.99}) {
+        zipf_gen_state state;
+        mehcached_zipf_init(&state, 1000000, theta, 1);
+        char name[64];
+        snprintf(name, sizeof(name), "zipf/next_theta_%.2f", theta);
+        suite->run(name, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                keep(mehcached_zipf_next(&state));
+            }
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    parseArgs(argc, argv);
+    MicroSuite suite(cfg);
+    bench_node_search(&suite);
+    bench_node_io(&suite);
+    bench_compare(&suite);
+    bench_hash(&suite);
+    bench_door_plate(&suite);
+    bench_zipf(&suite);
+    return 0;
+}
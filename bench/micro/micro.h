@@ -0,0 +1,87 @@
+#ifndef __MICRO_H__
+#define __MICRO_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bench/bench_util.h"
+
+// Keeps |v| alive, and whatever computed it, without the compiler seeing
+// what happens to it
+template <class T>
+inline void keep(const T &v) {
+    __asm__ __volatile__("" : : "g"(v) : "memory");
+}
+
+struct MicroConfig {
+    std::string filter;     // only kernels whose name contains this
+    double warmup_ms = 100;  // per kernel, before anything is measured
+    double rep_ms = 20;      // length of one repetition
+    int reps = 15;
+};
+
+// Runs kernels and reports ns/op and TSC cycles/op for each.
+//
+// A kernel is a callable taking the number of ops to run, so the loop and
+// the choice of inputs are its own. It is run for the warmup time first,
+// which also sizes a repetition to about rep_ms, then timed over reps
+// repetitions; the report gives the median, the median absolute
+// deviation as a share of it, and the fastest repetition. TSC cycles tick
+// at the nominal frequency, which is the core clock only with turbo and
+// frequency scaling off.
+class MicroSuite {
+public:
+    explicit MicroSuite(const MicroConfig &config) : config_(config) {
+        tsc_per_ns();
+        printf("%-36s %10s %8s %10s %12s\n", "kernel", "ns/op", "+-mad",
+               "min ns/op", "tsc cyc/op");
+    }
+
+    template <class F>
+    void run(const std::string &name, F &&kernel) {
+        if (name.find(config_.filter) == std::string::npos) return;
+
+        // Warm up, doubling the ops until one call is long enough to time
+        uint64_t n = 1;
+        double warm = 0, ns = 0;
+        while (warm < config_.warmup_ms * 1e6) {
+            ns = time_ns(kernel, n);
+            warm += ns;
+            if (ns < 1e6) n *= 2;
+        }
+        n = std::max<uint64_t>(1, n * (config_.rep_ms * 1e6 / ns));
+
+        std::vector<double> per_op;
+        for (int r = 0; r < config_.reps; ++r) {
+            per_op.push_back(time_ns(kernel, n) / n);
+        }
+        std::sort(per_op.begin(), per_op.end());
+        double median = per_op[per_op.size() / 2];
+        std::vector<double> dev;
+        for (double v : per_op) dev.push_back(std::fabs(v - median));
+        std::sort(dev.begin(), dev.end());
+        double mad = dev[dev.size() / 2];
+
+        printf("%-36s %10.2f %7.1f%% %10.2f %12.1f\n", name.c_str(), median,
+               100 * mad / median, per_op[0], median * tsc_per_ns());
+        fflush(stdout);
+    }
+
+private:
+    MicroConfig config_;
+
+    template <class F>
+    static double time_ns(F &kernel, uint64_t n) {
+        auto start = std::chrono::steady_clock::now();
+        kernel(n);
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - start).count();
+    }
+};
+
+#endif /* __MICRO_H__ */
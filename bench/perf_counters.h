@@ -0,0 +1,137 @@
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+enum PerfEvent {
+    kPerfCycles,
+    kPerfInstructions,
+    kPerfLLCMisses,
+    kPerfDTLBMisses,
+    kPerfContextSwitches,
+    kPerfEvents
+};
+static const char *const perf_event_names[kPerfEvents] = {
+    "cycles", "instructions", "llc-misses", "dtlb-misses", "ctx-switches"};
+
+// Counts of one thread, or summed over threads
+struct PerfCounts {
+    uint64_t value[kPerfEvents];
+    bool valid[kPerfEvents];  // the event could be counted everywhere
+    int error;                // errno of the first event that could not
+
+    PerfCounts() : error(0) {
+        for (int e = 0; e < kPerfEvents; ++e) {
+            value[e] = 0;
+            valid[e] = false;
+        }
+    }
+
+    void merge(const PerfCounts &other, bool first) {
+        for (int e = 0; e < kPerfEvents; ++e) {
+            value[e] += other.value[e];
+            valid[e] = (first || valid[e]) && other.valid[e];
+        }
+        if (error == 0) error = other.error;
+    }
+};
+
+// Counts events of the calling thread between start() and stop(), through
+// perf_event_open. Events the kernel or the machine will not count, e.g.
+// hardware events in a VM or with a strict perf_event_paranoid, are left
+// out and come back invalid; the rest still work. Kernel time is counted
+// when allowed. Counts are scaled up if the kernel had to multiplex.
+class PerfCounters {
+public:
+    PerfCounters() {
+        for (int e = 0; e < kPerfEvents; ++e) fd_[e] = -1;
+    }
+
+    ~PerfCounters() {
+        for (int e = 0; e < kPerfEvents; ++e) {
+            if (fd_[e] >= 0) close(fd_[e]);
+        }
+    }
+
+    void start() {
+        for (int e = 0; e < kPerfEvents; ++e) {
+            fd_[e] = open_event((PerfEvent)e);
+            if (fd_[e] < 0 && counts_.error == 0) counts_.error = errno;
+        }
+        for (int e = 0; e < kPerfEvents; ++e) {
+            if (fd_[e] < 0) continue;
+            ioctl(fd_[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    PerfCounts stop() {
+        for (int e = 0; e < kPerfEvents; ++e) {
+            if (fd_[e] >= 0) ioctl(fd_[e], PERF_EVENT_IOC_DISABLE, 0);
+        }
+        for (int e = 0; e < kPerfEvents; ++e) {
+            uint64_t v[3];  // value, time enabled, time running
+            if (fd_[e] < 0 || read(fd_[e], v, sizeof(v)) != sizeof(v)) {
+                continue;
+            }
+            counts_.value[e] =
+                v[2] == 0 ? 0 : (uint64_t)((double)v[0] * v[1] / v[2]);
+            counts_.valid[e] = true;
+        }
+        return counts_;
+    }
+
+private:
+    int fd_[kPerfEvents];
+    PerfCounts counts_;
+
+    static int open_event(PerfEvent event) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (event) {
+            case kPerfCycles:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case kPerfInstructions:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case kPerfLLCMisses:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                break;
+            case kPerfDTLBMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            default:
+                attr.type = PERF_TYPE_SOFTWARE;
+                attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+                break;
+        }
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+            // Not allowed to count the kernel, try user space alone
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        return fd;
+    }
+};
+
+#endif /* __PERF_COUNTERS_H__ */
@@ -0,0 +1,137 @@
+#ifndef __RESULTS_H__
+#define __RESULTS_H__
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Mean of repeated measurements with a 95% confidence interval, from the
+// t distribution since there are only a few of them
+struct Estimate {
+    double mean = 0;
+    double stddev = 0;
+    double ci95 = 0;  // half width; 0 with fewer than two measurements
+
+    explicit Estimate(const std::vector<double> &v) {
+        if (v.empty()) return;
+        for (double x : v) mean += x;
+        mean /= v.size();
+        if (v.size() < 2) return;
+        double ss = 0;
+        for (double x : v) ss += (x - mean) * (x - mean);
+        stddev = std::sqrt(ss / (v.size() - 1));
+        ci95 = t975(v.size() - 1) * stddev / std::sqrt((double)v.size());
+    }
+
+    // 97.5th percentile of Student's t with |df| degrees of freedom
+    static double t975(size_t df) {
+        static const double t[] = {12.706, 4.303, 3.182, 2.776, 2.571,
+                                   2.447,  2.365, 2.306, 2.262, 2.228,
+                                   2.201,  2.179, 2.160, 2.145, 2.131,
+                                   2.120,  2.110, 2.101, 2.093, 2.086};
+        if (df == 0) return 0;
+        if (df <= sizeof(t) / sizeof(t[0])) return t[df - 1];
+        return df <= 30 ? 2.042 : df <= 60 ? 2.000 : 1.960;
+    }
+};
+
+// One row of results: what was run, as ordered name/value pairs, and what
+// came out of it
+class ResultRow {
+public:
+    void add(const std::string &name, const std::string &value) {
+        fields_.push_back(Field{name, value, true});
+    }
+    void add(const std::string &name, double value) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.6g", value);
+        fields_.push_back(Field{name, buf, false});
+    }
+    void add(const std::string &name, const Estimate &e) {
+        add(name + "_mean", e.mean);
+        add(name + "_stddev", e.stddev);
+        add(name + "_ci95_low", e.mean - e.ci95);
+        add(name + "_ci95_high", e.mean + e.ci95);
+    }
+
+private:
+    friend class ResultsFile;
+    struct Field {
+        std::string name;
+        std::string value;
+        bool quoted;
+    };
+    std::vector<Field> fields_;
+};
+
+// Rows written as CSV, one line each under a header, or, for a path ending
+// in .json, as a JSON array of flat objects. Every row should have the
+// same fields, in the same order.
+class ResultsFile {
+public:
+    explicit ResultsFile(const std::string &path)
+        : json_(path.size() >= 5 &&
+                path.compare(path.size() - 5, 5, ".json") == 0) {
+        out_ = fopen(path.c_str(), "w");
+        if (out_ == NULL) perror(path.c_str());
+    }
+
+    ~ResultsFile() {
+        if (out_ == NULL) return;
+        if (json_) fprintf(out_, rows_ == 0 ? "[]\n" : "\n]\n");
+        fclose(out_);
+    }
+
+    void write(const ResultRow &row) {
+        if (out_ == NULL) return;
+        if (json_) {
+            fprintf(out_, rows_ == 0 ? "[\n  {" : ",\n  {");
+            for (size_t i = 0; i < row.fields_.size(); ++i) {
+                const ResultRow::Field &f = row.fields_[i];
+                fprintf(out_, "%s\"%s\": ", i == 0 ? "" : ", ",
+                        f.name.c_str());
+                if (f.quoted) {
+                    fprintf(out_, "\"%s\"", escape(f.value, '"').c_str());
+                } else {
+                    fprintf(out_, "%s", f.value.c_str());
+                }
+            }
+            fprintf(out_, "}");
+        } else {
+            if (rows_ == 0) {
+                for (size_t i = 0; i < row.fields_.size(); ++i) {
+                    fprintf(out_, "%s%s", i == 0 ? "" : ",",
+                            row.fields_[i].name.c_str());
+                }
+                fprintf(out_, "\n");
+            }
+            for (size_t i = 0; i < row.fields_.size(); ++i) {
+                const ResultRow::Field &f = row.fields_[i];
+                fprintf(out_, "%s%s", i == 0 ? "" : ",",
+                        f.quoted ? ("\"" + escape(f.value, '"') + "\"").c_str()
+                                 : f.value.c_str());
+            }
+            fprintf(out_, "\n");
+        }
+        fflush(out_);
+        rows_++;
+    }
+
+private:
+    FILE *out_;
+    bool json_;
+    size_t rows_ = 0;
+
+    // JSON escapes quotes with a backslash, CSV by doubling them
+    std::string escape(const std::string &s, char quote) const {
+        std::string r;
+        for (char c : s) {
+            if (c == quote || (json_ && c == '\\')) r += json_ ? '\\' : quote;
+            r += c;
+        }
+        return r;
+    }
+};
+
+#endif /* __RESULTS_H__ */
@@ -0,0 +1,179 @@
+#ifndef __TIMELINE_H__
+#define __TIMELINE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Completed ops and their latency per fixed interval of a phase, e.g. every
+// 10ms, to show stalls an average over the whole run hides.
+//
+// Intervals are shared by every thread and only ever added to with
+// relaxed atomics. A thread counts into its own TimelineCursor and adds
+// that to the shared interval when it moves on to the next one, so the
+// cost per op stays a compare and a few local increments, and the shared
+// counters see one flush per thread per interval. An interval in which no
+// op finished stays zero, which is exactly a stall.
+//
+// Latencies go into coarse histograms, four buckets per power of two
+// (within 25%), which is enough to see p99 move from one interval to the
+// next at 1KB an interval. Intervals are allocated in chunks as the phase
+// reaches them.
+class Timeline {
+public:
+    static const int kSubBits = 2;
+    static const uint64_t kSub = 1ull << kSubBits;
+    static const int kMaxBits = 40;  // latencies clamp to 2^40 ticks
+    static const int kBuckets = kSub + (kMaxBits - kSubBits) * kSub;
+
+    struct Interval {
+        std::atomic<uint64_t> ops;
+        std::atomic<uint64_t> max;
+        std::atomic<uint32_t> counts[kBuckets];
+    };
+
+    // Buckets of one thread's current interval
+    struct Cursor {
+        uint64_t index = 0;  // of the interval
+        uint64_t end = 0;    // tsc at which it ends
+        uint64_t ops = 0;
+        uint64_t max = 0;
+        uint32_t counts[kBuckets];
+
+        Cursor() { memset(counts, 0, sizeof(counts)); }
+    };
+
+    Timeline(uint64_t start_tsc, uint64_t interval_ticks)
+        : start_(start_tsc), interval_(interval_ticks), intervals_(0) {
+        for (int i = 0; i < kChunks; ++i) chunks_[i] = NULL;
+    }
+
+    ~Timeline() {
+        for (int i = 0; i < kChunks; ++i) delete[] chunks_[i].load();
+    }
+
+    uint64_t start() const { return start_; }
+    uint64_t interval() const { return interval_; }
+
+    // An op that finished at |now| after |latency| ticks
+    void record(Cursor *c, uint64_t now, uint64_t latency) {
+        if (now >= c->end) move(c, now);
+        c->ops++;
+        c->max = std::max(c->max, latency);
+        c->counts[index(latency)]++;
+    }
+
+    // Adds what |c| holds to the shared interval
+    void flush(Cursor *c) {
+        if (c->ops == 0) return;
+        Interval *in = get(c->index);
+        if (in != NULL) {
+            in->ops.fetch_add(c->ops, std::memory_order_relaxed);
+            uint64_t max = in->max.load(std::memory_order_relaxed);
+            while (max < c->max &&
+                   !in->max.compare_exchange_weak(max, c->max,
+                                                  std::memory_order_relaxed)) {
+            }
+            for (int i = 0; i < kBuckets; ++i) {
+                if (c->counts[i] == 0) continue;
+                in->counts[i].fetch_add(c->counts[i],
+                                        std::memory_order_relaxed);
+                c->counts[i] = 0;
+            }
+        }
+        c->ops = 0;
+        c->max = 0;
+    }
+
+    // Intervals up to the last one any op finished in. Only once every
+    // thread has flushed.
+    size_t size() const { return intervals_.load(); }
+
+    uint64_t ops(size_t i) const {
+        const Interval *in = peek(i);
+        return in == NULL ? 0 : in->ops.load();
+    }
+
+    // Of the latencies in interval |i|, to within a bucket
+    uint64_t percentile(size_t i, double p) const {
+        const Interval *in = peek(i);
+        if (in == NULL || in->ops.load() == 0) return 0;
+        uint64_t total = in->ops.load();
+        uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total));
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            seen += in->counts[b].load();
+            if (seen >= rank) return std::min(bucket_high(b), in->max.load());
+        }
+        return in->max.load();
+    }
+
+    uint64_t max(size_t i) const {
+        const Interval *in = peek(i);
+        return in == NULL ? 0 : in->max.load();
+    }
+
+private:
+    static const int kChunkBits = 8;
+    static const int kChunks = 4096;  // 1M intervals, 3 hours at 10ms
+
+    const uint64_t start_;
+    const uint64_t interval_;
+    std::atomic<size_t> intervals_;
+    std::atomic<Interval *> chunks_[kChunks];
+
+    void move(Cursor *c, uint64_t now) {
+        flush(c);
+        c->index = now < start_ ? 0 : (now - start_) / interval_;
+        c->end = start_ + (c->index + 1) * interval_;
+    }
+
+    // NULL past the last chunk
+    Interval *get(uint64_t i) {
+        uint64_t chunk = i >> kChunkBits;
+        if (chunk >= kChunks) return NULL;
+        Interval *p = chunks_[chunk].load(std::memory_order_acquire);
+        if (p == NULL) {
+            // Value-initialized, so every counter starts at zero
+            Interval *fresh = new Interval[1 << kChunkBits]();
+            if (chunks_[chunk].compare_exchange_strong(p, fresh)) {
+                p = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        size_t n = intervals_.load(std::memory_order_relaxed);
+        while (n < i + 1 && !intervals_.compare_exchange_weak(n, i + 1)) {
+        }
+        return &p[i & ((1 << kChunkBits) - 1)];
+    }
+
+    const Interval *peek(size_t i) const {
+        uint64_t chunk = i >> kChunkBits;
+        if (chunk >= kChunks) return NULL;
+        const Interval *p = chunks_[chunk].load(std::memory_order_acquire);
+        return p == NULL ? NULL : &p[i & ((1 << kChunkBits) - 1)];
+    }
+
+    static int index(uint64_t v) {
+        if (v < kSub) return (int)v;
+        int e = 63 - __builtin_clzll(v);
+        if (e >= kMaxBits) return kBuckets - 1;
+        return kSub + (e - kSubBits) * kSub +
+               (int)((v >> (e - kSubBits)) - kSub);
+    }
+
+    static uint64_t bucket_high(int i) {
+        if (i < (int)kSub) return i;
+        int e = (i - kSub) / kSub + kSubBits;
+        uint64_t sub = (i - kSub) % kSub;
+        return ((kSub + sub + 1) << (e - kSubBits)) - 1;
+    }
+};
+
+#endif /* __TIMELINE_H__ */
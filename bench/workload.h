@@ -0,0 +1,314 @@
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "zipf.h"
+
+// Key ids become keys of any size: the id in big-endian order, so that
+// keys sort like their ids, cut to the key size or padded with '0'.
+inline void make_key(uint64_t id, char *buf, int key_size) {
+    char be[8];
+    for (int i = 0; i < 8; ++i) {
+        be[i] = (char)(id >> (56 - 8 * i));
+    }
+    if (key_size <= 8) {
+        memcpy(buf, be + 8 - key_size, key_size);
+    } else {
+        memcpy(buf, be, 8);
+        memset(buf + 8, '0', key_size - 8);
+    }
+}
+
+// Largest number of distinct ids make_key can tell apart
+inline uint64_t max_key_space(int key_size) {
+    return key_size >= 8 ? UINT64_MAX : (1ull << (8 * key_size));
+}
+
+// FNV-1a over the 8 bytes of |v|
+inline uint64_t fnv_hash64(uint64_t v) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < 8; ++i) {
+        h = (h ^ (v & 0xff)) * 0x100000001b3ull;
+        v >>= 8;
+    }
+    return h;
+}
+
+inline uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Time to the next arrival, averaging |mean|: exponential for a Poisson
+// process, otherwise always |mean|
+inline double arrival_gap(double mean, bool poisson, uint64_t *rng) {
+    if (!poisson) return mean;
+    double u = (xorshift64(rng) >> 11) * (1.0 / (1ull << 53));
+    return -std::log(1 - u) * mean;
+}
+
+// Value sizes, from a spec:
+//   fixed:N (or just N)  every value is N bytes
+//   uniform:A-B          uniform in [A, B]
+//   hist:PATH            lines of "size weight", weight defaults to 1
+class ValueSizeGen {
+public:
+    bool parse(const std::string &spec, std::string *err) {
+        sizes_.clear();
+        cumulative_.clear();
+        std::string arg = spec;
+        std::string kind = "fixed";
+        size_t colon = spec.find(':');
+        if (colon != std::string::npos) {
+            kind = spec.substr(0, colon);
+            arg = spec.substr(colon + 1);
+        }
+        if (kind == "fixed") {
+            char *end;
+            long n = strtol(arg.c_str(), &end, 10);
+            if (arg.empty() || *end != 0 || n < 0) {
+                *err = "bad fixed value size: " + arg;
+                return false;
+            }
+            add(n, 1);
+        } else if (kind == "uniform") {
+            long lo, hi;
+            if (sscanf(arg.c_str(), "%ld-%ld", &lo, &hi) != 2 || lo < 0 ||
+                hi < lo) {
+                *err = "bad uniform value size range: " + arg;
+                return false;
+            }
+            lo_ = lo;
+            hi_ = hi;
+            uniform_ = true;
+            return true;
+        } else if (kind == "hist") {
+            std::ifstream in(arg.c_str());
+            if (!in) {
+                *err = "can not open value size histogram: " + arg;
+                return false;
+            }
+            std::string line;
+            while (std::getline(in, line)) {
+                if (line.empty() || line[0] == '#') continue;
+                std::istringstream fields(line);
+                long size;
+                double weight = 1;
+                if (!(fields >> size) || size < 0) {
+                    *err = "bad histogram line: " + line;
+                    return false;
+                }
+                fields >> weight;
+                if (weight > 0) add(size, weight);
+            }
+            if (sizes_.empty()) {
+                *err = "empty value size histogram: " + arg;
+                return false;
+            }
+        } else {
+            *err = "unknown value size distribution: " + kind;
+            return false;
+        }
+        uniform_ = false;
+        return true;
+    }
+
+    size_t next(uint64_t *rng) const {
+        if (uniform_) {
+            return lo_ + xorshift64(rng) % (hi_ - lo_ + 1);
+        }
+        if (sizes_.size() == 1) {
+            return sizes_[0];
+        }
+        double u = (xorshift64(rng) >> 11) * (1.0 / (1ull << 53)) *
+                   cumulative_.back();
+        size_t i = std::upper_bound(cumulative_.begin(), cumulative_.end(),
+                                    u) -
+                   cumulative_.begin();
+        return sizes_[std::min(i, sizes_.size() - 1)];
+    }
+
+    size_t max() const {
+        return uniform_ ? hi_ : *std::max_element(sizes_.begin(), sizes_.end());
+    }
+
+private:
+    bool uniform_ = false;
+    size_t lo_ = 0, hi_ = 0;
+    std::vector<size_t> sizes_;
+    std::vector<double> cumulative_;
+
+    void add(size_t size, double weight) {
+        sizes_.push_back(size);
+        cumulative_.push_back((cumulative_.empty() ? 0 : cumulative_.back()) +
+                              weight);
+    }
+};
+
+enum KeyDist { kUniform, kZipf, kLatest, kSequential, kHotspot };
+static const char *const key_dist_names[] = {"uniform", "zipf", "latest",
+                                             "sequential", "hotspot"};
+
+inline bool parse_key_dist(const std::string &name, KeyDist *dist) {
+    for (int i = 0; i < 5; ++i) {
+        if (name == key_dist_names[i]) {
+            *dist = (KeyDist)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct KeyDistConfig {
+    KeyDist dist = kUniform;
+    uint64_t key_space = 0;
+    double theta = 0.99;             // zipf and latest
+    double hot_fraction = 0.2;       // hotspot: share of the key space...
+    double hot_op_fraction = 0.8;    // ...that gets this share of the ops
+    bool scramble = false;           // zipf: hash ranks over the key space,
+                                     // so hot keys are not neighbours
+};
+
+// Zipf state shared by the threads, with the zeta sum, which takes time
+// linear in the key space, already worked out
+inline zipf_gen_state prepare_zipf(const KeyDistConfig &config,
+                                   uint64_t inserted) {
+    double theta =
+        config.dist == kZipf || config.dist == kLatest ? config.theta : 0;
+    uint64_t n = config.dist == kLatest ? std::max<uint64_t>(inserted, 1)
+                                        : config.key_space;
+    zipf_gen_state state;
+    mehcached_zipf_init(&state, n, theta, 0);
+    mehcached_zipf_next(&state);
+    return state;
+}
+
+// Picks key ids for one thread. For the latest distribution, |inserted|
+// counts the keys written so far by every thread; writes append new keys
+// and reads favour the most recent ones.
+class KeyChooser {
+public:
+    KeyChooser(const KeyDistConfig &config, const zipf_gen_state &zipf,
+               int id, int threads, std::atomic<uint64_t> *inserted,
+               uint64_t seed)
+        : config_(config), inserted_(inserted), rng_(seed | 1) {
+        mehcached_zipf_init_copy(&zipf_, &zipf, seed & ((1ull << 48) - 1));
+        next_seq_ = config.key_space / threads * id;
+    }
+
+    uint64_t next_read() {
+        switch (config_.dist) {
+            case kSequential:
+                return next_sequential();
+            case kHotspot:
+                return next_hotspot();
+            case kLatest: {
+                uint64_t latest = std::max<uint64_t>(inserted_->load(), 1);
+                mehcached_zipf_change_n(&zipf_, latest);
+                return latest - 1 - std::min(mehcached_zipf_next(&zipf_),
+                                             latest - 1);
+            }
+            case kZipf:
+                if (config_.scramble) {
+                    return fnv_hash64(mehcached_zipf_next(&zipf_)) %
+                           config_.key_space;
+                }
+                return mehcached_zipf_next(&zipf_);
+            default:
+                return mehcached_zipf_next(&zipf_);
+        }
+    }
+
+    // A key nobody has written yet
+    uint64_t next_insert() { return inserted_->fetch_add(1); }
+
+private:
+    KeyDistConfig config_;
+    std::atomic<uint64_t> *inserted_;
+    zipf_gen_state zipf_;
+    uint64_t rng_;
+    uint64_t next_seq_;
+
+    uint64_t next_sequential() {
+        uint64_t id = next_seq_ % config_.key_space;
+        next_seq_ = id + 1;
+        return id;
+    }
+
+    uint64_t next_hotspot() {
+        uint64_t hot = std::max<uint64_t>(
+            1, (uint64_t)(config_.key_space * config_.hot_fraction));
+        hot = std::min(hot, config_.key_space);
+        double u = (xorshift64(&rng_) >> 11) * (1.0 / (1ull << 53));
+        if (u < config_.hot_op_fraction || hot == config_.key_space) {
+            return xorshift64(&rng_) % hot;
+        }
+        return hot + xorshift64(&rng_) % (config_.key_space - hot);
+    }
+};
+
+enum OpType {
+    kOpRead,
+    kOpUpdate,
+    kOpInsert,
+    kOpScan,
+    kOpReadModifyWrite,
+    kOpTypes
+};
+static const char *const op_names[kOpTypes] = {"read", "update", "insert",
+                                               "scan", "rmw"};
+
+// Share of each kind of operation, in percent
+struct OpMix {
+    int percent[kOpTypes];
+
+    // |r| is uniform in [0, 100)
+    OpType pick(int r) const {
+        for (int op = 0; op < kOpTypes; ++op) {
+            r -= percent[op];
+            if (r < 0) return (OpType)op;
+        }
+        return kOpRead;
+    }
+};
+
+// The YCSB core workloads. Every one loads the whole key space first;
+// scans cover 1 to max_scan keys, uniformly.
+struct YcsbWorkload {
+    const char *name;
+    const char *about;
+    KeyDist dist;
+    OpMix mix;  // read, update, insert, scan, rmw
+};
+
+static const YcsbWorkload ycsb_workloads[] = {
+    {"a", "update heavy", kZipf, {{50, 50, 0, 0, 0}}},
+    {"b", "read mostly", kZipf, {{95, 5, 0, 0, 0}}},
+    {"c", "read only", kZipf, {{100, 0, 0, 0, 0}}},
+    {"d", "read latest", kLatest, {{95, 0, 5, 0, 0}}},
+    {"e", "short ranges", kZipf, {{0, 0, 5, 95, 0}}},
+    {"f", "read-modify-write", kZipf, {{50, 0, 0, 0, 50}}},
+};
+
+inline const YcsbWorkload *find_ycsb_workload(const std::string &name) {
+    for (const YcsbWorkload &w : ycsb_workloads) {
+        if (name == w.name) return &w;
+    }
+    return NULL;
+}
+
+#endif /* __WORKLOAD_H__ */
@@ -0,0 +1,271 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+#include "util.h"
+
+namespace polar_race {
+
+static const uint64_t kCheckpointMagic = 0x3154504b43524c50ull;  // PLRCKPT1
+static const uint32_t kCheckpointVersion = 1;
+static const uint64_t kPageSize = 4096;
+
+struct CheckpointHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t file_size;
+    uint64_t table_size;  // section table plus chunk crcs
+    uint32_t table_crc;
+    uint32_t header_crc;  // covers the fields above
+};
+
+struct SectionEntry {
+    uint32_t id;
+    uint32_t chunk_count;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t chunk_size;
+    uint64_t crc_offset;  // relative to the start of the section table
+};
+
+static uint64_t PageAlign(uint64_t n) {
+    return (n + kPageSize - 1) & ~(kPageSize - 1);
+}
+
+static bool IsZero(const char* p, uint64_t n) {
+    return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+bool CheckpointSection::VerifyChunk(uint64_t chunk) {
+    std::atomic<uint8_t>& state = (*state_)[chunk];
+    uint8_t expected = state.load(std::memory_order_relaxed);
+    if (expected != kChunkUnknown) {
+        return expected == kChunkGood;
+    }
+    uint64_t begin = chunk * chunk_size_;
+    uint64_t len = std::min(chunk_size_, size_ - begin);
+    // A chunk is only modified once some thread found it good, so a
+    // mismatch seen while it is still unknown is real corruption. The
+    // first thread to decide wins, and the others take its verdict.
+    const bool good = Crc32c(data_ + begin, len) == crcs_[chunk];
+    if (!state.compare_exchange_strong(
+            expected, static_cast<uint8_t>(good ? kChunkGood : kChunkBad),
+            std::memory_order_relaxed)) {
+        return expected == kChunkGood;
+    }
+    if (!good) {
+        std::cerr << "checkpoint chunk " << chunk << " is corrupted"
+                  << std::endl;
+    }
+    return good;
+}
+
+CheckpointReader::~CheckpointReader() { Close(); }
+
+RetCode CheckpointReader::Open(const std::string& path) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? kNotFound : kIOError;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<uint64_t>(st.st_size) < sizeof(CheckpointHeader)) {
+        close(fd);
+        return kCorruption;
+    }
+
+    // Private mapping: the owner of a section may modify it in place
+    // without touching the file.
+    void* ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        std::cerr << "MAP_FAILED: " << strerror(errno) << std::endl;
+        return kIOError;
+    }
+    base_ = reinterpret_cast<char*>(ptr);
+    size_ = st.st_size;
+
+    const CheckpointHeader* header =
+        reinterpret_cast<const CheckpointHeader*>(base_);
+    if (header->magic != kCheckpointMagic ||
+        header->version != kCheckpointVersion ||
+        header->header_crc !=
+            Crc32c(base_, offsetof(CheckpointHeader, header_crc)) ||
+        header->file_size != size_ ||
+        sizeof(CheckpointHeader) + header->table_size > size_ ||
+        header->section_count * sizeof(SectionEntry) > header->table_size ||
+        header->table_crc != Crc32c(base_ + sizeof(CheckpointHeader),
+                                    header->table_size)) {
+        Close();
+        return kCorruption;
+    }
+    return kSucc;
+}
+
+void CheckpointReader::Close() {
+    if (base_ != NULL) {
+        munmap(base_, size_);
+        base_ = NULL;
+        size_ = 0;
+    }
+}
+
+RetCode CheckpointReader::GetSection(uint32_t id,
+                                     CheckpointSection* section) {
+    if (base_ == NULL) {
+        return kNotFound;
+    }
+    const CheckpointHeader* header =
+        reinterpret_cast<const CheckpointHeader*>(base_);
+    const char* table = base_ + sizeof(CheckpointHeader);
+    const SectionEntry* entries = reinterpret_cast<const SectionEntry*>(table);
+    for (uint32_t i = 0; i < header->section_count; i++) {
+        const SectionEntry& e = entries[i];
+        if (e.id != id) {
+            continue;
+        }
+        if (e.offset + e.size > size_ ||
+            e.crc_offset + e.chunk_count * sizeof(uint32_t) >
+                header->table_size ||
+            (e.size > 0 && (e.chunk_size == 0 ||
+                            (e.size - 1) / e.chunk_size + 1 != e.chunk_count))) {
+            return kCorruption;
+        }
+        section->data_ = base_ + e.offset;
+        section->size_ = e.size;
+        section->chunk_size_ = e.chunk_size;
+        section->crcs_ = reinterpret_cast<const uint32_t*>(table + e.crc_offset);
+        // Value-initialized, i.e. kChunkUnknown
+        section->state_ = std::make_shared<std::vector<std::atomic<uint8_t> > >(
+            e.chunk_count);
+        return kSucc;
+    }
+    return kNotFound;
+}
+
+void CheckpointWriter::AddSection(uint32_t id, const void* data,
+                                  uint64_t size, uint64_t chunk_size) {
+    if (chunk_size == 0 || chunk_size > size) {
+        chunk_size = size;
+    }
+    std::vector<const char*> chunks;
+    const char* p = reinterpret_cast<const char*>(data);
+    for (uint64_t begin = 0; begin < size; begin += chunk_size) {
+        chunks.push_back(p + begin);
+    }
+    AddSection(id, chunks, chunk_size, size);
+}
+
+void CheckpointWriter::AddSection(uint32_t id,
+                                  const std::vector<const char*>& chunks,
+                                  uint64_t chunk_size, uint64_t size) {
+    PendingSection s;
+    s.id = id;
+    s.chunks = chunks;
+    s.size = size;
+    s.chunk_size = chunk_size;
+    sections_.push_back(s);
+}
+
+RetCode CheckpointWriter::Commit() {
+    // Lay out the table and the payloads
+    std::vector<SectionEntry> entries(sections_.size());
+    uint64_t crc_count = 0;
+    for (size_t i = 0; i < sections_.size(); i++) {
+        const PendingSection& s = sections_[i];
+        entries[i].id = s.id;
+        entries[i].size = s.size;
+        entries[i].chunk_size = s.chunk_size;
+        entries[i].chunk_count =
+            s.size == 0 ? 0 : (s.size - 1) / s.chunk_size + 1;
+        entries[i].crc_offset = sections_.size() * sizeof(SectionEntry) +
+                                crc_count * sizeof(uint32_t);
+        crc_count += entries[i].chunk_count;
+    }
+    std::string table(sections_.size() * sizeof(SectionEntry) +
+                          crc_count * sizeof(uint32_t),
+                      '\0');
+    uint64_t offset = PageAlign(sizeof(CheckpointHeader) + table.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].offset = offset;
+        offset = PageAlign(offset + entries[i].size);
+    }
+
+    std::string tmp = path_ + ".tmp";
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return kIOError;
+    }
+
+    // Payloads; all-zero chunks are left as holes
+    uint32_t* crcs = reinterpret_cast<uint32_t*>(
+        &table[sections_.size() * sizeof(SectionEntry)]);
+    uint64_t zero_len = 0;
+    uint32_t zero_crc = 0;
+    for (size_t i = 0; i < sections_.size(); i++) {
+        const PendingSection& s = sections_[i];
+        for (uint32_t c = 0; c < entries[i].chunk_count; c++) {
+            uint64_t begin = c * s.chunk_size;
+            uint64_t len = std::min(s.chunk_size, s.size - begin);
+            const char* chunk = s.chunks[c];
+            if (IsZero(chunk, len)) {
+                if (len != zero_len) {
+                    zero_len = len;
+                    zero_crc = Crc32c(chunk, len);
+                }
+                *crcs++ = zero_crc;
+                continue;
+            }
+            *crcs++ = Crc32c(chunk, len);
+            if (0 != FileWriteAt(fd, chunk, len, entries[i].offset + begin)) {
+                close(fd);
+                return kIOError;
+            }
+        }
+    }
+
+    // Table and header
+    if (!entries.empty()) {
+        memcpy(&table[0], entries.data(), entries.size() * sizeof(SectionEntry));
+    }
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kCheckpointMagic;
+    header.version = kCheckpointVersion;
+    header.section_count = sections_.size();
+    header.file_size = offset;
+    header.table_size = table.size();
+    header.table_crc = Crc32c(table.data(), table.size());
+    header.header_crc = Crc32c(reinterpret_cast<const char*>(&header),
+                               offsetof(CheckpointHeader, header_crc));
+    if (0 != FileWriteAt(fd, table.data(), table.size(),
+                         sizeof(CheckpointHeader)) ||
+        0 != FileWriteAt(fd, reinterpret_cast<const char*>(&header),
+                         sizeof(header), 0) ||
+        0 != ftruncate(fd, offset) || 0 != fsync(fd)) {
+        close(fd);
+        return kIOError;
+    }
+    close(fd);
+
+    if (0 != rename(tmp.c_str(), path_.c_str())) {
+        return kIOError;
+    }
+    std::string dir = path_.substr(0, path_.find_last_of('/'));
+    return 0 == SyncDir(dir) ? kSucc : kIOError;
+}
+
+}  // namespace polar_race
@@ -0,0 +1,139 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef ENGINE_EXAMPLE_CHECKPOINT_H_
+#define ENGINE_EXAMPLE_CHECKPOINT_H_
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "include/engine.h"
+
+namespace polar_race {
+
+// A checkpoint is written on clean shutdown and holds the volatile state
+// (index image, allocator positions) as a list of sections:
+//
+//   [header][section table][chunk crcs] | page aligned payloads ...
+//
+// The header and the table are checked when the file is opened. Payloads
+// are mapped MAP_PRIVATE and checked chunk by chunk the first time a chunk
+// is touched, so Open does not pay for reading the whole image.
+
+enum CheckpointSectionId {
+    kStoreSection = 1,
+    kIndexSection = 2,
+    kOverflowSection = 3,
+    kIndexMetaSection = 4,
+    kKeyArenaSection = 5,
+    kGarbageSection = 6,
+    kKeyOrderSection = 7,
+    kKeyOrderMetaSection = 8,
+};
+
+// Payload of one section, as mapped from the checkpoint file. Copies share
+// the mapping and what is known about each chunk of it.
+class CheckpointSection {
+public:
+    CheckpointSection()
+        : data_(NULL), size_(0), chunk_size_(0), crcs_(NULL) {}
+
+    char* data() const { return data_; }
+
+    uint64_t size() const { return size_; }
+
+    // Returns false if any chunk overlapping [offset, offset + len)
+    // does not match its checksum. Bytes past the end are not checked.
+    // Safe to call from concurrent threads.
+    bool Verify(uint64_t offset, uint64_t len) {
+        if (offset >= size_ || len == 0) {
+            return true;
+        }
+        if (len > size_ - offset) {
+            len = size_ - offset;
+        }
+        uint64_t first = offset / chunk_size_;
+        uint64_t last = (offset + len - 1) / chunk_size_;
+        for (uint64_t c = first; c <= last; c++) {
+            if ((*state_)[c].load(std::memory_order_relaxed) != kChunkGood &&
+                !VerifyChunk(c)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool VerifyAll() { return size_ == 0 || Verify(0, size_); }
+
+private:
+    friend class CheckpointReader;
+
+    enum { kChunkUnknown = 0, kChunkGood = 1, kChunkBad = 2 };
+
+    char* data_;
+    uint64_t size_;
+    uint64_t chunk_size_;
+    const uint32_t* crcs_;
+    // Only ever moves from unknown to good or bad. Verifying a chunk
+    // writes nothing a reader depends on, so relaxed order is enough.
+    std::shared_ptr<std::vector<std::atomic<uint8_t> > > state_;
+
+    bool VerifyChunk(uint64_t chunk);
+};
+
+class CheckpointReader {
+public:
+    CheckpointReader() : base_(NULL), size_(0) {}
+    ~CheckpointReader();
+
+    // Returns kNotFound if there is no checkpoint, kCorruption if the
+    // header or the section table is damaged.
+    RetCode Open(const std::string& path);
+
+    // Unmaps the file. Sections handed out before become invalid.
+    void Close();
+
+    RetCode GetSection(uint32_t id, CheckpointSection* section);
+
+private:
+    char* base_;
+    uint64_t size_;
+
+    // No copying allowed
+    CheckpointReader(const CheckpointReader&);
+    void operator=(const CheckpointReader&);
+};
+
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(const std::string& path) : path_(path) {}
+
+    // |data| must stay valid until Commit(). A |chunk_size| of 0 checksums
+    // the section as a single chunk.
+    void AddSection(uint32_t id, const void* data, uint64_t size,
+                    uint64_t chunk_size = 0);
+    // Same, but the payload is gathered from separately allocated chunks
+    // of |chunk_size| bytes each (the last one may be shorter).
+    void AddSection(uint32_t id, const std::vector<const char*>& chunks,
+                    uint64_t chunk_size, uint64_t size);
+
+    // Writes every section to a temporary file, syncs it and renames it
+    // over |path|.
+    RetCode Commit();
+
+private:
+    struct PendingSection {
+        uint32_t id;
+        std::vector<const char*> chunks;
+        uint64_t size;
+        uint64_t chunk_size;
+    };
+
+    std::string path_;
+    std::vector<PendingSection> sections_;
+};
+
+}  // namespace polar_race
+
+#endif  // ENGINE_EXAMPLE_CHECKPOINT_H_
@@ -0,0 +1,219 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#include "codec.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace polar_race {
+
+static const size_t kValueHeaderSize = 1 + sizeof(uint32_t);
+
+namespace {
+
+// LZ77 in the style of LZ4 blocks: a sequence of
+//
+//   [token][literal length+][literals][offset: 2 bytes][match length+]
+//
+// The token holds the literal length in its high nibble and the match
+// length minus kMinMatch in its low one; a nibble of 15 continues in bytes
+// of 255 until a smaller one. The last sequence has literals only.
+// Matches are found through a small hash table of 4-byte prefixes, one
+// probe per position, so compression runs at memory speed rather than
+// hunting for the best match.
+class LZCodec : public Codec {
+public:
+    CompressionType type() const override { return kLZCompression; }
+
+    void Compress(const char* in, size_t n, std::string* out) const override;
+
+    bool Decompress(const char* in, size_t n, char* out,
+                    size_t raw_size) const override;
+
+    // A length byte of 255 is the most one byte adds
+    size_t MaxRawSize(size_t n) const override { return n * 255; }
+
+private:
+    static const size_t kMinMatch = 4;
+    static const size_t kMaxOffset = 65535;
+    static const int kMaxHashBits = 12;
+
+    static uint32_t Load32(const char* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static void PutLength(size_t len, std::string* out) {
+        for (; len >= 255; len -= 255) {
+            out->push_back(static_cast<char>(255));
+        }
+        out->push_back(static_cast<char>(len));
+    }
+
+    static void PutSequence(const char* literals, size_t literal_len,
+                            size_t offset, size_t match_len,
+                            std::string* out) {
+        size_t ml = match_len == 0 ? 0 : match_len - kMinMatch;
+        out->push_back(static_cast<char>((std::min<size_t>(literal_len, 15)
+                                          << 4) |
+                                         std::min<size_t>(ml, 15)));
+        if (literal_len >= 15) {
+            PutLength(literal_len - 15, out);
+        }
+        out->append(literals, literal_len);
+        if (match_len == 0) {
+            return;
+        }
+        out->push_back(static_cast<char>(offset & 0xff));
+        out->push_back(static_cast<char>(offset >> 8));
+        if (ml >= 15) {
+            PutLength(ml - 15, out);
+        }
+    }
+
+    // Advances |*p|; false if the input ends first
+    static bool GetLength(const uint8_t** p, const uint8_t* end,
+                          size_t* len) {
+        uint8_t b;
+        do {
+            if (*p == end) {
+                return false;
+            }
+            b = *(*p)++;
+            *len += b;
+        } while (b == 255);
+        return true;
+    }
+};
+
+void LZCodec::Compress(const char* in, size_t n, std::string* out) const {
+    // Small inputs get a small table, which is cheaper to clear
+    int bits = 8;
+    while (bits < kMaxHashBits && (static_cast<size_t>(1) << bits) < n) {
+        bits++;
+    }
+    uint32_t table[1 << kMaxHashBits];  // position + 1, 0 is empty
+    memset(table, 0, sizeof(uint32_t) << bits);
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + kMinMatch <= n) {
+        uint32_t seq = Load32(in + pos);
+        uint32_t h = (seq * 2654435761u) >> (32 - bits);
+        size_t ref = table[h];
+        table[h] = pos + 1;
+        if (ref == 0 || pos - (ref - 1) > kMaxOffset ||
+            Load32(in + ref - 1) != seq) {
+            // Step faster through data that does not compress
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+        ref--;
+        size_t len = kMinMatch;
+        while (pos + len < n && in[ref + len] == in[pos + len]) {
+            len++;
+        }
+        PutSequence(in + anchor, pos - anchor, pos - ref, len, out);
+        pos += len;
+        anchor = pos;
+    }
+    PutSequence(in + anchor, n - anchor, 0, 0, out);
+}
+
+bool LZCodec::Decompress(const char* in, size_t n, char* out,
+                         size_t raw_size) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t* end = p + n;
+    size_t o = 0;
+    while (p < end) {
+        const uint8_t token = *p++;
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !GetLength(&p, end, &literal_len)) {
+            return false;
+        }
+        if (literal_len > static_cast<size_t>(end - p) ||
+            literal_len > raw_size - o) {
+            return false;
+        }
+        memcpy(out + o, p, literal_len);
+        p += literal_len;
+        o += literal_len;
+        if (p == end) {
+            break;
+        }
+
+        if (end - p < 2) {
+            return false;
+        }
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !GetLength(&p, end, &match_len)) {
+            return false;
+        }
+        match_len += kMinMatch;
+        if (offset == 0 || offset > o || match_len > raw_size - o) {
+            return false;
+        }
+        const char* from = out + o - offset;
+        if (offset >= match_len) {
+            memcpy(out + o, from, match_len);
+        } else {
+            // Overlapping: the match repeats its own output
+            for (size_t i = 0; i < match_len; i++) {
+                out[o + i] = from[i];
+            }
+        }
+        o += match_len;
+    }
+    return o == raw_size;
+}
+
+}  // namespace
+
+const Codec* GetCodec(CompressionType type) {
+    static const LZCodec lz;
+    switch (type) {
+        case kLZCompression:
+            return &lz;
+        default:
+            return NULL;
+    }
+}
+
+bool CompressValue(const Codec* codec, const PolarString& value,
+                   std::string* out) {
+    uint32_t raw_size = value.size();
+    out->clear();
+    out->reserve(kValueHeaderSize + value.size());
+    out->push_back(static_cast<char>(codec->type()));
+    out->append(reinterpret_cast<const char*>(&raw_size), sizeof(raw_size));
+    codec->Compress(value.data(), value.size(), out);
+    return out->size() < value.size();
+}
+
+RetCode DecompressValue(const char* in, size_t n, std::string* value) {
+    if (n < kValueHeaderSize) {
+        return kCorruption;
+    }
+    const Codec* codec =
+        GetCodec(static_cast<CompressionType>(static_cast<uint8_t>(in[0])));
+    uint32_t raw_size;
+    memcpy(&raw_size, in + 1, sizeof(raw_size));
+    if (codec == NULL) {
+        return kNotSupported;
+    }
+    if (raw_size > codec->MaxRawSize(n - kValueHeaderSize)) {
+        return kCorruption;
+    }
+    value->resize(raw_size);
+    if (raw_size > 0 &&
+        !codec->Decompress(in + kValueHeaderSize, n - kValueHeaderSize,
+                           &(*value)[0], raw_size)) {
+        return kCorruption;
+    }
+    return kSucc;
+}
+
+}  // namespace polar_race
@@ -0,0 +1,51 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef ENGINE_EXAMPLE_CODEC_H_
+#define ENGINE_EXAMPLE_CODEC_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "include/engine.h"
+
+namespace polar_race {
+
+// A way of compressing values. The type is stored in front of every value
+// it compressed, so a type must never change its format.
+class Codec {
+public:
+    virtual ~Codec() {}
+
+    virtual CompressionType type() const = 0;
+
+    // Append the compressed form of |n| bytes of |in| to |out|
+    virtual void Compress(const char* in, size_t n, std::string* out) const = 0;
+
+    // Decompress |n| bytes of |in| into exactly |raw_size| bytes of |out|;
+    // false if |in| is damaged
+    virtual bool Decompress(const char* in, size_t n, char* out,
+                            size_t raw_size) const = 0;
+
+    // The most bytes |n| compressed bytes can stand for, so that a damaged
+    // raw size is refused before room is made for it
+    virtual size_t MaxRawSize(size_t n) const = 0;
+};
+
+// NULL for kNoCompression and unknown types
+const Codec* GetCodec(CompressionType type);
+
+// A compressed value is stored as
+//
+//   [codec type: 1 byte][raw size: 4 bytes][compressed bytes]
+
+// Set |out| to the stored form of |value|; false if compressing it does
+// not save anything
+bool CompressValue(const Codec* codec, const PolarString& value,
+                   std::string* out);
+
+// Decompress a stored value straight into |value|
+RetCode DecompressValue(const char* in, size_t n, std::string* value);
+
+}  // namespace polar_race
+
+#endif  // ENGINE_EXAMPLE_CODEC_H_
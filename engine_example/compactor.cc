@@ -0,0 +1,343 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#include "compactor.h"
+
+#include <sys/time.h>
+
+#include <iostream>
+
+namespace polar_race {
+
+// Only files at least this much garbage are worth copying
+static const double kMinGarbageRatio = 0.5;
+// The file being appended to is sealed for compaction once it holds this
+// much and is that much garbage
+static const uint32_t kMinTailSize = 16 * 1024 * 1024;
+static const uint64_t kBytesPerSecond = 64 * 1024 * 1024;
+static const uint64_t kWindowMicros = 100 * 1000;
+static const uint64_t kIdleMicros = 1000 * 1000;
+
+static uint64_t NowMicros() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static bool SameLocation(const Location& a, const Location& b) {
+    return a.file_no == b.file_no && a.offset == b.offset;
+}
+
+namespace {
+
+// Appends the copy of a record as it is stored, but only if the table
+// still points at the original
+class MoveWriter : public LocationWriter {
+public:
+    MoveWriter(DataStore* store, const std::string& key,
+               const std::string& value, const Location& from)
+        : store_(store), key_(key), value_(value), from_(from) {}
+
+    RetCode Write(const Location* current, Location* l) override {
+        if (current == NULL || !SameLocation(*current, from_)) {
+            return kNotFound;
+        }
+        return store_->AppendRecord(key_, value_, l, from_.len & kRecordBits);
+    }
+
+private:
+    DataStore* store_;
+    const std::string& key_;
+    const std::string& value_;
+    Location from_;
+};
+
+// Appends a new extent list for a streamed value whose extents moved,
+// but only if the table still points at the old list
+class MoveListWriter : public LocationWriter {
+public:
+    MoveListWriter(DataStore* store, const std::string& key,
+                   const std::vector<Location>& extents, const Location& from)
+        : store_(store), key_(key), extents_(extents), from_(from) {}
+
+    RetCode Write(const Location* current, Location* l) override {
+        if (current == NULL || !SameLocation(*current, from_)) {
+            return kNotFound;
+        }
+        return store_->AppendExtentList(key_, extents_, l);
+    }
+
+private:
+    DataStore* store_;
+    const std::string& key_;
+    const std::vector<Location>& extents_;
+    Location from_;
+};
+
+// Appends a copy of a delete record, but only if its key is still
+// deleted; the table is left as it is either way
+class MoveDeleteWriter : public LocationWriter {
+public:
+    MoveDeleteWriter(DataStore* store, const std::string& key)
+        : store_(store), key_(key) {}
+
+    RetCode Write(const Location* current, Location* l) override {
+        if (current != NULL) {
+            return kNotFound;
+        }
+        return store_->AppendDelete(key_, l);
+    }
+
+private:
+    DataStore* store_;
+    const std::string& key_;
+};
+
+class LiveRecordMover : public RecordVisitor {
+public:
+    explicit LiveRecordMover(Compactor* compactor) : compactor_(compactor) {}
+
+    RetCode Visit(const std::string& key, const Location& l) override {
+        return compactor_->Relocate(key, l);
+    }
+
+private:
+    Compactor* compactor_;
+};
+
+}  // namespace
+
+Compactor::Compactor(DoorPlate* plate, DataStore* store, Epoch* epoch)
+    : plate_(plate),
+      store_(store),
+      epoch_(epoch),
+      stop_(false),
+      window_start_(0),
+      window_bytes_(0),
+      oldest_file_(0) {
+    pthread_mutex_init(&mu_, NULL);
+    pthread_cond_init(&cv_, NULL);
+}
+
+Compactor::~Compactor() {
+    Stop();
+    pthread_cond_destroy(&cv_);
+    pthread_mutex_destroy(&mu_);
+}
+
+void Compactor::Start() {
+    stop_ = false;
+    thread_ = std::thread(&Compactor::Run, this);
+}
+
+void Compactor::Stop() {
+    pthread_mutex_lock(&mu_);
+    stop_ = true;
+    pthread_cond_broadcast(&cv_);
+    pthread_mutex_unlock(&mu_);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void Compactor::Run() {
+    while (true) {
+        bool compacted = false;
+        RetCode ret = CompactOnce(&compacted);
+        if (ret != kSucc && ret != kIncomplete) {
+            std::cerr << "compaction failed: " << ret << std::endl;
+        }
+        if (!compacted && !Wait(kIdleMicros)) {
+            return;
+        }
+        pthread_mutex_lock(&mu_);
+        bool stop = stop_;
+        pthread_mutex_unlock(&mu_);
+        if (stop) {
+            return;
+        }
+    }
+}
+
+RetCode Compactor::CompactOnce(bool* compacted) {
+    *compacted = false;
+    uint32_t file_no;
+    if (!store_->PickGarbageFile(kMinGarbageRatio, &file_no)) {
+        // No full file is worth it, but the current one may be, e.g.
+        // after most keys were deleted
+        bool sealed = false;
+        RetCode ret = store_->SealGarbageTail(kMinGarbageRatio, kMinTailSize,
+                                              &file_no, &sealed);
+        if (ret != kSucc || !sealed) {
+            return ret;
+        }
+    }
+    // Appends that reserved room in the file before it filled up may
+    // still be copying into it; wait for them so that the scan sees
+    // every record the table can point at
+    epoch_->Synchronize();
+
+    oldest_file_ = store_->OldestFile();
+    LiveRecordMover mover(this);
+    RetCode ret = store_->Scan(file_no, &mover);
+    if (ret != kSucc) {
+        return ret;
+    }
+    // Nothing new points into the file; wait out whoever looked it up
+    // before its records moved
+    epoch_->Synchronize();
+    // The copies reach the disk before the originals leave it, or a
+    // machine crash could lose records that only lived in the file
+    ret = store_->Sync();
+    if (ret != kSucc) {
+        return ret;
+    }
+    ret = store_->Remove(file_no);
+    if (ret == kSucc) {
+        *compacted = true;
+    }
+    return ret;
+}
+
+RetCode Compactor::Relocate(const std::string& key, const Location& l) {
+    if (l.kind() == kDeleteRecord) {
+        return RelocateDelete(key, l);
+    }
+    if (l.kind() != kPlainRecord) {
+        return RelocateExtents(key, l);
+    }
+    EpochGuard guard(epoch_);
+    Location current;
+    RetCode ret = plate_->Find(key, &current);
+    if (ret == kNotFound || (ret == kSucc && !SameLocation(current, l))) {
+        return kSucc;  // already garbage
+    }
+    if (ret != kSucc) {
+        return ret;
+    }
+    // Copied without decompressing
+    std::string value(l.size(), '\0');
+    ret = store_->ReadAt(l, 0, &value[0], l.size());
+    if (ret != kSucc) {
+        return ret;
+    }
+    MoveWriter writer(store_, key, value, l);
+    ret = plate_->AddOrUpdate(key, &writer);
+    if (ret == kNotFound) {
+        return kSucc;  // overwritten meanwhile
+    }
+    if (ret != kSucc) {
+        return ret;
+    }
+    return Throttle(sizeof(RecordHeader) + key.size() + value.size())
+               ? kSucc
+               : kIncomplete;
+}
+
+// |l| is an extent or an extent list in the file being compacted. If it
+// belongs to the current value of |key|, copy every extent of that value
+// which lives in the file and point the key at a new list.
+RetCode Compactor::RelocateExtents(const std::string& key,
+                                   const Location& l) {
+    EpochGuard guard(epoch_);
+    Location current;
+    RetCode ret = plate_->Find(key, &current);
+    if (ret == kNotFound ||
+        (ret == kSucc && current.kind() != kExtentListRecord)) {
+        return kSucc;  // already garbage
+    }
+    if (ret != kSucc) {
+        return ret;
+    }
+    std::vector<Location> extents;
+    ret = store_->ReadExtentList(current, &extents);
+    if (ret != kSucc) {
+        return ret;
+    }
+    bool live = SameLocation(current, l);
+    for (size_t i = 0; !live && i < extents.size(); i++) {
+        live = SameLocation(extents[i], l);
+    }
+    if (!live) {
+        return kSucc;
+    }
+
+    std::vector<Location> moved;
+    uint64_t bytes = 0;
+    std::string value;
+    for (auto& e : extents) {
+        if (e.file_no != l.file_no) {
+            continue;
+        }
+        ret = store_->Read(e, &value);
+        if (ret == kSucc) {
+            ret = store_->AppendRecord(key, value, &e, kExtentRecord);
+        }
+        if (ret != kSucc) {
+            break;
+        }
+        moved.push_back(e);
+        bytes += sizeof(RecordHeader) + key.size() + value.size();
+    }
+    if (ret == kSucc) {
+        MoveListWriter writer(store_, key, extents, current);
+        ret = plate_->AddOrUpdate(key, &writer);
+    }
+    if (ret != kSucc) {
+        // The copies are unreachable
+        for (auto& e : moved) {
+            store_->AddGarbage(e, key.size());
+        }
+        return ret == kNotFound ? kSucc : ret;  // overwritten meanwhile
+    }
+    // The extents left behind in the file go away with it
+    store_->AddGarbage(current, key.size());
+    return Throttle(bytes) ? kSucc : kIncomplete;
+}
+
+RetCode Compactor::RelocateDelete(const std::string& key,
+                                  const Location& l) {
+    if (l.file_no <= oldest_file_) {
+        return kSucc;  // whatever it deleted is gone
+    }
+    EpochGuard guard(epoch_);
+    MoveDeleteWriter writer(store_, key);
+    RetCode ret = plate_->Delete(key, &writer);
+    if (ret == kNotFound) {
+        return kSucc;  // written again meanwhile
+    }
+    if (ret != kSucc) {
+        return ret;
+    }
+    return Throttle(sizeof(RecordHeader) + key.size()) ? kSucc : kIncomplete;
+}
+
+bool Compactor::Throttle(uint64_t bytes) {
+    window_bytes_ += bytes;
+    const uint64_t budget = kBytesPerSecond * kWindowMicros / 1000000;
+    if (window_bytes_ < budget) {
+        return true;
+    }
+    uint64_t now = NowMicros();
+    uint64_t window_end = window_start_ + kWindowMicros;
+    if (now < window_end && !Wait(window_end - now)) {
+        return false;
+    }
+    window_start_ = NowMicros();
+    window_bytes_ = 0;
+    return true;
+}
+
+bool Compactor::Wait(uint64_t us) {
+    uint64_t deadline = NowMicros() + us;
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    pthread_mutex_lock(&mu_);
+    while (!stop_ && NowMicros() < deadline) {
+        pthread_cond_timedwait(&cv_, &mu_, &ts);
+    }
+    bool stop = stop_;
+    pthread_mutex_unlock(&mu_);
+    return !stop;
+}
+
+}  // namespace polar_race
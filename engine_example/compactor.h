@@ -0,0 +1,69 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef ENGINE_EXAMPLE_COMPACTOR_H_
+#define ENGINE_EXAMPLE_COMPACTOR_H_
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "data_store.h"
+#include "door_plate.h"
+#include "epoch.h"
+#include "include/engine.h"
+
+namespace polar_race {
+
+// Reclaims the space of overwritten and deleted records in the
+// background. It takes the full data file with the largest share of
+// garbage, or seals the one being appended to if that is mostly garbage,
+// appends its live records anew, moves their locations over unless a
+// write got there first, and deletes the file once nothing can be
+// reading it any more.
+// Copying is throttled so that foreground latency stays flat.
+//
+// A delete record has to outlive the records of its key it deleted, or
+// replaying the data files would bring the key back. As those may sit in
+// any older file, delete records are copied forward while an older file
+// is left, unless their key was written again.
+class Compactor {
+public:
+    // Operations on |plate| and |store| must run inside |epoch|
+    Compactor(DoorPlate* plate, DataStore* store, Epoch* epoch);
+    ~Compactor();
+
+    void Start();
+    void Stop();
+
+    // Compact the worst file if it is worth it
+    RetCode CompactOnce(bool* compacted);
+
+    // Move one record of the file being compacted, if it is still live
+    RetCode Relocate(const std::string& key, const Location& l);
+
+private:
+    DoorPlate* plate_;
+    DataStore* store_;
+    Epoch* epoch_;
+    std::thread thread_;
+    pthread_mutex_t mu_;
+    pthread_cond_t cv_;
+    bool stop_;
+    uint64_t window_start_;  // throttle window, microseconds
+    uint64_t window_bytes_;  // copied in the current window
+    uint32_t oldest_file_;   // when the current compaction started
+
+    RetCode RelocateExtents(const std::string& key, const Location& l);
+    RetCode RelocateDelete(const std::string& key, const Location& l);
+
+    void Run();
+    // Returns false if we are asked to stop while waiting for budget
+    bool Throttle(uint64_t bytes);
+    // Sleep up to |us| or until stopped; returns false if stopped
+    bool Wait(uint64_t us);
+};
+
+}  // namespace polar_race
+
+#endif  // ENGINE_EXAMPLE_COMPACTOR_H_
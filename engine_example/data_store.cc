@@ -2,11 +2,16 @@
 #include "data_store.h"
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <iostream>
+#include <thread>
 #include <vector>
 
+#include "include/flight_recorder.h"
 #include "util.h"
 
 namespace polar_race {
@@ -19,6 +24,135 @@ static std::string FileName(const std::string& dir, uint32_t fileno) {
     return dir + "/" + kDataFilePrefix + std::to_string(fileno);
 }
 
+static uint64_t PackTail(uint64_t file_no, uint64_t offset) {
+    return (file_no << 32) | offset;
+}
+
+static uint32_t RecordCrc(const RecordHeader& header, const char* key,
+                          const char* value) {
+    const char* sizes = reinterpret_cast<const char*>(&header.key_size);
+    uint32_t crc =
+        Crc32c(sizes, sizeof(header.key_size) + sizeof(header.value_size));
+    crc = Crc32c(key, header.key_size & ~kRecordBits, crc);
+    return Crc32c(value, header.value_size, crc);
+}
+
+namespace {
+
+struct ScannedRecord {
+    std::string key;
+    Location location;
+};
+
+// Intact records of one data file
+struct FileScan {
+    FileScan() : file_no(0), ret(kSucc), valid_end(0) {}
+    uint32_t file_no;
+    RetCode ret;
+    uint32_t valid_end;  // end of the last intact record
+    std::vector<ScannedRecord> records;
+};
+
+}  // namespace
+
+static void ScanFile(const std::string& dir, FileScan* scan) {
+    int fd = open(FileName(dir, scan->file_no).c_str(), O_RDONLY);
+    if (fd < 0) {
+        scan->ret = errno == ENOENT ? kSucc : kIOError;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        scan->ret = kIOError;
+        return;
+    }
+    uint64_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return;
+    }
+    void* ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        scan->ret = kIOError;
+        return;
+    }
+
+    const char* base = reinterpret_cast<const char*>(ptr);
+    uint64_t pos = 0;
+    uint64_t damaged = 0;  // skipped bytes that are not unwritten space
+    while (pos + sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        memcpy(&header, base + pos, sizeof(header));
+        const uint32_t key_size = header.key_size & ~kRecordBits;
+        uint64_t key_pos = pos + sizeof(header);
+        uint64_t value_pos = key_pos + key_size;
+        uint64_t end = value_pos + header.value_size;
+        if (end > size || header.value_size & kRecordBits ||
+            header.crc != RecordCrc(header, base + key_pos, base + value_pos)) {
+            // Appends run in parallel, so one that never finished may have
+            // left a hole that later appends wrote past. Look for the next
+            // intact record instead of stopping here. Unwritten space
+            // reads as zeros and no header is all zeros, so a record starts
+            // less than a header before the next nonzero byte.
+            uint64_t nonzero = pos;
+            while (nonzero < size && base[nonzero] == 0) {
+                nonzero++;
+            }
+            uint64_t next = std::max(pos + 1, nonzero + 1 - sizeof(header));
+            if (nonzero == pos) {
+                damaged++;
+            }
+            pos = next;
+            continue;
+        }
+        ScannedRecord record;
+        record.key.assign(base + key_pos, key_size);
+        record.location.file_no = scan->file_no;
+        record.location.offset = value_pos;
+        record.location.len =
+            header.value_size | (header.key_size & kRecordBits);
+        scan->records.push_back(record);
+        pos = end;
+        scan->valid_end = end;
+    }
+    if (damaged != 0) {
+        std::cerr << "data file " << scan->file_no << " has " << damaged
+                  << " damaged bytes, intact up to " << scan->valid_end
+                  << " of " << size << std::endl;
+    }
+    munmap(ptr, size);
+}
+
+DataStore::DataStore(const std::string dir, const Options& options)
+    : dir_(dir),
+      codec_(GetCodec(options.compression)),
+      min_compress_size_(options.min_compress_size),
+      tail_(0) {
+    memset(files_, 0, sizeof(files_));
+    pthread_mutex_init(&file_mu_, NULL);
+}
+
+DataStore::~DataStore() {
+    for (uint32_t c = 0; c < kFileChunks; c++) {
+        if (files_[c] == NULL) {
+            continue;
+        }
+        for (uint32_t i = 0; i < kFileChunkSize; i++) {
+            DataFile* f = &files_[c][i];
+            if (f->base != NULL) {
+                munmap(f->base, kSingleFileSize);
+            }
+            if (f->fd != 0) {
+                close(f->fd - 1);
+            }
+        }
+        delete[] files_[c];
+    }
+    pthread_mutex_destroy(&file_mu_);
+}
+
 RetCode DataStore::Init() {
     if (!FileExists(dir_) && 0 != mkdir(dir_.c_str(), 0755)) {
         return kIOError;
@@ -51,76 +185,620 @@ RetCode DataStore::Init() {
         cur_offset = len;
     }
 
-    next_location_.file_no = last_no;
-    next_location_.offset = cur_offset;
+    tail_ = PackTail(last_no, cur_offset);
 
     // Open file
-    return OpenCurFile();
+    int fd;
+    return FileFd(last_no, &fd);
+}
+
+RetCode DataStore::Init(CheckpointReader* checkpoint) {
+    CheckpointSection section;
+    RetCode ret = checkpoint->GetSection(kStoreSection, &section);
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (section.size() != sizeof(Location) || !section.VerifyAll()) {
+        return kCorruption;
+    }
+    Location l;
+    memcpy(&l, section.data(), sizeof(l));
+
+    // Only trust the checkpoint if nothing was appended behind its back
+    int len = GetFileLength(FileName(dir_, l.file_no));
+    if ((len < 0 ? 0 : len) != static_cast<int>(l.offset) ||
+        FileExists(FileName(dir_, l.file_no + 1))) {
+        return kCorruption;
+    }
+
+    CheckpointSection garbage;
+    ret = checkpoint->GetSection(kGarbageSection, &garbage);
+    if (ret != kSucc) {
+        return ret;
+    }
+    const uint64_t* counts = reinterpret_cast<const uint64_t*>(garbage.data());
+    const uint64_t files = garbage.size() / sizeof(uint64_t);
+    if (garbage.size() % sizeof(uint64_t) != 0 || files > l.file_no + 1ull ||
+        !garbage.VerifyAll()) {
+        return kCorruption;
+    }
+    for (uint64_t i = 0; i < files; i++) {
+        DataFile* f = FileEntry(i);
+        if (f == NULL) {
+            return kCorruption;
+        }
+        f->garbage = counts[i];
+    }
+
+    tail_ = PackTail(l.file_no, l.offset);
+    int fd;
+    return FileFd(l.file_no, &fd);
+}
+
+RetCode DataStore::Recover(RecordVisitor* visitor) {
+    const uint32_t last_no = tail_ >> 32;
+    const uint32_t workers = std::max(1u, std::thread::hardware_concurrency());
+
+    // Parse a batch of files in parallel, then replay it in file order
+    for (uint64_t first = 0; first <= last_no; first += workers) {
+        uint32_t count =
+            std::min<uint64_t>(workers, static_cast<uint64_t>(last_no) - first + 1);
+        std::vector<FileScan> scans(count);
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < count; i++) {
+            scans[i].file_no = first + i;
+            threads.push_back(std::thread(ScanFile, dir_, &scans[i]));
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        for (auto& scan : scans) {
+            if (scan.ret != kSucc) {
+                return scan.ret;
+            }
+            for (auto& record : scan.records) {
+                if (record.location.kind() == kExtentRecord) {
+                    continue;  // reached through its list
+                }
+                RetCode ret = visitor->Visit(record.key, record.location);
+                if (ret != kSucc) {
+                    return ret;
+                }
+            }
+            if (scan.file_no == last_no &&
+                scan.valid_end < static_cast<uint32_t>(tail_)) {
+                // Torn tail of an interrupted append
+                int fd;
+                RetCode ret = FileFd(last_no, &fd);
+                if (ret != kSucc) {
+                    return ret;
+                }
+                if (0 != ftruncate(fd, scan.valid_end)) {
+                    return kIOError;
+                }
+                tail_ = PackTail(last_no, scan.valid_end);
+            }
+        }
+    }
+    return kSucc;
 }
 
-RetCode DataStore::Append(const std::string& value, Location* location) {
-    if (value.size() > kSingleFileSize) {
+bool DataStore::FitsRecord(size_t key_size, size_t value_size) {
+    return sizeof(RecordHeader) + key_size + value_size <= kSingleFileSize;
+}
+
+RetCode DataStore::Append(const PolarString& key, const PolarString& value,
+                          Location* location) {
+    // Big values are left alone, so that reading a slice of one never
+    // means decompressing all of it
+    if (codec_ != NULL && value.size() >= min_compress_size_ &&
+        value.size() <= kStreamChunk) {
+        std::string stored;
+        if (CompressValue(codec_, value, &stored)) {
+            return AppendRecord(key, stored, location, kCompressedRecord);
+        }
+    }
+    return AppendRecord(key, value, location, kPlainRecord);
+}
+
+RetCode DataStore::AppendRecord(const PolarString& key,
+                                const PolarString& value, Location* location,
+                                uint32_t bits) {
+    uint64_t record_size = sizeof(RecordHeader) + key.size() + value.size();
+    if (!FitsRecord(key.size(), value.size())) {
         return kInvalidArgument;
     }
 
-    if (next_location_.offset + value.size() > kSingleFileSize) {
-        // Swtich to new file
-        close(fd_);
-        next_location_.file_no += 1;
-        next_location_.offset = 0;
-        OpenCurFile();
+    // Reserve room for the record; one that does not fit switches every
+    // writer to the next file
+    uint64_t tail = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+    uint64_t pos;
+    do {
+        pos = tail;
+        if ((pos & 0xffffffff) + record_size > kSingleFileSize) {
+            pos = PackTail((pos >> 32) + 1, 0);
+        }
+    } while (!__atomic_compare_exchange_n(&tail_, &tail, pos + record_size,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    const uint32_t file_no = pos >> 32;
+    const uint32_t offset = static_cast<uint32_t>(pos);
+    RetCode ret;
+    char* base;
+    {
+        FLIGHT_PHASE(kPhaseIO);
+        if (file_no != (tail >> 32)) {
+            // We switched files, give back the unused end of the full one
+            counters_.Add(kFileSwitches);
+            ret = Seal(tail >> 32, static_cast<uint32_t>(tail));
+            if (ret != kSucc) {
+                return ret;
+            }
+        }
+        ret = FileBase(file_no, &base);
+        if (ret != kSucc) {
+            return ret;
+        }
     }
 
-    // Append write
-    if (0 != FileAppend(fd_, value)) {
-        return kIOError;
+    RecordHeader header;
+    header.key_size = key.size() | bits;
+    header.value_size = value.size();
+    header.crc = RecordCrc(header, key.data(), value.data());
+    char* record = base + offset;
+    {
+        FLIGHT_PHASE(kPhaseCopy);
+        memcpy(record, &header, sizeof(header));
+        memcpy(record + sizeof(header), key.data(), key.size());
+        memcpy(record + sizeof(header) + key.size(), value.data(),
+               value.size());
     }
-    location->file_no = next_location_.file_no;
-    location->offset = next_location_.offset;
-    location->len = value.size();
 
-    next_location_.offset += location->len;
+    location->file_no = file_no;
+    location->offset = offset + sizeof(header) + key.size();
+    location->len = value.size() | bits;
+    counters_.Add(kRecordsWritten);
+    counters_.Add(kBytesWritten, record_size);
     return kSucc;
 }
 
-RetCode DataStore::Read(const Location& l, std::string* value) {
-    int fd = open(FileName(dir_, l.file_no).c_str(), O_RDONLY, 0644);
-    if (fd < 0) {
-        return kIOError;
+RetCode DataStore::AppendExtentList(const PolarString& key,
+                                    const std::vector<Location>& extents,
+                                    Location* location) {
+    PolarString list(reinterpret_cast<const char*>(extents.data()),
+                     extents.size() * sizeof(Location));
+    return AppendRecord(key, list, location, kExtentListRecord);
+}
+
+RetCode DataStore::AppendDelete(const PolarString& key, Location* location) {
+    return AppendRecord(key, PolarString(), location, kDeleteRecord);
+}
+
+RetCode DataStore::Sync() {
+    // On a shared mapping fdatasync also writes back the pages dirtied
+    // through it. The lock keeps Remove from closing a file under us.
+    RetCode ret = kSucc;
+    file_stats_.Lock(&file_mu_);
+    for (uint32_t c = 0; c < kFileChunks && ret == kSucc; c++) {
+        if (files_[c] == NULL) {
+            continue;
+        }
+        for (uint32_t i = 0; i < kFileChunkSize; i++) {
+            int fd = files_[c][i].fd;
+            if (fd != 0 && 0 != fdatasync(fd - 1)) {
+                ret = kIOError;
+                break;
+            }
+        }
     }
-    lseek(fd, l.offset, SEEK_SET);
+    file_stats_.Unlock(&file_mu_);
+    return ret;
+}
 
-    char* buf = new char[l.len]();
-    char* pos = buf;
-    uint32_t value_len = l.len;
+RetCode DataStore::SaveTo(CheckpointWriter* writer) {
+    // Cut the preallocated end of the current file so that its length
+    // tells the append position again
+    RetCode ret = Seal(tail_ >> 32, static_cast<uint32_t>(tail_));
+    if (ret == kSucc) {
+        ret = Sync();
+    }
+    if (ret != kSucc) {
+        return ret;
+    }
+    saved_tail_.file_no = tail_ >> 32;
+    saved_tail_.offset = static_cast<uint32_t>(tail_);
+    saved_tail_.len = 0;
+    writer->AddSection(kStoreSection, &saved_tail_, sizeof(saved_tail_));
+
+    saved_garbage_.assign(saved_tail_.file_no + 1, 0);
+    for (uint32_t i = 0; i <= saved_tail_.file_no; i++) {
+        DataFile* f = FileEntry(i);
+        if (f != NULL) {
+            saved_garbage_[i] = f->garbage;
+        }
+    }
+    writer->AddSection(kGarbageSection, saved_garbage_.data(),
+                       saved_garbage_.size() * sizeof(uint64_t));
+    return kSucc;
+}
 
-    while (value_len > 0) {
-        ssize_t r = read(fd, pos, value_len);
-        if (r < 0) {
-            if (errno == EINTR) {
-                continue;  // Retry
+void DataStore::AddGarbage(const Location& l, uint32_t key_size) {
+    DataFile* f = FileEntry(l.file_no);
+    if (f != NULL) {
+        __atomic_fetch_add(&f->garbage,
+                           sizeof(RecordHeader) + key_size + l.size(),
+                           __ATOMIC_RELAXED);
+    }
+}
+
+void DataStore::AddValueGarbage(const Location& l, uint32_t key_size) {
+    AddGarbage(l, key_size);
+    std::vector<Location> extents;
+    if (l.kind() == kExtentListRecord &&
+        ReadExtentList(l, &extents) == kSucc) {
+        for (auto& e : extents) {
+            AddGarbage(e, key_size);
+        }
+    }
+}
+
+bool DataStore::PickGarbageFile(double min_ratio, uint32_t* file_no) {
+    // A pin taken after this only covers files from the tail on
+    file_stats_.Lock(&file_mu_);
+    uint32_t tail_no = __atomic_load_n(&tail_, __ATOMIC_RELAXED) >> 32;
+    if (!pins_.empty()) {
+        tail_no = std::min(tail_no, *pins_.begin());
+    }
+    file_stats_.Unlock(&file_mu_);
+    bool found = false;
+    double worst = min_ratio;
+    for (uint32_t i = 0; i < tail_no; i++) {
+        DataFile* f = FileEntry(i);
+        if (f == NULL || __atomic_load_n(&f->removed, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        uint64_t garbage = __atomic_load_n(&f->garbage, __ATOMIC_RELAXED);
+        int len = GetFileLength(FileName(dir_, i));
+        if (garbage == 0 || len <= 0) {
+            continue;
+        }
+        double ratio = static_cast<double>(garbage) / len;
+        if (ratio >= worst) {
+            worst = ratio;
+            *file_no = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+RetCode DataStore::SealGarbageTail(double min_ratio, uint32_t min_size,
+                                   uint32_t* file_no, bool* sealed) {
+    *sealed = false;
+    uint64_t tail = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+    const uint32_t tail_no = tail >> 32;
+    const uint32_t end = static_cast<uint32_t>(tail);
+    DataFile* f = FileEntry(tail_no);
+    if (f == NULL || end < min_size ||
+        __atomic_load_n(&f->garbage, __ATOMIC_RELAXED) < min_ratio * end) {
+        return kSucc;
+    }
+    // Under file_mu_ a Pin either comes first and stops us, or pins the
+    // next file
+    file_stats_.Lock(&file_mu_);
+    bool moved = (pins_.empty() || *pins_.begin() > tail_no) &&
+                 __atomic_compare_exchange_n(&tail_, &tail,
+                                             PackTail(tail_no + 1, 0), false,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED);
+    file_stats_.Unlock(&file_mu_);
+    if (!moved) {
+        return kSucc;
+    }
+    counters_.Add(kFileSwitches);
+    RetCode ret = Seal(tail_no, end);
+    if (ret == kSucc) {
+        *file_no = tail_no;
+        *sealed = true;
+    }
+    return ret;
+}
+
+uint32_t DataStore::Pin() {
+    file_stats_.Lock(&file_mu_);
+    const uint32_t pin = __atomic_load_n(&tail_, __ATOMIC_RELAXED) >> 32;
+    pins_.insert(pin);
+    file_stats_.Unlock(&file_mu_);
+    return pin;
+}
+
+void DataStore::Unpin(uint32_t pin) {
+    file_stats_.Lock(&file_mu_);
+    pins_.erase(pins_.find(pin));
+    file_stats_.Unlock(&file_mu_);
+}
+
+uint32_t DataStore::OldestFile() {
+    const uint32_t tail_no = __atomic_load_n(&tail_, __ATOMIC_RELAXED) >> 32;
+    uint32_t i = 0;
+    for (; i < tail_no; i++) {
+        DataFile* f = FileEntry(i);
+        if ((f == NULL || !__atomic_load_n(&f->removed, __ATOMIC_RELAXED)) &&
+            FileExists(FileName(dir_, i))) {
+            break;
+        }
+    }
+    return i;
+}
+
+RetCode DataStore::Scan(uint32_t file_no, RecordVisitor* visitor) {
+    FileScan scan;
+    scan.file_no = file_no;
+    ScanFile(dir_, &scan);
+    if (scan.ret != kSucc) {
+        return scan.ret;
+    }
+    for (auto& record : scan.records) {
+        RetCode ret = visitor->Visit(record.key, record.location);
+        if (ret != kSucc) {
+            return ret;
+        }
+    }
+    return kSucc;
+}
+
+RetCode DataStore::Remove(uint32_t file_no) {
+    DataFile* f = FileEntry(file_no);
+    if (f == NULL) {
+        return kInvalidArgument;
+    }
+    file_stats_.Lock(&file_mu_);
+    if (f->base != NULL) {
+        munmap(f->base, kSingleFileSize);
+        f->base = NULL;
+    }
+    if (f->fd != 0) {
+        close(f->fd - 1);
+        __atomic_store_n(&f->fd, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&f->removed, true, __ATOMIC_RELAXED);
+    f->garbage = 0;
+    file_stats_.Unlock(&file_mu_);
+    if (0 != unlink(FileName(dir_, file_no).c_str()) && errno != ENOENT) {
+        return kIOError;
+    }
+    return 0 == SyncDir(dir_) ? kSucc : kIOError;
+}
+
+RetCode DataStore::Read(const Location& l, std::string* value) {
+    if (l.compressed()) {
+        std::string stored(l.size(), '\0');
+        RetCode ret = ReadAt(l, 0, &stored[0], l.size());
+        if (ret != kSucc) {
+            return ret;
+        }
+        return DecompressValue(stored.data(), stored.size(), value);
+    }
+    if (l.kind() != kExtentListRecord) {
+        value->resize(l.size());
+        return l.size() == 0 ? kSucc : ReadAt(l, 0, &(*value)[0], l.size());
+    }
+    std::vector<Location> extents;
+    RetCode ret = ReadExtentList(l, &extents);
+    if (ret != kSucc) {
+        return ret;
+    }
+    uint64_t total = 0;
+    for (auto& e : extents) {
+        total += e.size();
+    }
+    value->resize(total);
+    uint64_t pos = 0;
+    for (auto& e : extents) {
+        if (e.size() > 0) {
+            ret = ReadAt(e, 0, &(*value)[pos], e.size());
+            if (ret != kSucc) {
+                return ret;
             }
-            close(fd);
-            return kIOError;
         }
-        pos += r;
-        value_len -= r;
+        pos += e.size();
     }
-    *value = std::string(buf, l.len);
+    return kSucc;
+}
 
-    delete buf;
-    close(fd);
+RetCode DataStore::ReadAt(const Location& l, uint64_t offset, char* buf,
+                          size_t n) {
+    // Never conjure up a file for a location from past the tail
+    if (l.file_no > (__atomic_load_n(&tail_, __ATOMIC_RELAXED) >> 32) ||
+        offset > l.size() || n > l.size() - offset) {
+        return kCorruption;
+    }
+    FLIGHT_PHASE(kPhaseIO);
+    int fd;
+    RetCode ret = FileFd(l.file_no, &fd);
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (n > 0 && 0 != FileReadAt(fd, buf, n, l.offset + offset)) {
+        return kIOError;
+    }
+    counters_.Add(kReads);
+    counters_.Add(kBytesRead, n);
     return kSucc;
 }
 
-RetCode DataStore::OpenCurFile() {
-    std::string file_name = FileName(dir_, next_location_.file_no);
-    int fd = open(file_name.c_str(), O_APPEND | O_WRONLY | O_CREAT, 0644);
+RetCode DataStore::ReadExtentList(const Location& l,
+                                  std::vector<Location>* extents) {
+    if (l.kind() != kExtentListRecord || l.size() % sizeof(Location) != 0) {
+        return kCorruption;
+    }
+    extents->resize(l.size() / sizeof(Location));
+    return extents->empty() ? kSucc
+                            : ReadAt(l, 0, reinterpret_cast<char*>(
+                                                &(*extents)[0]),
+                                     l.size());
+}
+
+void DataStore::GetProperties(Properties* props) {
+    AddProperty(props, "polar.store.records_written",
+                counters_.Get(kRecordsWritten));
+    AddProperty(props, "polar.store.bytes_written",
+                counters_.Get(kBytesWritten));
+    AddProperty(props, "polar.store.reads", counters_.Get(kReads));
+    AddProperty(props, "polar.store.bytes_read", counters_.Get(kBytesRead));
+    AddProperty(props, "polar.store.file_switches",
+                counters_.Get(kFileSwitches));
+
+    // Appended bytes of the files that are left, against the bytes of the
+    // records still in use; the unused end of the file being appended to
+    // is not counted
+    const uint64_t tail = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+    const uint32_t tail_no = tail >> 32;
+    uint64_t files = 0, stored = 0, garbage = 0;
+    for (uint32_t i = 0; i <= tail_no; i++) {
+        DataFile* f = FileEntry(i);
+        if (f == NULL || __atomic_load_n(&f->removed, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        int64_t len = i == tail_no ? static_cast<uint32_t>(tail)
+                                   : GetFileLength(FileName(dir_, i));
+        if (len <= 0) {
+            continue;
+        }
+        files++;
+        stored += len;
+        garbage += __atomic_load_n(&f->garbage, __ATOMIC_RELAXED);
+    }
+    garbage = std::min(garbage, stored);
+    AddProperty(props, "polar.store.files", files);
+    AddProperty(props, "polar.store.stored_bytes", stored);
+    AddProperty(props, "polar.store.garbage_bytes", garbage);
+    // 0 while nothing is live
+    AddProperty(props, "polar.store.space_amplification",
+                stored == garbage ? 0.0
+                                  : static_cast<double>(stored) /
+                                        (stored - garbage));
+    file_stats_.GetProperties("polar.lock.file", props);
+}
+
+// Entry of |file_no| in the file table, NULL if it is out of range
+DataStore::DataFile* DataStore::FileEntry(uint32_t file_no) {
+    const uint32_t chunk = file_no / kFileChunkSize;
+    if (chunk >= kFileChunks) {
+        return NULL;
+    }
+    DataFile* files = __atomic_load_n(&files_[chunk], __ATOMIC_ACQUIRE);
+    if (files == NULL) {
+        file_stats_.Lock(&file_mu_);
+        files = files_[chunk];
+        if (files == NULL) {
+            files = new DataFile[kFileChunkSize]();
+            __atomic_store_n(&files_[chunk], files, __ATOMIC_RELEASE);
+        }
+        file_stats_.Unlock(&file_mu_);
+    }
+    return &files[file_no % kFileChunkSize];
+}
+
+// Holds file_mu_
+RetCode DataStore::OpenFile(uint32_t file_no, DataFile* f) {
+    if (f->fd != 0) {
+        return kSucc;
+    }
+    if (f->removed) {
+        return kIOError;
+    }
+    int fd = open(FileName(dir_, file_no).c_str(), O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
         return kIOError;
     }
-    fd_ = fd;
+    __atomic_store_n(&f->fd, fd + 1, __ATOMIC_RELEASE);
     return kSucc;
 }
 
+RetCode DataStore::FileFd(uint32_t file_no, int* fd) {
+    DataFile* f = FileEntry(file_no);
+    if (f == NULL) {
+        return kFull;
+    }
+    int entry = __atomic_load_n(&f->fd, __ATOMIC_ACQUIRE);
+    if (entry == 0) {
+        file_stats_.Lock(&file_mu_);
+        RetCode ret = OpenFile(file_no, f);
+        entry = f->fd;
+        file_stats_.Unlock(&file_mu_);
+        if (ret != kSucc) {
+            return ret;
+        }
+    }
+    *fd = entry - 1;
+    return kSucc;
+}
+
+// Map |file_no| for appends. The file is preallocated to its full size
+// first, so stores into the mapping never fault past its end; the part
+// nobody appended to is cut again by Seal.
+RetCode DataStore::FileBase(uint32_t file_no, char** base) {
+    DataFile* f = FileEntry(file_no);
+    if (f == NULL) {
+        return kFull;
+    }
+    char* entry = __atomic_load_n(&f->base, __ATOMIC_ACQUIRE);
+    if (entry != NULL) {
+        *base = entry;
+        return kSucc;
+    }
+
+    file_stats_.Lock(&file_mu_);
+    RetCode ret = OpenFile(file_no, f);
+    if (ret == kSucc && f->base == NULL) {
+        int fd = f->fd - 1;
+        struct stat st;
+        if (0 != fstat(fd, &st)) {
+            ret = kIOError;
+        } else if (!f->sealed && st.st_size < kSingleFileSize &&
+                   0 != fallocate(fd, 0, 0, kSingleFileSize) &&
+                   (errno != EOPNOTSUPP ||
+                    0 != ftruncate(fd, kSingleFileSize))) {
+            // Out of space shows here rather than as SIGBUS later
+            ret = kIOError;
+        }
+        if (ret == kSucc) {
+            void* ptr = mmap(NULL, kSingleFileSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                std::cerr << "MAP_FAILED: " << strerror(errno) << std::endl;
+                ret = kIOError;
+            } else {
+                __atomic_store_n(&f->base, reinterpret_cast<char*>(ptr),
+                                 __ATOMIC_RELEASE);
+            }
+        }
+    }
+    if (ret == kSucc) {
+        *base = f->base;
+    }
+    file_stats_.Unlock(&file_mu_);
+    return ret;
+}
+
+// Cut |file_no| to |end|. Appends still copying into it stay below |end|.
+RetCode DataStore::Seal(uint32_t file_no, uint32_t end) {
+    DataFile* f = FileEntry(file_no);
+    if (f == NULL) {
+        return kFull;
+    }
+    file_stats_.Lock(&file_mu_);
+    RetCode ret = OpenFile(file_no, f);
+    if (ret == kSucc) {
+        f->sealed = true;
+        if (0 != ftruncate(f->fd - 1, end)) {
+            ret = kIOError;
+        }
+    }
+    file_stats_.Unlock(&file_mu_);
+    return ret;
+}
+
 }  // namespace polar_race
@@ -1,42 +1,191 @@
 // Copyright [2018] Alibaba Cloud All rights reserved
 #ifndef ENGINE_SIMPLE_DATA_STORE_H_
 #define ENGINE_SIMPLE_DATA_STORE_H_
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <set>
 #include <string>
+#include <vector>
 
+#include "checkpoint.h"
+#include "codec.h"
 #include "include/engine.h"
+#include "include/lock_stats.h"
+#include "stats.h"
 
 namespace polar_race {
 
+// Kinds of record. A value too big for one record, or written as a
+// stream, is stored as extent records followed by an extent list record
+// that holds their locations; only the list is indexed. A delete record
+// has no value and marks its key as deleted from then on. The kind is kept
+// in the top bits of RecordHeader::key_size and Location::len.
+static const uint32_t kPlainRecord = 0;
+static const uint32_t kExtentRecord = 1u << 30;
+static const uint32_t kExtentListRecord = 1u << 31;
+static const uint32_t kDeleteRecord = kExtentRecord | kExtentListRecord;
+static const uint32_t kRecordKindMask = kExtentRecord | kExtentListRecord;
+// Flag on a plain record whose value is compressed, see codec.h
+static const uint32_t kCompressedRecord = 1u << 29;
+// Bits of RecordHeader::key_size and Location::len that are not sizes
+static const uint32_t kRecordBits = kRecordKindMask | kCompressedRecord;
+
+// Values are streamed in extents of this size
+static const uint32_t kStreamChunk = 1024 * 1024;
+
 struct Location {
     Location() : file_no(0), offset(0), len(0) {}
+    Location(uint32_t f, uint32_t o, uint32_t l)
+        : file_no(f), offset(o), len(l) {}
     uint32_t file_no;
     uint32_t offset;
-    uint32_t len;
+    uint32_t len;  // stored value bytes, record kind and flags on top
+
+    uint32_t size() const { return len & ~kRecordBits; }
+    uint32_t kind() const { return len & kRecordKindMask; }
+    bool compressed() const { return (len & kCompressedRecord) != 0; }
 };
 
-class DataStore {
+// Every value is stored behind a header carrying its key, so the index
+// can be rebuilt from the data files alone.
+struct RecordHeader {
+    uint32_t crc;  // covers the sizes, the key and the value
+    uint32_t key_size;  // record kind and flags on top
+    uint32_t value_size;
+};
+
+// Receives records by key, e.g. the ones found while replaying the data
+// files, oldest first
+class RecordVisitor {
 public:
-    explicit DataStore(const std::string dir) : fd_(-1), dir_(dir) {}
+    virtual ~RecordVisitor() {}
+
+    virtual RetCode Visit(const std::string& key, const Location& l) = 0;
+};
 
-    ~DataStore() {
-        if (fd_ > 0) {
-            close(fd_);
-        }
-    }
+// Append and Read may be called from any number of threads at once.
+class DataStore {
+public:
+    DataStore(const std::string dir, const Options& options);
+    ~DataStore();
 
+    // Find the append position by listing the data files
     RetCode Init();
+    // Take the append position from a clean-shutdown checkpoint
+    RetCode Init(CheckpointReader* checkpoint);
+    // Replay every intact record but extents, cutting off a torn tail.
+    // Holes left by appends that never finished are skipped.
+    RetCode Recover(RecordVisitor* visitor);
+
+    // Whole value, gathered from its extents or decompressed if need be
     RetCode Read(const Location& l, std::string* value);
-    RetCode Append(const std::string& value, Location* location);
+    // |n| stored bytes from |offset| into the value of a record
+    RetCode ReadAt(const Location& l, uint64_t offset, char* buf, size_t n);
+    RetCode ReadExtentList(const Location& l, std::vector<Location>* extents);
+
+    // Append |value| as a plain record, compressed if the options ask
+    // for it and it pays off
+    RetCode Append(const PolarString& key, const PolarString& value,
+                   Location* location);
+    // Append |value| as it is, with record kind and flags |bits|. The
+    // record is copied straight into a shared mapping of the data file,
+    // so it survives a crash of the process as soon as this returns,
+    // without a system call.
+    RetCode AppendRecord(const PolarString& key, const PolarString& value,
+                         Location* location, uint32_t bits);
+    RetCode AppendExtentList(const PolarString& key,
+                             const std::vector<Location>& extents,
+                             Location* location);
+    RetCode AppendDelete(const PolarString& key, Location* location);
+    // Whether a value of |value_size| fits in a single record
+    static bool FitsRecord(size_t key_size, size_t value_size);
+
+    // Durability barrier: once it returns, every append that returned
+    // before survives a crash of the machine too
+    RetCode Sync();
+
+    // Count the record at |l|, whose key is |key_size| bytes long, as
+    // garbage now that nothing points at it
+    void AddGarbage(const Location& l, uint32_t key_size);
+    // Same for a whole value, including the extents of an extent list
+    void AddValueGarbage(const Location& l, uint32_t key_size);
+    // The full data file with the largest share of garbage, if that is at
+    // least |min_ratio|. Pinned files are left alone.
+    bool PickGarbageFile(double min_ratio, uint32_t* file_no);
+    // Move appends on to a new file and seal the current one, so that it
+    // can be compacted like a full one, if it holds at least |min_size|
+    // bytes and |min_ratio| of them are garbage. |sealed| tells whether
+    // it was; not while the file is pinned or another append switched
+    // files first.
+    RetCode SealGarbageTail(double min_ratio, uint32_t min_size,
+                            uint32_t* file_no, bool* sealed);
+    // Keep compaction away from the current data file and every later
+    // one, e.g. while a stream's extents are not in the index yet. Hand
+    // what it returns to Unpin.
+    uint32_t Pin();
+    void Unpin(uint32_t pin);
+    // Number of the oldest data file compaction has not removed yet
+    uint32_t OldestFile();
+    // Visit every intact record of a full data file, extents included
+    RetCode Scan(uint32_t file_no, RecordVisitor* visitor);
+    // Delete a data file nothing points into any more. No append or read
+    // that may still use it can be running.
+    RetCode Remove(uint32_t file_no);
+
+    // Sync the data and add the append position to |writer|
+    RetCode SaveTo(CheckpointWriter* writer);
+
+    // Bytes moved to and from storage, and how much of what is stored is
+    // still live
+    void GetProperties(Properties* props);
 
 private:
-    int fd_;
+    static const uint32_t kFileChunks = 256;
+    static const uint32_t kFileChunkSize = 256;
+
+    enum Counter {
+        kRecordsWritten,
+        kBytesWritten,  // whole records, headers and keys too
+        kReads,
+        kBytesRead,
+        kFileSwitches,
+        kCounters
+    };
+
+    struct DataFile {
+        int fd;            // + 1, so that 0 means not open
+        bool sealed;       // cut to its final length, never grown again
+        bool removed;      // deleted by compaction
+        char* base;        // shared mapping for appends, NULL until needed
+        uint64_t garbage;  // bytes of records nothing points at
+    };
+
     std::string dir_;
-    Location next_location_;
+    const Codec* codec_;  // for new values, NULL if they are not compressed
+    size_t min_compress_size_;
+    // Append position, file number in the high half and offset in the
+    // low half. Writers reserve their record by moving it with CAS and
+    // then write it at the reserved offset.
+    uint64_t tail_;
+    Location saved_tail_;  // what SaveTo added to the checkpoint
+    std::vector<uint64_t> saved_garbage_;
+    // Data files by number, opened on first use and kept until close,
+    // shared by appends and reads
+    DataFile* files_[kFileChunks];
+    std::multiset<uint32_t> pins_;  // what Pin returned, until Unpin
+    // serializes opening, mapping and sealing, and guards pins_
+    pthread_mutex_t file_mu_;
+    LockStats file_stats_;     // of file_mu_
+    Counters<kCounters> counters_;
 
-    RetCode OpenCurFile();
+    DataFile* FileEntry(uint32_t file_no);
+    RetCode OpenFile(uint32_t file_no, DataFile* f);
+    RetCode FileFd(uint32_t file_no, int* fd);
+    RetCode FileBase(uint32_t file_no, char** base);
+    RetCode Seal(uint32_t file_no, uint32_t end);
 };
 
 }  // namespace polar_race
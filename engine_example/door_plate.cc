@@ -6,153 +6,870 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
 #include <cstring>
 #include <iostream>
-#include <map>
 #include <utility>
+#include <vector>
 
+#include "include/flight_recorder.h"
 #include "util.h"
 
 namespace polar_race {
 
-static const uint32_t kMaxDoorCnt = 1024 * 1024 * 32;
-static const char kMetaFileName[] = "META";
-static const int kMaxRangeBufCount = kMaxDoorCnt;
+static const int kInitialShift = 8;
+static const uint64_t kInitialBuckets = 1 << kInitialShift;
+static const uint32_t kMaxLevel = 32 - kInitialShift;
+static const double kMaxLoadFactor = 0.75;
+
+static uint32_t LevelOf(uint64_t shape) { return static_cast<uint32_t>(shape); }
+
+static uint32_t SplitOf(uint64_t shape) { return shape >> 32; }
+
+static uint8_t TagOf(uint64_t hash) { return kCtrlFull | (hash >> 57); }
+
+static void CpuRelax() {
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+}
 
-static bool ItemKeyMatch(const Item& item, const std::string& target) {
-    if (target.size() != item.key_size ||
-        memcmp(item.key, target.data(), item.key_size) != 0) {
-        // Conflict
-        return false;
+// Bit i is set if ctrl[i] == v
+static uint32_t MatchCtrl(const uint8_t* ctrl, uint8_t v) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(v)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < kBucketSlots; i++) {
+        mask |= static_cast<uint32_t>(ctrl[i] == v) << i;
     }
-    return true;
+    return mask;
+#endif
 }
 
-static bool ItemTryPlace(const Item& item, const std::string& target) {
-    if (item.in_use == 0) {
-        return true;
+// Bit i is set if slot i holds a key
+static uint32_t MatchFull(const uint8_t* ctrl) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < kBucketSlots; i++) {
+        mask |= static_cast<uint32_t>((ctrl[i] & kCtrlFull) != 0) << i;
     }
-    return ItemKeyMatch(item, target);
+    return mask;
+#endif
 }
 
-DoorPlate::DoorPlate(const std::string& path)
-    : dir_(path), fd_(-1), items_(NULL) {}
+static uint64_t InlineKey(const char* data, size_t size) {
+    uint64_t k = 0;
+    memcpy(&k, data, size);
+    return k;
+}
 
-RetCode DoorPlate::Init() {
-    bool new_create = false;
-    const int map_size = kMaxDoorCnt * sizeof(Item);
-
-    if (!FileExists(dir_) && 0 != mkdir(dir_.c_str(), 0755)) {
-        return kIOError;
-    }
-
-    std::string path = dir_ + "/" + kMetaFileName;
-    int fd = open(path.c_str(), O_RDWR, 0644);
-    if (fd < 0 && errno == ENOENT) {
-        // not exist, then create
-        fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
-        if (fd >= 0) {
-            new_create = true;
-            if (posix_fallocate(fd, 0, map_size) != 0) {
-                std::cerr << "posix_fallocate failed: " << strerror(errno)
-                          << std::endl;
-                close(fd);
-                return kIOError;
-            }
+// Leaves the version alone, readers may be watching it
+static void ClearBucket(Bucket* b) {
+    memset(b->ctrl, 0, sizeof(b->ctrl));
+    b->next = 0;
+    memset(static_cast<void*>(b->slots), 0, sizeof(b->slots));
+}
+
+// Version word of a primary bucket, see Bucket
+static const uint32_t kOwned = 0x80000000;
+static const uint32_t kCounter = 0x7fffffff;
+
+// Seqlock counter for readers
+static uint32_t ReadVersion(const Bucket* head) {
+    return __atomic_load_n(&head->version, __ATOMIC_ACQUIRE) & kCounter;
+}
+
+// Counted in |stats| as a lock, waiting from the first failed attempt
+static void OwnBucket(Bucket* head, LockStats* stats) {
+    uint64_t since = 0;
+    while (true) {
+        uint32_t v = __atomic_load_n(&head->version, __ATOMIC_RELAXED);
+        if ((v & kOwned) == 0 &&
+            __atomic_compare_exchange_n(&head->version, &v, v | kOwned, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            stats->Acquired(since != 0, since);
+            return;
         }
+        if (since == 0) {
+            since = ReadTsc();
+        }
+        CpuRelax();
     }
-    if (fd < 0) {
-        return kIOError;
+}
+
+static void DisownBucket(Bucket* head, LockStats* stats) {
+    stats->Released();
+    __atomic_store_n(&head->version, head->version & kCounter,
+                     __ATOMIC_RELEASE);
+}
+
+// Readers retry until the matching EndChange
+static void BeginChange(Bucket* head) {
+    uint32_t v = kOwned | ((head->version + 1) & kCounter);
+    __atomic_store_n(&head->version, v, __ATOMIC_RELAXED);
+    // Readers must see the odd version before any of our stores
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void EndChange(Bucket* head) {
+    uint32_t v = kOwned | ((head->version + 1) & kCounter);
+    __atomic_store_n(&head->version, v, __ATOMIC_RELEASE);
+}
+
+DoorPlate::DoorPlate() {
+    memset(&meta_, 0, sizeof(meta_));
+    pthread_mutex_init(&alloc_mu_, NULL);
+    pthread_mutex_init(&split_mu_, NULL);
+}
+
+DoorPlate::~DoorPlate() {
+    pthread_mutex_destroy(&alloc_mu_);
+    pthread_mutex_destroy(&split_mu_);
+}
+
+RetCode DoorPlate::Init() {
+    memset(&meta_, 0, sizeof(meta_));
+    RetCode ret = keys_.Init();
+    if (ret != kSucc) {
+        return ret;
     }
-    fd_ = fd;
+    return buckets_.Reserve(kInitialBuckets);
+}
 
-    void* ptr =
-        mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
-    if (ptr == MAP_FAILED) {
-        std::cerr << "MAP_FAILED: " << strerror(errno) << std::endl;
-        close(fd);
-        return kIOError;
+RetCode DoorPlate::Init(CheckpointReader* checkpoint) {
+    CheckpointSection meta, index, overflow, arena;
+    RetCode ret = checkpoint->GetSection(kIndexMetaSection, &meta);
+    if (ret == kSucc) {
+        ret = checkpoint->GetSection(kIndexSection, &index);
+    }
+    if (ret == kSucc) {
+        ret = checkpoint->GetSection(kOverflowSection, &overflow);
+    }
+    if (ret == kSucc) {
+        ret = checkpoint->GetSection(kKeyArenaSection, &arena);
+    }
+    if (ret != kSucc) {
+        return ret;
     }
-    if (new_create) {
-        memset(ptr, 0, map_size);
+    if (meta.size() != sizeof(meta_) || !meta.VerifyAll()) {
+        return kCorruption;
     }
+    memcpy(&meta_, meta.data(), sizeof(meta_));
 
-    items_ = reinterpret_cast<Item*>(ptr);
+    ret = buckets_.Adopt(index);
+    if (ret == kSucc) {
+        ret = overflow_.Adopt(overflow);
+    }
+    if (ret == kSucc) {
+        ret = arena_.Adopt(arena);
+    }
+    if (ret == kSucc) {
+        ret = keys_.Init(checkpoint);
+    }
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (LevelOf(meta_.shape) > kMaxLevel ||
+        buckets_.capacity() < BucketCount(meta_.shape) ||
+        overflow_.capacity() < meta_.overflow ||
+        arena_.capacity() < meta_.arena) {
+        return kCorruption;
+    }
     return kSucc;
 }
 
-DoorPlate::~DoorPlate() {
-    if (fd_ > 0) {
-        const int map_size = kMaxDoorCnt * sizeof(Item);
-        munmap(items_, map_size);
-        close(fd_);
+uint64_t DoorPlate::BucketCount(uint64_t shape) {
+    return (kInitialBuckets << LevelOf(shape)) + SplitOf(shape);
+}
+
+uint32_t DoorPlate::BucketOf(uint64_t hash, uint64_t shape) {
+    uint64_t mask = (kInitialBuckets << LevelOf(shape)) - 1;
+    uint64_t b = hash & mask;
+    if (b < SplitOf(shape)) {
+        // Already split in this round
+        b = hash & ((mask << 1) | 1);
     }
+    return b;
 }
 
-// Very easy hash table, which deal conflict only by try the next one
-int DoorPlate::CalcIndex(const std::string& key) {
-    uint32_t jcnt = 0;
-    int index = StrHash(key.data(), key.size()) % kMaxDoorCnt;
-    while (!ItemTryPlace(*(items_ + index), key) && ++jcnt < kMaxDoorCnt) {
-        index = (index + 1) % kMaxDoorCnt;
+// Own the chain of |hash|. A split may move the key to another chain
+// while we wait, so the mapping is checked again once we own it.
+Bucket* DoorPlate::OwnChain(uint64_t hash) {
+    while (true) {
+        uint32_t index = BucketOf(hash, Shape());
+        Bucket* head = buckets_.At(index);
+        if (head == NULL) {
+            return NULL;
+        }
+        {
+            FLIGHT_PHASE(kPhaseLock);
+            OwnBucket(head, &chain_stats_);
+        }
+        if (BucketOf(hash, Shape()) == index) {
+            return head;
+        }
+        DisownBucket(head, &chain_stats_);
     }
+}
 
-    if (jcnt == kMaxDoorCnt) {
-        // full
-        return -1;
+// Point |data| at the key bytes of |slot|; inline keys are copied out to
+// |inline_key| first. Lock-free readers may pass a torn slot, so nothing
+// is dereferenced before it is bounds checked.
+RetCode DoorPlate::SlotKey(const Slot& slot, const char** data,
+                           uint64_t* inline_key) {
+    if (slot.key_size <= kMaxInlineKeyLen) {
+        *inline_key = slot.key;
+        *data = reinterpret_cast<const char*>(inline_key);
+        return kSucc;
+    }
+    uint64_t limit = std::min(__atomic_load_n(&meta_.arena, __ATOMIC_ACQUIRE),
+                              arena_.capacity());
+    if (slot.key_size > kMaxKeyLen || slot.key > limit ||
+        slot.key_size > limit - slot.key) {
+        return kCorruption;
     }
-    return index;
+    *data = arena_.At(slot.key, slot.key_size);
+    return *data == NULL ? kCorruption : kSucc;
 }
 
-RetCode DoorPlate::AddOrUpdate(const std::string& key, const Location& l) {
-    if (key.size() > kMaxKeyLen) {
-        return kInvalidArgument;
+// Walk the owned chain of |key|, comparing full keys only where the tag
+// matches. Without a match the first deleted slot, if any, is offered as
+// the free one, but the walk still goes on to the first empty slot.
+// Adds the buckets it looks at to |walked|.
+RetCode DoorPlate::Lookup(const std::string& key, uint64_t hash, Bucket* head,
+                          Probe* probe, uint64_t* walked) {
+    probe->match = NULL;
+    probe->empty = NULL;
+    const uint8_t tag = TagOf(hash);
+    const bool is_inline = key.size() <= kMaxInlineKeyLen;
+    const uint64_t inline_key =
+        is_inline ? InlineKey(key.data(), key.size()) : 0;
+
+    Bucket* b = head;
+    while (true) {
+        if (b == NULL) {
+            return kCorruption;
+        }
+        (*walked)++;
+        for (uint32_t m = MatchCtrl(b->ctrl, tag); m != 0; m &= m - 1) {
+            uint32_t i = __builtin_ctz(m);
+            const Slot& slot = b->slots[i];
+            if (slot.key_size != key.size()) {
+                continue;
+            }
+            bool same = is_inline && slot.key == inline_key;
+            if (!is_inline) {
+                const char* data;
+                uint64_t unused;
+                RetCode ret = SlotKey(slot, &data, &unused);
+                if (ret != kSucc) {
+                    return ret;
+                }
+                same = memcmp(data, key.data(), key.size()) == 0;
+            }
+            if (same) {
+                probe->match = b;
+                probe->match_slot = i;
+                return kSucc;
+            }
+        }
+        uint32_t deleted = MatchCtrl(b->ctrl, kCtrlDeleted);
+        if (deleted != 0 && probe->empty == NULL) {
+            probe->empty = b;
+            probe->empty_slot = __builtin_ctz(deleted);
+        }
+        uint32_t empty = MatchCtrl(b->ctrl, kCtrlEmpty);
+        if (empty != 0) {
+            if (probe->empty == NULL) {
+                probe->empty = b;
+                probe->empty_slot = __builtin_ctz(empty);
+            }
+            probe->tail = b;
+            return kSucc;
+        }
+        if (b->next == 0) {
+            break;
+        }
+        b = Chain(b->next);
     }
+    probe->tail = b;
+    return kSucc;
+}
+
+// Lookup without owning the chain. Whatever it returns only counts if the
+// version of |head| still reads |version| afterwards; kIncomplete means it
+// moved while we walked.
+RetCode DoorPlate::Walk(const std::string& key, uint64_t hash, Bucket* head,
+                        uint32_t version, Location* location,
+                        uint64_t* walked) {
+    const uint8_t tag = TagOf(hash);
+    const bool is_inline = key.size() <= kMaxInlineKeyLen;
+    const uint64_t inline_key =
+        is_inline ? InlineKey(key.data(), key.size()) : 0;
 
-    int index = CalcIndex(key);
-    if (index < 0) {
+    Bucket* b = head;
+    while (true) {
+        if (b == NULL) {
+            return kCorruption;
+        }
+        (*walked)++;
+        for (uint32_t m = MatchCtrl(b->ctrl, tag); m != 0; m &= m - 1) {
+            Slot slot;
+            memcpy(&slot, &b->slots[__builtin_ctz(m)], sizeof(slot));
+            if (slot.key_size != key.size()) {
+                continue;
+            }
+            bool same = is_inline && slot.key == inline_key;
+            if (!is_inline) {
+                const char* data;
+                uint64_t unused;
+                RetCode ret = SlotKey(slot, &data, &unused);
+                if (ret != kSucc) {
+                    return ret;
+                }
+                same = memcmp(data, key.data(), key.size()) == 0;
+            }
+            if (same) {
+                *location = slot.location;
+                return kSucc;
+            }
+        }
+        uint32_t next = b->next;
+        if (MatchCtrl(b->ctrl, kCtrlEmpty) != 0 || next == 0) {
+            return kNotFound;
+        }
+        // A torn chain could loop, so look at the version on every hop
+        if (ReadVersion(head) != version) {
+            return kIncomplete;
+        }
+        b = Chain(next);
+    }
+}
+
+// Take an overflow bucket off the free list, or a new one; holds
+// alloc_mu_
+RetCode DoorPlate::AllocBucket(uint32_t* next) {
+    if (meta_.free != 0) {
+        Bucket* b = Chain(meta_.free);
+        if (b == NULL) {
+            return kCorruption;
+        }
+        *next = meta_.free;
+        meta_.free = b->next;
+        return kSucc;
+    }
+    if (meta_.overflow == UINT32_MAX) {
         return kFull;
     }
+    RetCode ret = overflow_.Reserve(meta_.overflow + 1);
+    if (ret != kSucc) {
+        return ret;
+    }
+    *next = ++meta_.overflow;
+    return kSucc;
+}
 
-    Item* iptr = items_ + index;
-    if (iptr->in_use == 0) {
-        // new item
-        memcpy(iptr->key, key.data(), key.size());
-        iptr->key_size = key.size();
-        iptr->in_use = 1;  // Place
+// Holds alloc_mu_
+void DoorPlate::FreeBucket(uint32_t next) {
+    Bucket* b = Chain(next);
+    ClearBucket(b);
+    b->next = meta_.free;
+    meta_.free = next;
+}
+
+// Chain a fresh overflow bucket behind |tail|
+RetCode DoorPlate::Place(Bucket* tail, Bucket** bucket) {
+    uint32_t next;
+    alloc_stats_.Lock(&alloc_mu_);
+    RetCode ret = AllocBucket(&next);
+    alloc_stats_.Unlock(&alloc_mu_);
+    if (ret != kSucc) {
+        return ret;
     }
-    iptr->location = l;
+    Bucket* b = Chain(next);
+    ClearBucket(b);
+    tail->next = next;
+    *bucket = b;
     return kSucc;
 }
 
-RetCode DoorPlate::Find(const std::string& key, Location* location) {
-    int index = CalcIndex(key);
-    if (index < 0 || !ItemKeyMatch(*(items_ + index), key)) {
-        return kNotFound;
+// Arena space for a key of |size| bytes, freed space of that length first
+RetCode DoorPlate::AllocKey(uint32_t size, uint64_t* offset) {
+    uint64_t* list = &meta_.free_keys[size - kMaxInlineKeyLen - 1];
+    if (__atomic_load_n(list, __ATOMIC_RELAXED) != 0) {
+        alloc_stats_.Lock(&alloc_mu_);
+        const uint64_t head = *list;
+        RetCode ret = kSucc;
+        if (head != 0) {
+            const uint64_t limit =
+                __atomic_load_n(&meta_.arena, __ATOMIC_RELAXED);
+            const char* link = head - 1 <= limit - size
+                                   ? arena_.At(head - 1, sizeof(uint64_t))
+                                   : NULL;
+            if (link == NULL) {
+                ret = kCorruption;
+            } else {
+                uint64_t next;
+                memcpy(&next, link, sizeof(next));
+                __atomic_store_n(list, next, __ATOMIC_RELAXED);
+                __atomic_fetch_sub(&meta_.arena_free, size, __ATOMIC_RELAXED);
+                *offset = head - 1;
+            }
+        }
+        alloc_stats_.Unlock(&alloc_mu_);
+        if (head != 0) {
+            return ret;
+        }
     }
 
-    *location = (items_ + index)->location;
+    // Keys never straddle two arena segments
+    uint64_t end = __atomic_load_n(&meta_.arena, __ATOMIC_RELAXED);
+    uint64_t o;
+    do {
+        o = end;
+        if (o + size > KeyArena::SegmentEnd(o)) {
+            o = KeyArena::SegmentEnd(o);
+        }
+    } while (!__atomic_compare_exchange_n(&meta_.arena, &end, o + size, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *offset = o;
+    return arena_.Reserve(o + size);
+}
+
+// Put the arena space of the key in |slot| on its free list. Readers
+// that still look at the key see the chain's version change first.
+void DoorPlate::FreeKey(const Slot& slot) {
+    if (slot.key_size <= kMaxInlineKeyLen) {
+        return;
+    }
+    char* data = arena_.At(slot.key, slot.key_size);
+    if (data == NULL) {
+        return;  // damaged, never to be handed out again
+    }
+    uint64_t* list = &meta_.free_keys[slot.key_size - kMaxInlineKeyLen - 1];
+    alloc_stats_.Lock(&alloc_mu_);
+    memcpy(data, list, sizeof(uint64_t));
+    __atomic_store_n(list, slot.key + 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&meta_.arena_free, slot.key_size, __ATOMIC_RELAXED);
+    alloc_stats_.Unlock(&alloc_mu_);
+}
+
+RetCode DoorPlate::StoreKey(const std::string& key, Slot* slot) {
+    slot->key_size = key.size();
+    if (key.size() <= kMaxInlineKeyLen) {
+        slot->key = InlineKey(key.data(), key.size());
+        return kSucc;
+    }
+
+    uint64_t offset;
+    RetCode ret = AllocKey(key.size(), &offset);
+    if (ret != kSucc) {
+        return ret;
+    }
+    char* data = arena_.At(offset, key.size());
+    if (data == NULL) {
+        return kCorruption;
+    }
+    memcpy(data, key.data(), key.size());
+    slot->key = offset;
     return kSucc;
 }
 
-RetCode DoorPlate::GetRangeLocation(
-    const std::string& lower, const std::string& upper,
-    std::map<std::string, Location>* locations) {
-    int count = 0;
-    for (Item* it = items_ + kMaxDoorCnt - 1; it >= items_; it--) {
-        if (!it->in_use) {
-            continue;
+// Split buckets while the table is too full. Only one thread splits at a
+// time; the others leave the work to it rather than wait.
+RetCode DoorPlate::MaybeSplit() {
+    if (!split_stats_.TryLock(&split_mu_)) {
+        return kSucc;
+    }
+    RetCode ret = kSucc;
+    while (ret == kSucc && LevelOf(meta_.shape) < kMaxLevel &&
+           __atomic_load_n(&meta_.count, __ATOMIC_RELAXED) +
+                   __atomic_load_n(&meta_.deleted, __ATOMIC_RELAXED) >
+               kMaxLoadFactor * BucketCount(meta_.shape) * kBucketSlots) {
+        ret = Split();
+    }
+    split_stats_.Unlock(&split_mu_);
+    return ret;
+}
+
+// Split the bucket under the split pointer; holds split_mu_. The new
+// bucket is filled before the new shape makes it reachable, and the old
+// chain stays owned until then. Tombstones of the chain are dropped.
+// Every overflow bucket the two halves need is in hand before the chain
+// is emptied, so a split either moves every key or changes nothing.
+RetCode DoorPlate::Split() {
+    const uint64_t shape = meta_.shape;
+    const uint64_t buckets = BucketCount(shape);
+    RetCode ret = buckets_.Reserve(buckets + 1);
+    if (ret != kSucc) {
+        return ret;
+    }
+    Bucket* b = buckets_.At(SplitOf(shape));
+    Bucket* dst = buckets_.At(buckets);
+    if (b == NULL || dst == NULL) {
+        return kCorruption;
+    }
+    OwnBucket(b, &chain_stats_);
+
+    uint64_t level = LevelOf(shape);
+    uint64_t split = SplitOf(shape) + 1;
+    if (split == (kInitialBuckets << level)) {
+        level++;
+        split = 0;
+    }
+    const uint64_t next_shape = (split << 32) | level;
+
+    // Check the whole chain and collect the hashes before moving anything
+    std::vector<Slot> slots;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> spare;  // overflow buckets to chain the halves
+    uint64_t deleted = 0;
+    for (Bucket* o = b; o != NULL; o = o->next == 0 ? NULL : Chain(o->next)) {
+        deleted += __builtin_popcount(MatchCtrl(o->ctrl, kCtrlDeleted));
+        for (uint32_t m = MatchFull(o->ctrl); m != 0; m &= m - 1) {
+            const Slot& slot = o->slots[__builtin_ctz(m)];
+            const char* data;
+            uint64_t inline_key;
+            ret = SlotKey(slot, &data, &inline_key);
+            if (ret != kSucc) {
+                DisownBucket(b, &chain_stats_);
+                return ret;
+            }
+            slots.push_back(slot);
+            hashes.push_back(StrHash(data, slot.key_size));
         }
-        std::string key(it->key, it->key_size);
-        if ((key >= lower || lower.empty()) && (key < upper || upper.empty())) {
-            locations->insert(
-                std::pair<std::string, Location>(key, it->location));
-            if (++count > kMaxRangeBufCount) {
-                return kOutOfMemory;
+        if (o->next != 0) {
+            if (Chain(o->next) == NULL) {
+                DisownBucket(b, &chain_stats_);
+                return kCorruption;
+            }
+            spare.push_back(o->next);
+        }
+    }
+
+    // Each half needs one overflow bucket per kBucketSlots keys past its
+    // first kBucketSlots. Take what the chain's own overflow buckets do
+    // not cover before touching anything.
+    uint64_t to_new = 0;
+    for (size_t k = 0; k < hashes.size(); k++) {
+        to_new += BucketOf(hashes[k], next_shape) == buckets;
+    }
+    const uint64_t to_old = hashes.size() - to_new;
+    const uint64_t need =
+        (to_old == 0 ? 0 : (to_old - 1) / kBucketSlots) +
+        (to_new == 0 ? 0 : (to_new - 1) / kBucketSlots);
+    const size_t own = spare.size();
+    alloc_stats_.Lock(&alloc_mu_);
+    while (spare.size() < need) {
+        uint32_t next;
+        ret = AllocBucket(&next);
+        if (ret != kSucc) {
+            for (size_t k = own; k < spare.size(); k++) {
+                FreeBucket(spare[k]);
             }
+            alloc_stats_.Unlock(&alloc_mu_);
+            DisownBucket(b, &chain_stats_);
+            return ret;
         }
+        spare.push_back(next);
     }
+    alloc_stats_.Unlock(&alloc_mu_);
+
+    // Empty the chain; each slot lands either back in the old bucket or
+    // in the new one, and keys in the arena stay where they are
+    BeginChange(b);
+    ClearBucket(b);
+    ClearBucket(dst);
+    for (size_t k = 0; k < slots.size(); k++) {
+        Bucket* o = buckets_.At(BucketOf(hashes[k], next_shape));
+        uint32_t empty;
+        while ((empty = MatchCtrl(o->ctrl, kCtrlEmpty)) == 0) {
+            if (o->next == 0) {
+                o->next = spare.back();
+                spare.pop_back();
+                ClearBucket(Chain(o->next));
+            }
+            o = Chain(o->next);
+        }
+        uint32_t i = __builtin_ctz(empty);
+        o->slots[i] = slots[k];
+        o->ctrl[i] = TagOf(hashes[k]);
+    }
+    __atomic_store_n(&meta_.shape, next_shape, __ATOMIC_RELEASE);
+    EndChange(b);
+    DisownBucket(b, &chain_stats_);
+
+    // The chain's overflow buckets the halves did not need
+    alloc_stats_.Lock(&alloc_mu_);
+    for (size_t k = 0; k < spare.size(); k++) {
+        FreeBucket(spare[k]);
+    }
+    alloc_stats_.Unlock(&alloc_mu_);
+    __atomic_fetch_sub(&meta_.deleted, deleted, __ATOMIC_RELAXED);
+    counters_.Add(kSplits);
     return kSucc;
 }
 
+RetCode DoorPlate::AddOrUpdate(const std::string& key,
+                               LocationWriter* writer) {
+    if (key.size() > kMaxKeyLen) {
+        return kInvalidArgument;
+    }
+    FLIGHT_PHASE(kPhaseIndex);
+
+    uint64_t hash = StrHash(key.data(), key.size());
+    Bucket* head = OwnChain(hash);
+    if (head == NULL) {
+        return kCorruption;
+    }
+    Probe probe;
+    uint64_t walked = 0;
+    RetCode ret = Lookup(key, hash, head, &probe, &walked);
+    counters_.Add(kUpdates);
+    counters_.Add(kUpdateBuckets, walked);
+    if (ret != kSucc) {
+        DisownBucket(head, &chain_stats_);
+        return ret;
+    }
+
+    // A new item gets its slot before the record is written, so that
+    // running out of room never leaves a record the table does not know
+    Location current;
+    Slot* slot;
+    bool tombstone = false;
+    if (probe.match != NULL) {
+        current = probe.match->slots[probe.match_slot].location;
+        slot = &probe.match->slots[probe.match_slot];
+    } else {
+        if (probe.empty == NULL) {
+            BeginChange(head);
+            ret = Place(probe.tail, &probe.empty);
+            EndChange(head);
+            if (ret != kSucc) {
+                DisownBucket(head, &chain_stats_);
+                return ret;
+            }
+            probe.empty_slot = 0;
+        }
+        tombstone = probe.empty->ctrl[probe.empty_slot] == kCtrlDeleted;
+        // Readers skip the slot until its control byte is set
+        slot = &probe.empty->slots[probe.empty_slot];
+        ret = StoreKey(key, slot);
+        if (ret == kSucc) {
+            // Should the write fail, range scans skip the key
+            ret = keys_.Insert(key);
+        }
+        if (ret != kSucc) {
+            DisownBucket(head, &chain_stats_);
+            return ret;
+        }
+    }
+
+    Location l;
+    {
+        // Storing the value is not part of the index's time
+        FLIGHT_PHASE(kPhaseOther);
+        ret = writer->Write(probe.match != NULL ? &current : NULL, &l);
+    }
+    if (ret != kSucc) {
+        DisownBucket(head, &chain_stats_);
+        return ret;
+    }
+    BeginChange(head);
+    slot->location = l;
+    if (probe.match == NULL) {
+        probe.empty->ctrl[probe.empty_slot] = TagOf(hash);  // Place
+    }
+    EndChange(head);
+    DisownBucket(head, &chain_stats_);
+    if (probe.match != NULL) {
+        return kSucc;
+    }
+    __atomic_fetch_add(&meta_.count, 1, __ATOMIC_RELAXED);
+    if (tombstone) {
+        __atomic_fetch_sub(&meta_.deleted, 1, __ATOMIC_RELAXED);
+        return kSucc;
+    }
+    return MaybeSplit();
+}
+
+RetCode DoorPlate::Delete(const std::string& key, LocationWriter* writer) {
+    if (key.size() > kMaxKeyLen) {
+        return kInvalidArgument;
+    }
+    FLIGHT_PHASE(kPhaseIndex);
+
+    uint64_t hash = StrHash(key.data(), key.size());
+    Bucket* head = OwnChain(hash);
+    if (head == NULL) {
+        return kCorruption;
+    }
+    Probe probe;
+    uint64_t walked = 0;
+    RetCode ret = Lookup(key, hash, head, &probe, &walked);
+    counters_.Add(kDeletes);
+    if (ret != kSucc) {
+        DisownBucket(head, &chain_stats_);
+        return ret;
+    }
+
+    // The slot is not emptied, so the chain goes on past it. It keeps
+    // the key size, but the arena space of a long key is freed.
+    Slot* slot =
+        probe.match != NULL ? &probe.match->slots[probe.match_slot] : NULL;
+    Location current;
+    Location l;
+    if (slot != NULL) {
+        current = slot->location;
+    }
+    {
+        FLIGHT_PHASE(kPhaseOther);
+        ret = writer->Write(slot != NULL ? &current : NULL, &l);
+    }
+    if (ret != kSucc || slot == NULL) {
+        DisownBucket(head, &chain_stats_);
+        return ret;
+    }
+    BeginChange(head);
+    probe.match->ctrl[probe.match_slot] = kCtrlDeleted;
+    slot->location = l;
+    EndChange(head);
+    FreeKey(*slot);
+    // Still owning the chain, so that no insert of the key races
+    ret = keys_.Remove(key);
+    DisownBucket(head, &chain_stats_);
+    __atomic_fetch_sub(&meta_.count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&meta_.deleted, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+RetCode DoorPlate::Find(const std::string& key, Location* location) {
+    FLIGHT_PHASE(kPhaseIndex);
+    uint64_t hash = StrHash(key.data(), key.size());
+    uint64_t walked = 0;
+    for (bool retry = false;; retry = true) {
+        if (retry) {
+            counters_.Add(kFindRetries);
+        }
+        uint32_t index = BucketOf(hash, Shape());
+        Bucket* head = buckets_.At(index);
+        if (head == NULL) {
+            return kCorruption;
+        }
+        uint32_t version = ReadVersion(head);
+        if ((version & 1) != 0) {
+            CpuRelax();
+            continue;
+        }
+        Location l;
+        RetCode ret = Walk(key, hash, head, version, &l, &walked);
+        // Every read of the chain must happen before the version check.
+        // A split that finished before we started moves the key away
+        // without touching the version we saw, hence the shape check.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ret == kIncomplete ||
+            (__atomic_load_n(&head->version, __ATOMIC_RELAXED) & kCounter) !=
+                version ||
+            BucketOf(hash, Shape()) != index) {
+            continue;
+        }
+        if (ret == kSucc) {
+            *location = l;
+        }
+        counters_.Add(kFinds);
+        counters_.Add(kFindBuckets, walked);
+        return ret;
+    }
+}
+
+namespace {
+
+// Looks up the location of every key a range scan meets
+class LocationFinder : public KeyVisitor {
+public:
+    LocationFinder(DoorPlate* plate, RecordVisitor* visitor)
+        : plate_(plate), visitor_(visitor) {}
+
+    RetCode Visit(const std::string& key) override {
+        Location l;
+        RetCode ret = plate_->Find(key, &l);
+        if (ret == kNotFound) {
+            return kSucc;  // deleted, or its first write failed
+        }
+        return ret == kSucc ? visitor_->Visit(key, l) : ret;
+    }
+
+private:
+    DoorPlate* plate_;
+    RecordVisitor* visitor_;
+};
+
+}  // namespace
+
+RetCode DoorPlate::Range(const std::string& lower, const std::string& upper,
+                         RecordVisitor* visitor) {
+    LocationFinder finder(this, visitor);
+    return keys_.Scan(lower, upper, &finder);
+}
+
+void DoorPlate::GetProperties(Properties* props) {
+    const uint64_t finds = counters_.Get(kFinds);
+    const uint64_t updates = counters_.Get(kUpdates);
+    AddProperty(props, "polar.plate.finds", finds);
+    AddProperty(props, "polar.plate.find_retries", counters_.Get(kFindRetries));
+    AddProperty(props, "polar.plate.find_probe_length",
+                finds == 0 ? 0.0
+                           : static_cast<double>(counters_.Get(kFindBuckets)) /
+                                 finds);
+    AddProperty(props, "polar.plate.updates", updates);
+    AddProperty(props, "polar.plate.update_probe_length",
+                updates == 0
+                    ? 0.0
+                    : static_cast<double>(counters_.Get(kUpdateBuckets)) /
+                          updates);
+    AddProperty(props, "polar.plate.deletes", counters_.Get(kDeletes));
+    AddProperty(props, "polar.plate.splits", counters_.Get(kSplits));
+
+    const uint64_t items = __atomic_load_n(&meta_.count, __ATOMIC_RELAXED);
+    const uint64_t buckets = BucketCount(Shape());
+    AddProperty(props, "polar.plate.items", items);
+    AddProperty(props, "polar.plate.tombstones",
+                __atomic_load_n(&meta_.deleted, __ATOMIC_RELAXED));
+    AddProperty(props, "polar.plate.buckets", buckets);
+    AddProperty(props, "polar.plate.overflow_buckets",
+                static_cast<uint64_t>(
+                    __atomic_load_n(&meta_.overflow, __ATOMIC_RELAXED)));
+    AddProperty(props, "polar.plate.load_factor",
+                static_cast<double>(items) / (buckets * kBucketSlots));
+    AddProperty(props, "polar.plate.key_arena_bytes",
+                __atomic_load_n(&meta_.arena, __ATOMIC_RELAXED));
+    AddProperty(props, "polar.plate.key_arena_free_bytes",
+                __atomic_load_n(&meta_.arena_free, __ATOMIC_RELAXED));
+    chain_stats_.GetProperties("polar.lock.chain", props);
+    alloc_stats_.GetProperties("polar.lock.alloc", props);
+    split_stats_.GetProperties("polar.lock.split", props);
+}
+
+RetCode DoorPlate::SaveTo(CheckpointWriter* writer) {
+    // Never bless an image part that was damaged or is still unchecked
+    if (!buckets_.VerifyAll() || !overflow_.VerifyAll() ||
+        !arena_.VerifyAll()) {
+        return kCorruption;
+    }
+    buckets_.SaveTo(writer, kIndexSection);
+    overflow_.SaveTo(writer, kOverflowSection);
+    arena_.SaveTo(writer, kKeyArenaSection);
+    writer->AddSection(kIndexMetaSection, &meta_, sizeof(meta_));
+    return keys_.SaveTo(writer);
+}
+
 }  // namespace polar_race
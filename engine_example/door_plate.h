@@ -1,48 +1,203 @@
 // Copyright [2018] Alibaba Cloud All rights reserved
 #ifndef ENGINE_EXAMPLE_DOOR_PLATE_H_
 #define ENGINE_EXAMPLE_DOOR_PLATE_H_
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
-#include <map>
 #include <string>
+#include <vector>
 
+#include "checkpoint.h"
 #include "data_store.h"
 #include "include/engine.h"
+#include "include/lock_stats.h"
+#include "segment_array.h"
+#include "skiplist.h"
+#include "stats.h"
 
 namespace polar_race {
 
 static const uint32_t kMaxKeyLen = 32;
+static const uint32_t kMaxInlineKeyLen = 8;
+static const uint32_t kBucketSlots = 16;
 
-struct Item {
-    Item() : key_size(0), in_use(0) {}
+// Control bytes; a used slot holds 0x80 | the top 7 bits of the key hash.
+// A deleted slot matches no tag but does not end the chain either.
+static const uint8_t kCtrlEmpty = 0;
+static const uint8_t kCtrlDeleted = 1;
+static const uint8_t kCtrlFull = 0x80;
+
+// Lives in zero-filled mappings, so no constructor
+struct Slot {
+    uint64_t key;  // the key itself if it fits, else its key arena offset
     Location location;
-    char key[kMaxKeyLen];
     uint32_t key_size;
-    uint8_t in_use;
 };
 
-// Hash index for key
+// One cache line of control bytes probed 16 at a time, then the slots.
+// Slots are filled in order, so the first empty one ends a chain; deleted
+// slots are taken again by new keys and dropped when the chain splits.
+struct alignas(64) Bucket {
+    uint8_t ctrl[kBucketSlots];
+    uint32_t next;  // overflow bucket index + 1, 0 ends the chain
+    // Only used in the primary bucket of a chain: the high bit is set
+    // while a writer owns the chain, the rest is a seqlock counter that
+    // is odd while the owner changes it
+    uint32_t version;
+    Slot slots[kBucketSlots];
+};
+
+// Decides what DoorPlate::AddOrUpdate stores for a key
+class LocationWriter {
+public:
+    virtual ~LocationWriter() {}
+
+    // |current| is NULL if the key is not in the table. On kSucc |l| is
+    // stored for the key, anything else leaves the table as it was. For
+    // DoorPlate::Delete |l| is the location of the delete record, and a
+    // key that is not in the table stays out of it whatever is returned.
+    virtual RetCode Write(const Location* current, Location* l) = 0;
+};
+
+typedef SegmentArray<Bucket, 8> BucketArray;
+typedef SegmentArray<char, 16> KeyArena;
+
+// Hash index for key, kept in memory and saved to the checkpoint on
+// clean shutdown.
+//
+// Linear hashing: the table starts with a few buckets and splits one
+// bucket (the one under the split pointer) per insert whenever the load
+// factor is exceeded, so it grows without ever rehashing as a whole.
+// Buckets that fill up chain overflow buckets. Deleted keys leave
+// tombstones, which count towards the load until a split drops them.
+//
+// Buckets are laid out Swiss-table style: 7-bit hash tags in a control
+// line are matched 16 at a time, keys up to 8 bytes are stored in the slot
+// and longer ones in a key arena, so a lookup touches the control line,
+// one slot and at most one arena line. The arena space of a deleted key
+// goes on a free list by key length for the next key of that length.
+//
+// Next to the table, a skiplist keeps the keys in order for range scans.
+// Deleted keys are removed from it.
+//
+// Safe for concurrent use. Writers claim a chain by CAS on the version
+// word of its primary bucket; readers take no lock, they copy what they
+// need and retry if the version moved meanwhile. Splits run one at a time
+// and own the chain being split like any writer.
 class DoorPlate {
 public:
-    explicit DoorPlate(const std::string& path);
+    DoorPlate();
     ~DoorPlate();
 
+    // Start with an empty table
     RetCode Init();
+    // Adopt the table image of a checkpoint; it is verified lazily
+    RetCode Init(CheckpointReader* checkpoint);
 
-    RetCode AddOrUpdate(const std::string& key, const Location& l);
+    // Store the location |writer| produces for |key|. The writer runs
+    // while the key's chain is owned, so the records of one key reach the
+    // log in the order the table sees them.
+    RetCode AddOrUpdate(const std::string& key, LocationWriter* writer);
+
+    // Drop |key|, running |writer| while its chain is owned like
+    // AddOrUpdate does. The writer runs even if there is no such key, so
+    // it can tell the caller or act on the key being absent.
+    RetCode Delete(const std::string& key, LocationWriter* writer);
 
     RetCode Find(const std::string& key, Location* location);
 
-    RetCode GetRangeLocation(const std::string& lower, const std::string& upper,
-                             std::map<std::string, Location>* locations);
+    // Visit the keys in [lower, upper) in order, with their locations; an
+    // empty bound is open. Not a snapshot: keys written during the scan may
+    // or may not show up.
+    RetCode Range(const std::string& lower, const std::string& upper,
+                  RecordVisitor* visitor);
+
+    // Add the table image to |writer|; fails if any part of an adopted
+    // image turned out to be corrupted
+    RetCode SaveTo(CheckpointWriter* writer);
+
+    // Lookups and the buckets they walk, splits and how full the table is
+    void GetProperties(Properties* props);
 
 private:
-    std::string dir_;
-    int fd_;
-    Item* items_;
+    enum Counter {
+        kFinds,
+        kFindBuckets,  // walked by finds, retries included
+        kFindRetries,  // a writer or a split got in the way
+        kUpdates,
+        kUpdateBuckets,
+        kDeletes,
+        kSplits,
+        kCounters
+    };
+
+    // Fields are accessed with atomic builtins, so the struct can still
+    // be saved to the checkpoint as is
+    struct Meta {
+        // Round of splits in the low half (2^level * initial buckets), next
+        // bucket to split in this round in the high half. One word so that
+        // readers see both change together.
+        uint64_t shape;
+        uint64_t count;     // items in the table
+        uint32_t overflow;  // overflow buckets ever allocated
+        uint32_t free;      // free overflow bucket list, index + 1
+        uint64_t arena;     // bytes used in the key arena
+        uint64_t deleted;   // tombstones in the table
+        uint64_t arena_free;  // bytes of the arena on the free key lists
+        // Freed arena keys by length, arena offset + 1, linked through
+        // their first bytes
+        uint64_t free_keys[kMaxKeyLen - kMaxInlineKeyLen];
+    };
+
+    // Result of walking a chain
+    struct Probe {
+        Bucket* match;  // bucket holding the key, slot |match_slot|
+        uint32_t match_slot;
+        Bucket* empty;  // first free slot, |empty_slot|, if no match
+        uint32_t empty_slot;
+        Bucket* tail;   // last bucket of the chain
+    };
+
+    Meta meta_;
+    BucketArray buckets_;
+    BucketArray overflow_;
+    KeyArena arena_;
+    SkipList keys_;
+    pthread_mutex_t alloc_mu_;  // guards meta_.overflow, meta_.free and
+                                // the free key lists
+    pthread_mutex_t split_mu_;  // one split at a time
+    LockStats chain_stats_;     // owning chains, see OwnBucket
+    LockStats alloc_stats_;     // of alloc_mu_
+    LockStats split_stats_;     // of split_mu_
+    Counters<kCounters> counters_;
+
+    static uint64_t BucketCount(uint64_t shape);
+    static uint32_t BucketOf(uint64_t hash, uint64_t shape);
+    uint64_t Shape() const {
+        return __atomic_load_n(&meta_.shape, __ATOMIC_ACQUIRE);
+    }
+    // NULL if |next| is out of range, which only a torn read or a damaged
+    // checkpoint can produce
+    Bucket* Chain(uint32_t next) {
+        return next - 1 < overflow_.capacity() ? overflow_.At(next - 1) : NULL;
+    }
+
+    Bucket* OwnChain(uint64_t hash);
 
-    int CalcIndex(const std::string& key);
+    RetCode SlotKey(const Slot& slot, const char** data, uint64_t* inline_key);
+    RetCode Lookup(const std::string& key, uint64_t hash, Bucket* head,
+                   Probe* probe, uint64_t* walked);
+    RetCode Walk(const std::string& key, uint64_t hash, Bucket* head,
+                 uint32_t version, Location* location, uint64_t* walked);
+    RetCode AllocBucket(uint32_t* next);
+    void FreeBucket(uint32_t next);
+    RetCode Place(Bucket* tail, Bucket** bucket);
+    RetCode AllocKey(uint32_t size, uint64_t* offset);
+    void FreeKey(const Slot& slot);
+    RetCode StoreKey(const std::string& key, Slot* slot);
+    RetCode MaybeSplit();
+    RetCode Split();
 };
 
 }  // namespace polar_race
@@ -2,97 +2,498 @@
 #include "engine_example.h"
 
 #include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <map>
+#include <algorithm>
+#include <memory>
+#include <vector>
 
+#include "include/flight_recorder.h"
 #include "util.h"
 
 namespace polar_race {
 
 static const char kLockFile[] = "LOCK";
+static const char kCheckpointFile[] = "CHECKPOINT";
 
-RetCode Engine::Open(const std::string& name, Engine** eptr) {
-    return EngineExample::Open(name, eptr);
-}
+namespace {
 
-Engine::~Engine() {}
+// Stores a location that is already known, counting the one it replaces
+// as garbage
+class ReplayWriter : public LocationWriter {
+public:
+    ReplayWriter(DataStore* store, uint32_t key_size, const Location& l)
+        : store_(store), key_size_(key_size), l_(l) {}
 
-RetCode EngineExample::Open(const std::string& name, Engine** eptr) {
-    *eptr = NULL;
-    EngineExample* engine_example = new EngineExample(name);
+    RetCode Write(const Location* current, Location* l) override {
+        if (current != NULL) {
+            store_->AddValueGarbage(*current, key_size_);
+        }
+        *l = l_;
+        return kSucc;
+    }
 
-    RetCode ret = engine_example->plate_.Init();
-    if (ret != kSucc) {
-        delete engine_example;
+private:
+    DataStore* store_;
+    uint32_t key_size_;
+    Location l_;
+};
+
+// Appends the record while the index holds its key
+class AppendWriter : public LocationWriter {
+public:
+    AppendWriter(DataStore* store, const PolarString& key,
+                 const PolarString& value)
+        : store_(store), key_(key), value_(value) {}
+
+    RetCode Write(const Location* current, Location* l) override {
+        RetCode ret = store_->Append(key_, value_, l);
+        if (ret == kSucc && current != NULL) {
+            store_->AddValueGarbage(*current, key_.size());
+        }
         return ret;
     }
-    ret = engine_example->store_.Init();
-    if (ret != kSucc) {
-        delete engine_example;
+
+private:
+    DataStore* store_;
+    const PolarString& key_;
+    const PolarString& value_;
+};
+
+// Appends a delete record while the index holds its key. The value it
+// deletes is garbage now; the record itself is not, see Compactor.
+class DeleteWriter : public LocationWriter {
+public:
+    DeleteWriter(DataStore* store, const PolarString& key)
+        : store_(store), key_(key) {}
+
+    RetCode Write(const Location* current, Location* l) override {
+        if (current == NULL) {
+            return kNotFound;
+        }
+        RetCode ret = store_->AppendDelete(key_, l);
+        if (ret == kSucc) {
+            store_->AddValueGarbage(*current, key_.size());
+        }
         return ret;
     }
 
+private:
+    DataStore* store_;
+    const PolarString& key_;
+};
+
+// Appends the extent list of a streamed value while the index holds its
+// key; the extents themselves are already in the log
+class ExtentListWriter : public LocationWriter {
+public:
+    ExtentListWriter(DataStore* store, const PolarString& key,
+                     const std::vector<Location>& extents)
+        : store_(store), key_(key), extents_(extents) {}
+
+    RetCode Write(const Location* current, Location* l) override {
+        RetCode ret = store_->AppendExtentList(key_, extents_, l);
+        if (ret == kSucc && current != NULL) {
+            store_->AddValueGarbage(*current, key_.size());
+        }
+        return ret;
+    }
+
+private:
+    DataStore* store_;
+    const PolarString& key_;
+    const std::vector<Location>& extents_;
+};
+
+// Streams a value that is already in memory
+class StringSource : public ValueSource {
+public:
+    explicit StringSource(const PolarString& value) : value_(value), pos_(0) {}
+
+    RetCode Read(char* buf, size_t size, size_t* n) override {
+        *n = std::min(size, value_.size() - pos_);
+        memcpy(buf, value_.data() + pos_, *n);
+        pos_ += *n;
+        return kSucc;
+    }
+
+private:
+    const PolarString& value_;
+    size_t pos_;
+};
+
+// Fill |buf| from |source| until it is full or the value ends
+RetCode FillChunk(ValueSource& source, char* buf, size_t size, size_t* n,
+                  bool* end) {
+    *n = 0;
+    *end = false;
+    while (*n < size) {
+        size_t got = 0;
+        RetCode ret = source.Read(buf + *n, size - *n, &got);
+        if (ret != kSucc) {
+            return ret;
+        }
+        if (got > size - *n) {
+            return kInvalidArgument;
+        }
+        if (got == 0) {
+            *end = true;
+            break;
+        }
+        *n += got;
+    }
+    return kSucc;
+}
+
+// Reads the values of a range scan as the index meets their keys
+class RangeReader : public RecordVisitor {
+public:
+    RangeReader(DataStore* store, Visitor* visitor)
+        : store_(store), visitor_(visitor) {}
+
+    RetCode Visit(const std::string& key, const Location& l) override {
+        RetCode ret = store_->Read(l, &value_);
+        if (ret == kSucc) {
+            visitor_->Visit(key, value_);
+        }
+        return ret;
+    }
+
+private:
+    DataStore* store_;
+    Visitor* visitor_;
+    std::string value_;
+};
+
+// Feeds the records replayed from the data files into the index
+class PlateBuilder : public RecordVisitor {
+public:
+    PlateBuilder(DoorPlate* plate, DataStore* store)
+        : plate_(plate), store_(store) {}
+
+    RetCode Visit(const std::string& key, const Location& l) override {
+        ReplayWriter writer(store_, key.size(), l);
+        if (l.kind() == kDeleteRecord) {
+            return plate_->Delete(key, &writer);
+        }
+        return plate_->AddOrUpdate(key, &writer);
+    }
+
+private:
+    DoorPlate* plate_;
+    DataStore* store_;
+};
+
+}  // namespace
+
+namespace engine_example {
+
+// Registered as "engine_example"
+RetCode Open(const std::string& name, const Options& options, Engine** eptr) {
+    return EngineExample::Open(name, options, eptr);
+}
+
+}  // namespace engine_example
+
+RetCode EngineExample::Open(const std::string& name, const Options& options,
+                            Engine** eptr) {
+    *eptr = NULL;
+    if (!FileExists(name) && 0 != mkdir(name.c_str(), 0755)) {
+        return kIOError;
+    }
+    EngineExample* engine_example = new EngineExample(name, options);
+
     if (0 != LockFile(name + "/" + kLockFile, &(engine_example->db_lock_))) {
         delete engine_example;
         return kIOError;
     }
 
+    RetCode ret = engine_example->Recover();
+    if (ret != kSucc) {
+        delete engine_example;
+        return ret;
+    }
+
+    engine_example->opened_ = true;
+    engine_example->compactor_.Start();
     *eptr = engine_example;
     return kSucc;
 }
 
+RetCode EngineExample::Recover() {
+    // Fast path: a clean shutdown left the index and the append position
+    std::string path = dir_ + "/" + kCheckpointFile;
+    if (checkpoint_.Open(path) == kSucc) {
+        if (store_.Init(&checkpoint_) == kSucc &&
+            plate_.Init(&checkpoint_) == kSucc) {
+            // The mapping stays usable; removing the file forces a replay
+            // should we crash before the next clean close
+            if (0 != unlink(path.c_str()) || 0 != SyncDir(dir_)) {
+                return kIOError;
+            }
+            recovery_ = "checkpoint";
+            return kSucc;
+        }
+        checkpoint_.Close();
+    }
+    if (FileExists(path) && 0 != unlink(path.c_str())) {
+        return kIOError;
+    }
+
+    // Slow path: rebuild the index from the data files
+    RetCode ret = store_.Init();
+    if (ret != kSucc) {
+        return ret;
+    }
+    ret = plate_.Init();
+    if (ret != kSucc) {
+        return ret;
+    }
+    recovery_ = "replay";
+    PlateBuilder builder(&plate_, &store_);
+    return store_.Recover(&builder);
+}
+
+RetCode EngineExample::SaveCheckpoint() {
+    CheckpointWriter writer(dir_ + "/" + kCheckpointFile);
+    RetCode ret = store_.SaveTo(&writer);
+    if (ret != kSucc) {
+        return ret;
+    }
+    ret = plate_.SaveTo(&writer);
+    if (ret != kSucc) {
+        return ret;
+    }
+    return writer.Commit();
+}
+
 EngineExample::~EngineExample() {
+    compactor_.Stop();
+    if (opened_) {
+        SaveCheckpoint();
+    }
     if (db_lock_) {
         UnlockFile(db_lock_);
     }
 }
 
 RetCode EngineExample::Write(const PolarString& key, const PolarString& value) {
-    pthread_mutex_lock(&mu_);
-    Location location;
-    RetCode ret = store_.Append(value.ToString(), &location);
+    FLIGHT_OP(kFlightWrite);
+    if (key.size() > kMaxKeyLen) {
+        // Never log a record the index can not take back on replay
+        return kInvalidArgument;
+    }
+    if (!DataStore::FitsRecord(key.size(), value.size())) {
+        StringSource source(value);
+        return WriteStream(key, source);
+    }
+    counters_.Add(kWrites);
+    EpochGuard guard(&epoch_);
+    AppendWriter writer(&store_, key, value);
+    return plate_.AddOrUpdate(key.ToString(), &writer);
+}
+
+RetCode EngineExample::WriteStream(const PolarString& key,
+                                   ValueSource& source) {
+    FLIGHT_OP(kFlightWrite);
+    if (key.size() > kMaxKeyLen) {
+        return kInvalidArgument;
+    }
+    std::unique_ptr<char[]> buf(new char[kStreamChunk]);
+    size_t n;
+    bool end;
+    RetCode ret = FillChunk(source, buf.get(), kStreamChunk, &n, &end);
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (end) {
+        // Small enough for a plain record
+        return Write(key, PolarString(buf.get(), n));
+    }
+    counters_.Add(kWriteStreams);
+
+    // The extents are only reachable once the list is in the index, and
+    // must not be compacted away before that. The pin, unlike an epoch,
+    // does not hold up compaction of older files while |source| takes
+    // its time.
+    const uint32_t pin = store_.Pin();
+    std::vector<Location> extents;
+    while (ret == kSucc && n > 0) {
+        Location l;
+        {
+            EpochGuard guard(&epoch_);
+            ret = store_.AppendRecord(key, PolarString(buf.get(), n), &l,
+                                      kExtentRecord);
+        }
+        if (ret != kSucc) {
+            break;
+        }
+        extents.push_back(l);
+        if (end) {
+            break;
+        }
+        ret = FillChunk(source, buf.get(), kStreamChunk, &n, &end);
+    }
     if (ret == kSucc) {
-        ret = plate_.AddOrUpdate(key.ToString(), location);
+        EpochGuard guard(&epoch_);
+        ExtentListWriter writer(&store_, key, extents);
+        ret = plate_.AddOrUpdate(key.ToString(), &writer);
+    }
+    store_.Unpin(pin);
+    if (ret != kSucc) {
+        for (auto& l : extents) {
+            store_.AddGarbage(l, key.size());
+        }
     }
-    pthread_mutex_unlock(&mu_);
     return ret;
 }
 
+RetCode EngineExample::ReadStream(const PolarString& key, uint64_t offset,
+                                  uint64_t len, ValueSink& sink) {
+    FLIGHT_OP(kFlightRead);
+    counters_.Add(kReadStreams);
+    EpochGuard guard(&epoch_);
+    Location location;
+    RetCode ret = plate_.Find(key.ToString(), &location);
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (location.compressed()) {
+        // Never more than one stream chunk
+        std::string value;
+        ret = store_.Read(location, &value);
+        if (ret != kSucc) {
+            return ret;
+        }
+        if (offset > value.size()) {
+            return kInvalidArgument;
+        }
+        len = std::min<uint64_t>(len, value.size() - offset);
+        return len == 0 ? kSucc
+                        : sink.Write(PolarString(value.data() + offset, len));
+    }
+    std::vector<Location> extents;
+    if (location.kind() == kExtentListRecord) {
+        ret = store_.ReadExtentList(location, &extents);
+        if (ret != kSucc) {
+            return ret;
+        }
+    } else {
+        extents.push_back(location);
+    }
+    uint64_t total = 0;
+    for (auto& e : extents) {
+        total += e.size();
+    }
+    if (offset > total) {
+        return kInvalidArgument;
+    }
+    len = std::min(len, total - offset);
+
+    std::unique_ptr<char[]> buf(new char[kStreamChunk]);
+    for (size_t i = 0; i < extents.size() && len > 0; i++) {
+        const Location& e = extents[i];
+        if (offset >= e.size()) {
+            offset -= e.size();
+            continue;
+        }
+        while (offset < e.size() && len > 0) {
+            size_t n = std::min<uint64_t>(
+                std::min<uint64_t>(kStreamChunk, e.size() - offset), len);
+            ret = store_.ReadAt(e, offset, buf.get(), n);
+            if (ret != kSucc) {
+                return ret;
+            }
+            ret = sink.Write(PolarString(buf.get(), n));
+            if (ret != kSucc) {
+                return ret;
+            }
+            offset += n;
+            len -= n;
+        }
+        offset = 0;
+    }
+    return kSucc;
+}
+
 RetCode EngineExample::Read(const PolarString& key, std::string* value) {
-    pthread_mutex_lock(&mu_);
+    FLIGHT_OP(kFlightRead);
+    counters_.Add(kReads);
+    EpochGuard guard(&epoch_);
     Location location;
     RetCode ret = plate_.Find(key.ToString(), &location);
     if (ret == kSucc) {
-        value->clear();
         ret = store_.Read(location, value);
+    } else if (ret == kNotFound) {
+        counters_.Add(kReadMisses);
     }
-    pthread_mutex_unlock(&mu_);
     return ret;
 }
 
+RetCode EngineExample::Delete(const PolarString& key) {
+    FLIGHT_OP(kFlightDelete);
+    if (key.size() > kMaxKeyLen) {
+        return kInvalidArgument;
+    }
+    counters_.Add(kDeletes);
+    EpochGuard guard(&epoch_);
+    DeleteWriter writer(&store_, key);
+    return plate_.Delete(key.ToString(), &writer);
+}
+
+RetCode EngineExample::Sync() {
+    counters_.Add(kSyncs);
+    return store_.Sync();
+}
+
 RetCode EngineExample::Range(const PolarString& lower, const PolarString& upper,
                              Visitor& visitor) {
-    pthread_mutex_lock(&mu_);
-    std::map<std::string, Location> locations;
-    RetCode ret =
-        plate_.GetRangeLocation(lower.ToString(), upper.ToString(), &locations);
-    if (ret != kSucc) {
-        pthread_mutex_unlock(&mu_);
-        return ret;
+    FLIGHT_OP(kFlightRange);
+    counters_.Add(kRanges);
+    EpochGuard guard(&epoch_);
+    RangeReader reader(&store_, &visitor);
+    return plate_.Range(lower.ToString(), upper.ToString(), &reader);
+}
+
+// Gathered anew on every call, which is cheap next to reading a value
+RetCode EngineExample::GetProperty(const std::string& property,
+                                   std::string* value) {
+    if (property == "polar.slow_ops") {
+        return FlightSlowOps(kSlowOps, value) ? kSucc : kNotFound;
+    }
+    Properties props;
+    AddProperty(&props, "polar.writes", counters_.Get(kWrites));
+    AddProperty(&props, "polar.reads", counters_.Get(kReads));
+    AddProperty(&props, "polar.read_misses", counters_.Get(kReadMisses));
+    AddProperty(&props, "polar.write_streams", counters_.Get(kWriteStreams));
+    AddProperty(&props, "polar.read_streams", counters_.Get(kReadStreams));
+    AddProperty(&props, "polar.ranges", counters_.Get(kRanges));
+    AddProperty(&props, "polar.deletes", counters_.Get(kDeletes));
+    AddProperty(&props, "polar.syncs", counters_.Get(kSyncs));
+    // "checkpoint" or "replay"
+    props.push_back(std::make_pair("polar.recovery", std::string(recovery_)));
+    {
+        EpochGuard guard(&epoch_);  // compaction may remove files
+        plate_.GetProperties(&props);
+        store_.GetProperties(&props);
     }
 
-    std::string value;
-    for (auto& pair : locations) {
-        ret = store_.Read(pair.second, &value);
-        if (kSucc != ret) {
-            break;
+    if (property == "polar.stats") {
+        value->clear();
+        for (auto& p : props) {
+            value->append(p.first + " " + p.second + "\n");
         }
-        visitor.Visit(pair.first, value);
+        return kSucc;
     }
-    pthread_mutex_unlock(&mu_);
-    return ret;
+    for (auto& p : props) {
+        if (p.first == property) {
+            *value = p.second;
+            return kSucc;
+        }
+    }
+    return kNotFound;
 }
 
 }  // namespace polar_race
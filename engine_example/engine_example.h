@@ -1,26 +1,31 @@
 // Copyright [2018] Alibaba Cloud All rights reserved
 #ifndef ENGINE_EXAMPLE_ENGINE_EXAMPLE_H_
 #define ENGINE_EXAMPLE_ENGINE_EXAMPLE_H_
-#include <pthread.h>
-
 #include <string>
 
+#include "checkpoint.h"
+#include "compactor.h"
 #include "data_store.h"
 #include "door_plate.h"
+#include "epoch.h"
 #include "include/engine.h"
+#include "stats.h"
 #include "util.h"
 
 namespace polar_race {
 
 class EngineExample : public Engine {
 public:
-    static RetCode Open(const std::string& name, Engine** eptr);
+    static RetCode Open(const std::string& name, const Options& options,
+                        Engine** eptr);
 
-    explicit EngineExample(const std::string& dir)
-        : mu_(PTHREAD_MUTEX_INITIALIZER),
-          db_lock_(NULL),
-          plate_(dir),
-          store_(dir) {}
+    EngineExample(const std::string& dir, const Options& options)
+        : db_lock_(NULL),
+          dir_(dir),
+          opened_(false),
+          recovery_(""),
+          store_(dir, options),
+          compactor_(&plate_, &store_, &epoch_) {}
 
     ~EngineExample();
 
@@ -28,14 +33,47 @@ public:
 
     RetCode Read(const PolarString& key, std::string* value) override;
 
+    RetCode WriteStream(const PolarString& key, ValueSource& source) override;
+
+    RetCode ReadStream(const PolarString& key, uint64_t offset, uint64_t len,
+                       ValueSink& sink) override;
+
+    RetCode Delete(const PolarString& key) override;
+
+    RetCode Sync() override;
+
     RetCode Range(const PolarString& lower, const PolarString& upper,
                   Visitor& visitor) override;
 
+    RetCode GetProperty(const std::string& property,
+                        std::string* value) override;
+
 private:
-    pthread_mutex_t mu_;
+    enum Counter {
+        kWrites,
+        kReads,
+        kReadMisses,
+        kWriteStreams,
+        kReadStreams,
+        kRanges,
+        kDeletes,
+        kSyncs,
+        kCounters
+    };
+
     FileLock* db_lock_;
+    std::string dir_;
+    bool opened_;
+    const char* recovery_;  // how Open got the index back
+    CheckpointReader checkpoint_;  // must outlive plate_
     DoorPlate plate_;
     DataStore store_;
+    Epoch epoch_;  // around every use of plate_ and store_
+    Compactor compactor_;
+    Counters<kCounters> counters_;
+
+    RetCode Recover();
+    RetCode SaveCheckpoint();
 };
 
 }  // namespace polar_race
@@ -0,0 +1,64 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#include "epoch.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace polar_race {
+
+static uint32_t ThreadShard(uint32_t shards) {
+    static uint32_t next_thread = 0;
+    static thread_local uint32_t shard =
+        __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+    return shard % shards;
+}
+
+Epoch::Epoch() : shards_(NULL), epoch_(0) {
+    void* ptr = NULL;
+    if (0 != posix_memalign(&ptr, sizeof(Shard), kShards * sizeof(Shard))) {
+        abort();
+    }
+    shards_ = reinterpret_cast<Shard*>(ptr);
+    memset(ptr, 0, kShards * sizeof(Shard));
+    pthread_mutex_init(&sync_mu_, NULL);
+}
+
+Epoch::~Epoch() {
+    free(shards_);
+    pthread_mutex_destroy(&sync_mu_);
+}
+
+uint32_t Epoch::Enter() {
+    const uint32_t shard = ThreadShard(kShards);
+    while (true) {
+        uint32_t e = __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST);
+        uint64_t* active = &shards_[shard].active[e & 1];
+        __atomic_fetch_add(active, 1, __ATOMIC_SEQ_CST);
+        // A Synchronize that flipped the epoch meanwhile may already have
+        // seen this counter drained, so count again under the new epoch
+        if (__atomic_load_n(&epoch_, __ATOMIC_SEQ_CST) == e) {
+            return ((e & 1) << 16) | shard;
+        }
+        __atomic_fetch_sub(active, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void Epoch::Exit(uint32_t token) {
+    __atomic_fetch_sub(&shards_[token & 0xffff].active[token >> 16], 1,
+                       __ATOMIC_RELEASE);
+}
+
+void Epoch::Synchronize() {
+    pthread_mutex_lock(&sync_mu_);
+    uint32_t e = __atomic_fetch_add(&epoch_, 1, __ATOMIC_SEQ_CST);
+    for (uint32_t s = 0; s < kShards; s++) {
+        while (__atomic_load_n(&shards_[s].active[e & 1], __ATOMIC_SEQ_CST) !=
+               0) {
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&sync_mu_);
+}
+
+}  // namespace polar_race
@@ -0,0 +1,54 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef ENGINE_EXAMPLE_EPOCH_H_
+#define ENGINE_EXAMPLE_EPOCH_H_
+#include <pthread.h>
+#include <stdint.h>
+
+namespace polar_race {
+
+// Lets one thread wait until every operation that was running when it
+// started waiting has finished, before it frees something those could
+// still be looking at. Entering and leaving costs two atomic adds on a
+// counter shared by few threads.
+class Epoch {
+public:
+    Epoch();
+    ~Epoch();
+
+    // Returns the token to hand to Exit
+    uint32_t Enter();
+    void Exit(uint32_t token);
+
+    // Wait for every operation entered before the call to exit
+    void Synchronize();
+
+private:
+    static const uint32_t kShards = 64;
+
+    struct alignas(64) Shard {
+        uint64_t active[2];  // by parity of the epoch entered in
+    };
+
+    Shard* shards_;  // cache line aligned, which new does not promise
+    uint32_t epoch_;
+    pthread_mutex_t sync_mu_;  // one Synchronize at a time
+};
+
+class EpochGuard {
+public:
+    explicit EpochGuard(Epoch* epoch) : epoch_(epoch), token_(epoch->Enter()) {}
+
+    ~EpochGuard() { epoch_->Exit(token_); }
+
+private:
+    Epoch* epoch_;
+    uint32_t token_;
+
+    // No copying allowed
+    EpochGuard(const EpochGuard&);
+    void operator=(const EpochGuard&);
+};
+
+}  // namespace polar_race
+
+#endif  // ENGINE_EXAMPLE_EPOCH_H_
@@ -0,0 +1,162 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef ENGINE_EXAMPLE_SEGMENT_ARRAY_H_
+#define ENGINE_EXAMPLE_SEGMENT_ARRAY_H_
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "checkpoint.h"
+#include "include/engine.h"
+
+namespace polar_race {
+
+// Elements live in segments that double in size, so growing never moves
+// an element and the directory stays tiny. Memory is mapped lazily.
+// Reserve may race with readers of elements below capacity().
+template <class T, int kShift>
+class SegmentArray {
+public:
+    SegmentArray() : capacity_(0), adopted_(0) {
+        memset(segs_, 0, sizeof(segs_));
+        pthread_mutex_init(&mu_, NULL);
+    }
+
+    ~SegmentArray() {
+        pthread_mutex_destroy(&mu_);
+        for (int seg = 0; seg < kMaxSegments && segs_[seg] != NULL; seg++) {
+            if (SegmentStart(seg) >= adopted_) {
+                munmap(segs_[seg], SegmentSize(seg) * sizeof(T));
+            }
+        }
+    }
+
+    // Back elements [0, n) with memory
+    RetCode Reserve(uint64_t n) {
+        if (capacity() >= n) {
+            return kSucc;
+        }
+        pthread_mutex_lock(&mu_);
+        int seg = 0;
+        while (capacity_ < n) {
+            while (seg < kMaxSegments && segs_[seg] != NULL) {
+                seg++;
+            }
+            if (seg == kMaxSegments) {
+                pthread_mutex_unlock(&mu_);
+                return kFull;
+            }
+            // Untouched pages stay zero-filled and cost nothing
+            uint64_t size = SegmentSize(seg) * sizeof(T);
+            void* ptr =
+                mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (ptr == MAP_FAILED) {
+                std::cerr << "MAP_FAILED: " << strerror(errno) << std::endl;
+                pthread_mutex_unlock(&mu_);
+                return kOutOfMemory;
+            }
+            segs_[seg] = reinterpret_cast<T*>(ptr);
+            // Publishes the segment to lock-free readers
+            __atomic_store_n(&capacity_, capacity_ + SegmentSize(seg),
+                             __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&mu_);
+        return kSucc;
+    }
+
+    // Take over the elements saved in |image|
+    RetCode Adopt(const CheckpointSection& image) {
+        if (image.size() % sizeof(T) != 0) {
+            return kCorruption;
+        }
+        uint64_t n = image.size() / sizeof(T);
+        uint64_t covered = 0;
+        for (int seg = 0; covered < n && seg < kMaxSegments; seg++) {
+            segs_[seg] = reinterpret_cast<T*>(image.data()) + covered;
+            covered += SegmentSize(seg);
+        }
+        if (covered != n) {
+            // Not a whole number of segments
+            memset(segs_, 0, sizeof(segs_));
+            return kCorruption;
+        }
+        capacity_ = adopted_ = n;
+        image_ = image;
+        return kSucc;
+    }
+
+    // Elements [i, i + n) must not cross a segment end. NULL if they come
+    // from a damaged checkpoint chunk.
+    T* At(uint64_t i, uint64_t n = 1) {
+        if (i < adopted_ && !image_.Verify(i * sizeof(T), n * sizeof(T))) {
+            return NULL;
+        }
+        uint64_t q = i >> kShift;
+        if (q == 0) {
+            return segs_[0] + i;
+        }
+        int seg = 64 - __builtin_clzll(q);
+        return segs_[seg] + (i - SegmentStart(seg));
+    }
+
+    // First index of the segment after the one holding |i|
+    static uint64_t SegmentEnd(uint64_t i) {
+        uint64_t q = i >> kShift;
+        return q == 0 ? kSegmentElems
+                      : kSegmentElems << (64 - __builtin_clzll(q));
+    }
+
+    bool VerifyAll() { return image_.VerifyAll(); }
+
+    // Trade elements with |other|; neither may be in use meanwhile
+    void Swap(SegmentArray* other) {
+        std::swap(segs_, other->segs_);
+        std::swap(capacity_, other->capacity_);
+        std::swap(adopted_, other->adopted_);
+        std::swap(image_, other->image_);
+    }
+
+    uint64_t capacity() const {
+        return __atomic_load_n(&capacity_, __ATOMIC_ACQUIRE);
+    }
+
+    void SaveTo(CheckpointWriter* writer, uint32_t id) const {
+        std::vector<const char*> chunks;
+        for (int seg = 0; seg < kMaxSegments && segs_[seg] != NULL; seg++) {
+            for (uint64_t i = 0; i < SegmentSize(seg); i += kSegmentElems) {
+                chunks.push_back(
+                    reinterpret_cast<const char*>(segs_[seg] + i));
+            }
+        }
+        writer->AddSection(id, chunks, kSegmentElems * sizeof(T),
+                           capacity_ * sizeof(T));
+    }
+
+private:
+    static const uint64_t kSegmentElems = 1ull << kShift;
+    static const int kMaxSegments = 40;
+
+    T* segs_[kMaxSegments];
+    uint64_t capacity_;
+    uint64_t adopted_;  // elements that belong to the checkpoint mapping
+    CheckpointSection image_;
+    pthread_mutex_t mu_;  // serializes Reserve
+
+    static uint64_t SegmentStart(int seg) {
+        return seg == 0 ? 0 : kSegmentElems << (seg - 1);
+    }
+
+    static uint64_t SegmentSize(int seg) {
+        return seg == 0 ? kSegmentElems : kSegmentElems << (seg - 1);
+    }
+};
+
+}  // namespace polar_race
+
+#endif  // ENGINE_EXAMPLE_SEGMENT_ARRAY_H_
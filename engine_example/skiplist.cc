@@ -0,0 +1,356 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#include "skiplist.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace polar_race {
+
+static const uint64_t kHead = 0;  // arena offset of the head node
+// Set in the next offsets of a removed node; nodes are 8 byte aligned
+static const uint64_t kMarked = 1;
+
+// Same order as std::string::compare
+static int CompareKey(const char* a, size_t a_size, const std::string& b) {
+    int r = memcmp(a, b.data(), std::min(a_size, b.size()));
+    if (r != 0) {
+        return r;
+    }
+    return a_size < b.size() ? -1 : (a_size > b.size() ? 1 : 0);
+}
+
+// One more level with probability 1/4
+static uint32_t RandomHeight(uint32_t max_height) {
+    static __thread uint64_t state = 0;
+    if (state == 0) {
+        state = reinterpret_cast<uintptr_t>(&state) | 1;
+    }
+    uint32_t height = 1;
+    while (height < max_height) {
+        // xorshift64
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if ((state & 3) != 0) {
+            break;
+        }
+        height++;
+    }
+    return height;
+}
+
+SkipList::SkipList() { memset(&meta_, 0, sizeof(meta_)); }
+
+RetCode SkipList::Init() {
+    memset(&meta_, 0, sizeof(meta_));
+    uint64_t head;
+    return NewNode("", kMaxHeight, &head);
+}
+
+RetCode SkipList::Init(CheckpointReader* checkpoint) {
+    CheckpointSection meta, arena;
+    RetCode ret = checkpoint->GetSection(kKeyOrderMetaSection, &meta);
+    if (ret == kSucc) {
+        ret = checkpoint->GetSection(kKeyOrderSection, &arena);
+    }
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (meta.size() != sizeof(meta_) || !meta.VerifyAll()) {
+        return kCorruption;
+    }
+    memcpy(&meta_, meta.data(), sizeof(meta_));
+    ret = arena_.Adopt(arena);
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (arena_.capacity() < meta_.arena ||
+        meta_.arena < NodeSize(kMaxHeight, 0)) {
+        return kCorruption;
+    }
+    return kSucc;
+}
+
+uint64_t SkipList::NodeSize(uint32_t height, uint32_t key_size) {
+    uint64_t size = offsetof(Node, next) + height * sizeof(uint64_t) + key_size;
+    return (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+SkipList::Node* SkipList::NodeAt(uint64_t offset) {
+    uint64_t limit = std::min(__atomic_load_n(&meta_.arena, __ATOMIC_ACQUIRE),
+                              arena_.capacity());
+    if (offset % sizeof(uint64_t) != 0 ||
+        offset + offsetof(Node, next) > limit) {
+        return NULL;
+    }
+    const Node* header = reinterpret_cast<const Node*>(
+        arena_.At(offset, offsetof(Node, next)));
+    if (header == NULL || header->height == 0 ||
+        header->height > kMaxHeight ||
+        NodeSize(header->height, header->key_size) > limit - offset) {
+        return NULL;
+    }
+    return reinterpret_cast<Node*>(
+        arena_.At(offset, NodeSize(header->height, header->key_size)));
+}
+
+RetCode SkipList::Seek(const std::string& key, int level, uint64_t from,
+                       uint64_t* prev, uint64_t* found) {
+    Node* node = NodeAt(from);
+    while (true) {
+        if (node == NULL || static_cast<uint32_t>(level) >= node->height) {
+            return kCorruption;
+        }
+        uint64_t next = __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+        if ((next & kMarked) != 0) {
+            return kIncomplete;
+        }
+        if (next == 0) {
+            *prev = from;
+            *found = 0;
+            return kSucc;
+        }
+        Node* n = NodeAt(next);
+        if (n == NULL || static_cast<uint32_t>(level) >= n->height) {
+            return kCorruption;
+        }
+        uint64_t after = __atomic_load_n(&n->next[level], __ATOMIC_ACQUIRE);
+        if ((after & kMarked) != 0) {
+            // Whether we unlink it or someone else changed |node| first,
+            // look at |node| again
+            __atomic_compare_exchange_n(&node->next[level], &next,
+                                        after & ~kMarked, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (CompareKey(KeyOf(n), n->key_size, key) >= 0) {
+            *prev = from;
+            *found = next;
+            return kSucc;
+        }
+        from = next;
+        node = n;
+    }
+}
+
+RetCode SkipList::Descend(const std::string& key, int bottom,
+                          uint64_t* prevs, uint64_t* nexts) {
+    RetCode ret;
+    do {
+        ret = kSucc;
+        uint64_t from = kHead;
+        for (int level = kMaxHeight - 1; ret == kSucc && level >= bottom;
+             level--) {
+            ret = Seek(key, level, from, &prevs[level], &nexts[level]);
+            from = prevs[level];
+        }
+    } while (ret == kIncomplete);
+    return ret;
+}
+
+RetCode SkipList::NewNode(const std::string& key, uint32_t height,
+                          uint64_t* offset) {
+    // Nodes never straddle two arena segments
+    const uint64_t size = NodeSize(height, key.size());
+    uint64_t end = __atomic_load_n(&meta_.arena, __ATOMIC_RELAXED);
+    uint64_t o;
+    do {
+        o = end;
+        if (o + size > SegmentArray<char, 16>::SegmentEnd(o)) {
+            o = SegmentArray<char, 16>::SegmentEnd(o);
+        }
+    } while (!__atomic_compare_exchange_n(&meta_.arena, &end, o + size, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    RetCode ret = arena_.Reserve(o + size);
+    if (ret != kSucc) {
+        return ret;
+    }
+    Node* node = reinterpret_cast<Node*>(arena_.At(o, size));
+    if (node == NULL) {
+        return kCorruption;
+    }
+    node->key_size = key.size();
+    node->height = height;
+    memset(node->next, 0, height * sizeof(uint64_t));
+    memcpy(const_cast<char*>(KeyOf(node)), key.data(), key.size());
+    *offset = o;
+    return kSucc;
+}
+
+RetCode SkipList::Insert(const std::string& key) {
+    uint64_t prevs[kMaxHeight];
+    uint64_t nexts[kMaxHeight];
+    RetCode ret = Descend(key, 0, prevs, nexts);
+    if (ret != kSucc) {
+        return ret;
+    }
+    if (nexts[0] != 0) {
+        Node* n = NodeAt(nexts[0]);
+        if (n != NULL && CompareKey(KeyOf(n), n->key_size, key) == 0) {
+            return kSucc;
+        }
+    }
+
+    const uint32_t height = RandomHeight(kMaxHeight);
+    uint64_t offset;
+    ret = NewNode(key, height, &offset);
+    if (ret != kSucc) {
+        return ret;
+    }
+    Node* node = NodeAt(offset);
+    if (node == NULL) {
+        return kCorruption;
+    }
+    // Bottom up, so that a node reachable at some level is reachable at
+    // every level below it. On a lost race only that level is searched
+    // again, from the node we lost at, or from the head if that one was
+    // removed meanwhile.
+    for (uint32_t level = 0; level < height; level++) {
+        while (true) {
+            Node* prev = NodeAt(prevs[level]);
+            if (prev == NULL || level >= prev->height) {
+                return kCorruption;
+            }
+            __atomic_store_n(&node->next[level], nexts[level],
+                             __ATOMIC_RELAXED);
+            uint64_t expected = nexts[level];
+            if (__atomic_compare_exchange_n(&prev->next[level], &expected,
+                                            offset, false, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+            ret = Seek(key, level, prevs[level], &prevs[level], &nexts[level]);
+            if (ret == kIncomplete) {
+                ret = Descend(key, level, prevs, nexts);
+            }
+            if (ret != kSucc) {
+                return ret;
+            }
+        }
+    }
+    return kSucc;
+}
+
+RetCode SkipList::Remove(const std::string& key) {
+    uint64_t prevs[kMaxHeight];
+    uint64_t nexts[kMaxHeight];
+    RetCode ret = Descend(key, 0, prevs, nexts);
+    if (ret != kSucc || nexts[0] == 0) {
+        return ret;
+    }
+    Node* node = NodeAt(nexts[0]);
+    if (node == NULL) {
+        return kCorruption;
+    }
+    if (CompareKey(KeyOf(node), node->key_size, key) != 0) {
+        return kSucc;
+    }
+    // From the top, so that the node leaves the list from there down.
+    // Once its next offsets are marked no insert links behind it.
+    for (int level = node->height - 1; level >= 0; level--) {
+        uint64_t next = __atomic_load_n(&node->next[level], __ATOMIC_RELAXED);
+        while ((next & kMarked) == 0 &&
+               !__atomic_compare_exchange_n(&node->next[level], &next,
+                                            next | kMarked, true,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    __atomic_fetch_add(&meta_.removed, NodeSize(node->height, node->key_size),
+                       __ATOMIC_RELAXED);
+    // Seeking the key unlinks the node at every level it is on
+    return Descend(key, 0, prevs, nexts);
+}
+
+RetCode SkipList::Scan(const std::string& lower, const std::string& upper,
+                       KeyVisitor* visitor) {
+    uint64_t prevs[kMaxHeight];
+    uint64_t nexts[kMaxHeight];
+    RetCode ret = Descend(lower, 0, prevs, nexts);
+    if (ret != kSucc) {
+        return ret;
+    }
+    std::string key;
+    uint64_t next = nexts[0];
+    while (next != 0) {
+        Node* node = NodeAt(next);
+        if (node == NULL) {
+            return kCorruption;
+        }
+        if (!upper.empty() &&
+            CompareKey(KeyOf(node), node->key_size, upper) >= 0) {
+            break;
+        }
+        // A removed node is skipped. Its next offset does not change any
+        // more and still leads on in order.
+        next = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+        if ((next & kMarked) != 0) {
+            next &= ~kMarked;
+            continue;
+        }
+        key.assign(KeyOf(node), node->key_size);
+        ret = visitor->Visit(key);
+        if (ret != kSucc) {
+            return ret;
+        }
+    }
+    return kSucc;
+}
+
+RetCode SkipList::Compact() {
+    SkipList fresh;
+    RetCode ret = fresh.Init();
+    if (ret != kSucc) {
+        return ret;
+    }
+    // The last node of every level so far, all in order
+    uint64_t tails[kMaxHeight] = {kHead};
+    Node* head = NodeAt(kHead);
+    if (head == NULL) {
+        return kCorruption;
+    }
+    uint64_t next = head->next[0];
+    while (next != 0) {
+        Node* node = NodeAt(next & ~kMarked);
+        if (node == NULL) {
+            return kCorruption;
+        }
+        next = node->next[0];
+        if ((next & kMarked) != 0) {
+            continue;
+        }
+        uint64_t offset;
+        ret = fresh.NewNode(std::string(KeyOf(node), node->key_size),
+                            node->height, &offset);
+        if (ret != kSucc) {
+            return ret;
+        }
+        for (uint32_t level = 0; level < node->height; level++) {
+            fresh.NodeAt(tails[level])->next[level] = offset;
+            tails[level] = offset;
+        }
+    }
+    arena_.Swap(&fresh.arena_);
+    std::swap(meta_, fresh.meta_);
+    return kSucc;
+}
+
+RetCode SkipList::SaveTo(CheckpointWriter* writer) {
+    if (!arena_.VerifyAll()) {
+        return kCorruption;
+    }
+    if (meta_.removed != 0) {
+        RetCode ret = Compact();
+        if (ret != kSucc) {
+            return ret;
+        }
+    }
+    arena_.SaveTo(writer, kKeyOrderSection);
+    writer->AddSection(kKeyOrderMetaSection, &meta_, sizeof(meta_));
+    return kSucc;
+}
+
+}  // namespace polar_race
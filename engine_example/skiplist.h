@@ -0,0 +1,103 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef ENGINE_EXAMPLE_SKIPLIST_H_
+#define ENGINE_EXAMPLE_SKIPLIST_H_
+#include <stdint.h>
+
+#include <string>
+
+#include "checkpoint.h"
+#include "include/engine.h"
+#include "segment_array.h"
+
+namespace polar_race {
+
+// Receives the keys of a SkipList scan, in order
+class KeyVisitor {
+public:
+    virtual ~KeyVisitor() {}
+
+    // Anything but kSucc ends the scan and is returned by it
+    virtual RetCode Visit(const std::string& key) = 0;
+};
+
+// The keys of the index in order, so that range scans seek to their lower
+// bound instead of walking the whole hash table.
+//
+// Nodes never move once written and are linked level by level with CAS,
+// so any number of threads may insert, remove and scan at once without a
+// lock. A removed node is first marked, by setting the low bit of its
+// next offsets, and then unlinked by whoever passes it next. Its space is
+// only given back when the list is saved. Nodes refer to each other by
+// arena offset, which lets the list be saved to the checkpoint and
+// adopted from it as is.
+class SkipList {
+public:
+    SkipList();
+
+    // Start with an empty list
+    RetCode Init();
+    // Adopt the list image of a checkpoint; it is verified lazily
+    RetCode Init(CheckpointReader* checkpoint);
+
+    // No-op if |key| is already there. Inserts and removes of one key
+    // must not race.
+    RetCode Insert(const std::string& key);
+
+    // No-op if |key| is not there
+    RetCode Remove(const std::string& key);
+
+    // Visit the keys in [lower, upper), where an empty bound is open. Not
+    // a snapshot: keys inserted during the scan may or may not show up.
+    RetCode Scan(const std::string& lower, const std::string& upper,
+                 KeyVisitor* visitor);
+
+    // Add the list image to |writer|, without the removed nodes; fails if
+    // any part of an adopted image turned out to be corrupted. Nothing
+    // else may use the list meanwhile.
+    RetCode SaveTo(CheckpointWriter* writer);
+
+private:
+    static const int kMaxHeight = 12;
+
+    // Followed by next[height] and the key bytes
+    struct Node {
+        uint32_t key_size;
+        uint32_t height;
+        uint64_t next[1];  // arena offsets, 0 ends the level
+    };
+
+    struct Meta {
+        uint64_t arena;    // bytes used in the node arena
+        uint64_t removed;  // bytes of them in removed nodes
+    };
+
+    Meta meta_;
+    SegmentArray<char, 16> arena_;
+
+    static uint64_t NodeSize(uint32_t height, uint32_t key_size);
+    static const char* KeyOf(const Node* node) {
+        return reinterpret_cast<const char*>(node->next + node->height);
+    }
+
+    // NULL if |offset| does not hold a whole node, which only a damaged
+    // checkpoint can produce
+    Node* NodeAt(uint64_t offset);
+    // Arena offset of the first node at |level| whose key is not below
+    // |key|, starting from the node at |from|, which must be below it.
+    // |*prev| is set to the offset of the node before it. Removed nodes on
+    // the way are unlinked; kIncomplete if the one at |from| is removed.
+    RetCode Seek(const std::string& key, int level, uint64_t from,
+                 uint64_t* prev, uint64_t* found);
+    // Seek from the head down to |bottom|, setting prevs[level] and
+    // nexts[level] of every level on the way
+    RetCode Descend(const std::string& key, int bottom, uint64_t* prevs,
+                    uint64_t* nexts);
+    RetCode NewNode(const std::string& key, uint32_t height,
+                    uint64_t* offset);
+    // Rebuild the list without the removed nodes
+    RetCode Compact();
+};
+
+}  // namespace polar_race
+
+#endif  // ENGINE_EXAMPLE_SKIPLIST_H_
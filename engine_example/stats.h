@@ -0,0 +1,86 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef ENGINE_EXAMPLE_STATS_H_
+#define ENGINE_EXAMPLE_STATS_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace polar_race {
+
+// Statistics by name, as Engine::GetProperty reports them
+typedef std::vector<std::pair<std::string, std::string> > Properties;
+
+inline void AddProperty(Properties* props, const std::string& name,
+                        uint64_t value) {
+    props->push_back(std::make_pair(name, std::to_string(value)));
+}
+
+inline void AddProperty(Properties* props, const std::string& name,
+                        double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.4f", value);
+    props->push_back(std::make_pair(name, std::string(buf)));
+}
+
+// |N| event counters any number of threads add to. Every thread adds to
+// its own cache line, so counting is an uncontended add to a line nobody
+// else writes, and reading sums the lines. Past kSlots threads some
+// share a line, which is why the add is still atomic.
+template <int N>
+class Counters {
+public:
+    Counters() : slots_(NULL) {
+        void* ptr = NULL;
+        if (0 != posix_memalign(&ptr, sizeof(Slot), kSlots * sizeof(Slot))) {
+            abort();
+        }
+        slots_ = reinterpret_cast<Slot*>(ptr);
+        memset(ptr, 0, kSlots * sizeof(Slot));
+    }
+
+    ~Counters() { free(slots_); }
+
+    void Add(int counter, uint64_t n = 1) {
+        __atomic_fetch_add(&slots_[ThreadSlot()].count[counter], n,
+                           __ATOMIC_RELAXED);
+    }
+
+    // May miss adds that are under way
+    uint64_t Get(int counter) const {
+        uint64_t sum = 0;
+        for (uint32_t s = 0; s < kSlots; s++) {
+            sum += __atomic_load_n(&slots_[s].count[counter], __ATOMIC_RELAXED);
+        }
+        return sum;
+    }
+
+private:
+    static const uint32_t kSlots = 64;
+
+    struct alignas(64) Slot {
+        uint64_t count[N];
+    };
+
+    Slot* slots_;  // cache line aligned, which new does not promise
+
+    // Threads in the order they first count anything
+    static uint32_t ThreadSlot() {
+        static uint32_t next_thread = 0;
+        static thread_local uint32_t slot =
+            __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED) % kSlots;
+        return slot;
+    }
+
+    // No copying allowed
+    Counters(const Counters&);
+    void operator=(const Counters&);
+};
+
+}  // namespace polar_race
+
+#endif  // ENGINE_EXAMPLE_STATS_H_
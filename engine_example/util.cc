@@ -2,27 +2,106 @@
 #include "util.h"
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
 namespace polar_race {
 
-static const int kA = 54059;    // a prime
-static const int kB = 76963;    // another prime
-static const int kFinish = 37;  // also prime
-uint32_t StrHash(const char* s, int size) {
-    uint32_t h = kFinish;
-    while (size > 0) {
-        h = (h * kA) ^ (s[0] * kB);
-        s++;
-        size--;
+// 64-bit multiply-xorshift hash in the spirit of MurmurHash64A, eight
+// bytes per step; every output bit depends on every input bit
+static const uint64_t kMul = 0xc6a4a7935bd1e995ull;
+static const int kShift = 47;
+static const uint64_t kSeed = 0x9e3779b97f4a7c15ull;
+uint64_t StrHash(const char* s, size_t size) {
+    uint64_t h = kSeed ^ (size * kMul);
+    while (size >= 8) {
+        uint64_t k;
+        memcpy(&k, s, sizeof(k));
+        k *= kMul;
+        k ^= k >> kShift;
+        k *= kMul;
+        h ^= k;
+        h *= kMul;
+        s += 8;
+        size -= 8;
+    }
+    if (size > 0) {
+        uint64_t k = 0;
+        memcpy(&k, s, size);
+        h ^= k;
+        h *= kMul;
     }
+    h ^= h >> kShift;
+    h *= kMul;
+    h ^= h >> kShift;
     return h;
 }
 
+static const uint32_t kCrc32cPoly = 0x82f63b78;  // reflected Castagnoli
+
+namespace {
+struct Crc32cTable {
+    uint32_t entry[256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ kCrc32cPoly : c >> 1;
+            }
+            entry[i] = c;
+        }
+    }
+};
+}  // namespace
+
+static uint32_t Crc32cSoft(const char* data, size_t n, uint32_t crc) {
+    static const Crc32cTable table;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    while (n-- > 0) {
+        crc = table.entry[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t Crc32cHw(const char* data,
+                                                           size_t n,
+                                                           uint32_t crc) {
+    uint64_t c = crc;
+    while (n >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+        data += 8;
+        n -= 8;
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    while (n-- > 0) {
+        c32 = _mm_crc32_u8(c32, *data++);
+    }
+    return c32;
+}
+#endif
+
+uint32_t Crc32c(const char* data, size_t n, uint32_t crc) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) {
+        return ~Crc32cHw(data, n, crc);
+    }
+#endif
+    return ~Crc32cSoft(data, n, crc);
+}
+
 int GetDirFiles(const std::string& dir, std::vector<std::string>* result) {
     int res = 0;
     result->clear();
@@ -72,6 +151,51 @@ bool FileExists(const std::string& path) {
     return access(path.c_str(), F_OK) == 0;
 }
 
+int FileWriteAt(int fd, const char* data, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t r = pwrite(fd, data, n, offset);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;  // Retry
+            }
+            return -1;
+        }
+        data += r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+int FileReadAt(int fd, char* buf, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t r = pread(fd, buf, n, offset);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;  // Retry
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;  // Past the end of the file
+        }
+        buf += r;
+        n -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+int SyncDir(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return errno;
+    }
+    int result = fsync(fd) == 0 ? 0 : errno;
+    close(fd);
+    return result;
+}
+
 static int LockOrUnlock(int fd, bool lock) {
     errno = 0;
     struct flock f;
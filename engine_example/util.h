@@ -3,6 +3,7 @@
 #define ENGINE_SIMPLE_UTIL_H_
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <string>
 #include <vector>
@@ -10,13 +11,19 @@
 namespace polar_race {
 
 // Hash
-uint32_t StrHash(const char* s, int size);
+uint64_t StrHash(const char* s, size_t size);
+
+// Checksum (CRC-32C), chainable through |crc|
+uint32_t Crc32c(const char* data, size_t n, uint32_t crc = 0);
 
 // Env
 int GetDirFiles(const std::string& dir, std::vector<std::string>* result);
 int GetFileLength(const std::string& file);
 int FileAppend(int fd, const std::string& value);
 bool FileExists(const std::string& path);
+int FileWriteAt(int fd, const char* data, size_t n, off_t offset);
+int FileReadAt(int fd, char* buf, size_t n, off_t offset);
+int SyncDir(const std::string& dir);
 
 // FileLock
 class FileLock {
@@ -4,6 +4,9 @@
 
 #include <list>
 #include <algorithm>
+
+#include "include/flight_recorder.h"
+#include "trace.h"
 using std::swap;
 using std::binary_search;
 using std::lower_bound;
@@ -26,6 +29,13 @@ inline record *find(T &node, const polar_race::PolarString &key) {
 	return lower_bound(begin(node), end(node), key);
 }
 
+/* the last key of a level, above any key that fits a node */
+inline void set_max_key(char *key)
+{
+	memset(key, 0xff, maxKeyLength - 1);
+	key[maxKeyLength - 1] = 0;
+}
+
 //锁操作相关函数
 inline void bplus_node_rlock(internalNode *bn)
 {
@@ -72,6 +82,7 @@ RetCode bplus_tree::init(const char *p)
 		meta.order = childSize;
 		meta.height = 1;
 		meta.slot = OFFSET_BLOCK;
+		slot_mark = OFFSET_BLOCK;
 
 		// init root node
 		internalNode root;
@@ -88,52 +99,61 @@ RetCode bplus_tree::init(const char *p)
 		leaf.n = 1;
 
 		// set lastChar
-		char maxChar[1] = {(char)127};
-		strcpy(root.children[0].key, maxChar);
-		strcpy(leaf.children[0].key, maxChar);
+		set_max_key(root.children[0].key);
+		set_max_key(leaf.children[0].key);
 
 		// save
-		disk_write(&meta, OFFSET_META);
+		save_meta();
 		disk_write(&root, meta.root_offset);
 		disk_write(&leaf, root.children[0].child);
 		ret = close_file();
 		return ret;
 	}
+	slot_mark = meta.slot;
 	return polar_race::kSucc;
 }
 
+RetCode bplus_tree::close()
+{
+	if (slot_mark == 0)
+		return polar_race::kSucc;  // never opened
+	slot_mark = meta.slot;
+	return save_meta() == 0 ? polar_race::kSucc : polar_race::kIOError;
+}
+
 off_t bplus_tree::search_index(const polar_race::PolarString &key) const
 {
+	FLIGHT_PHASE(polar_race::kPhaseIndex);
 	off_t org = meta.root_offset;
 	int height = meta.height;
 	while (height > 1) {
 		internalNode node;
 		disk_read(&node, org);
 		bplus_node_rlock(&node);
-		disk_write(&node,org);
 		index* i = lower_bound(begin(node), end(node), key);
 		org = i->child;
-		--height;
 		bplus_node_unlock(&node);
-		disk_write(&node,org);
+		--height;
 	}
 	return org;
 }
 
 off_t bplus_tree::search_leaf(off_t index, const polar_race::PolarString &key) const
 {
+	FLIGHT_PHASE(polar_race::kPhaseIndex);
 	internalNode node;
 	disk_read(&node, index);
 	bplus_node_rlock(&node);
-	disk_write(&node,index);
 	b_plus_tree::index* i = lower_bound(begin(node), end(node), key);
-	return i->child;
+	off_t child = i->child;
+	bplus_node_unlock(&node);
+	return child;
 }
 
 RetCode bplus_tree::search(const polar_race::PolarString &key, std::string *value) const
 {
-	printf("search key: %s\n", key.data());
-	tree_printf();
+	TRACE(TRACE_OP, "search key: %.*s\n", (int)key.size(), key.data());
+	trace_tree();
 	leafNode leaf;
 	disk_read(&leaf, search_leaf(key));
 	// finding the record
@@ -141,14 +161,18 @@ RetCode bplus_tree::search(const polar_race::PolarString &key, std::string *valu
 	if (record != leaf.children + leaf.n) {
 		// always return the lower bound
 		bplus_node_rlock(&leaf);
-		disk_write(&leaf,search_leaf(key));
 		char *valueBlock = new char[record->valueSize + 1];
 		bzero(valueBlock, record->valueSize + 1);
-		disk_read(valueBlock, record->valueOff, record->valueSize);
-		*value = valueBlock;
+		{
+			FLIGHT_PHASE(polar_race::kPhaseIO);
+			disk_read(valueBlock, record->valueOff, record->valueSize);
+		}
+		{
+			FLIGHT_PHASE(polar_race::kPhaseCopy);
+			*value = valueBlock;
+		}
 		bplus_node_unlock(&leaf);
-		disk_write(&leaf,search_leaf(key));
-		printf("%s %s\n", record->key, key.data());
+		TRACE(TRACE_OP, "found %s for %.*s\n", record->key, (int)key.size(), key.data());
 		return record->key == key ? polar_race::kSucc : polar_race::kNotFound;
 	} else {
 		return polar_race::kNotFound;
@@ -208,22 +232,100 @@ RetCode bplus_tree::search(const polar_race::PolarString &key, std::string *valu
 //     return i;
 // }
 
+double bplus_tree::leaf_fill() const
+{
+	if (meta.leaf_node_num == 0)
+		return 0;
+	size_t used = 0;
+	leafNode leaf;
+	off_t offset = meta.leaf_offset;
+	while (offset != 0 && disk_read(&leaf, offset) == 0) {
+		used += leaf.n;
+		offset = leaf.prev;
+	}
+	return (double)used / (meta.leaf_node_num * meta.order);
+}
+
+template<class T>
+static void dump_node(const T &node, std::string *out)
+{
+	char line[64];
+	snprintf(line, sizeof(line), "node size: %zu\n", node.n);
+	out->append(line);
+	for (size_t i = 0; i < node.n; i++) {
+		out->append(node.children[i].key);
+		out->push_back(i == node.n - 1 ? '\n' : ' ');
+	}
+}
+
+void bplus_tree::dump_tree(std::string *out) const
+{
+	static const char rule[] = "--------------------------------\n";
+	char line[96];
+	off_t org = meta.root_offset;
+	size_t height = meta.height;
+	internalNode node, nxtInternal;
+	leafNode nxtLeafNode;
+	disk_read(&node, org);
+	out->assign(rule);
+	snprintf(line, sizeof(line), "internalCnt: %zu leafCnt: %zu\n",
+			 meta.internal_node_num, meta.leaf_node_num);
+	out->append(line);
+	while (height > 0) {
+		disk_read(&nxtInternal, node.children[0].child);
+		out->append(rule);
+		snprintf(line, sizeof(line), "height: %zu\n", height);
+		out->append(line);
+		while (true) {
+			dump_node(node, out);
+			if (node.next == 0)
+				break;
+			disk_read(&node, node.next);
+		}
+		node = nxtInternal;
+		--height;
+	}
+	disk_read(&nxtLeafNode, meta.leaf_offset);
+	out->append(rule);
+	out->append("leaf nodes:\n");
+	while (true) {
+		dump_node(nxtLeafNode, out);
+		if (nxtLeafNode.prev == 0)
+			break;
+		disk_read(&nxtLeafNode, nxtLeafNode.prev);
+	}
+	out->append(rule);
+}
+
+void bplus_tree::trace_tree() const
+{
+	if (!TRACE_ON(TRACE_TREE))
+		return;
+	std::string tree;
+	dump_tree(&tree);
+	fputs(tree.c_str(), stderr);
+}
+
 RetCode bplus_tree::insert_or_update(const polar_race::PolarString& key, polar_race::PolarString value)
 {
+	TRACE(TRACE_OP, "insert key: %.*s\n", (int)key.size(), key.data());
 	off_t parent = search_index(key);
 	off_t offset = search_leaf(parent, key);
 	leafNode leaf;
 	disk_read(&leaf, offset);
 	bplus_node_wlock(&leaf);
-	disk_write(&leaf,offset);
 	// check if we have the same key
 	record *where = find(leaf, key);
 	if (where != leaf.children + leaf.n) {
 		if (where->key == key) {
-			// rewrite the value
+			// rewrite the value, then free the old one's space
+			off_t old_off = where->valueOff;
+			size_t old_size = where->valueSize;
 			where->valueSize = value.size();
-			where->valueOff = alloc(value.size());
+			where->valueOff = alloc_value(value.size());
+			FLIGHT_PHASE(polar_race::kPhaseIO);
 			disk_write(value.data(), where->valueOff, where->valueSize);
+			unalloc_value(old_off, old_size);
 			bplus_node_unlock(&leaf);
 			disk_write(&leaf, offset);
 			return polar_race::kSucc;
@@ -232,6 +334,7 @@ RetCode bplus_tree::insert_or_update(const polar_race::PolarString& key, polar_r
 
 	if (leaf.n == meta.order) {
 		// split when full
+		++leaf_splits;
 
 		// new sibling leaf
 		leafNode new_leaf;
@@ -270,7 +373,7 @@ RetCode bplus_tree::insert_or_update(const polar_race::PolarString& key, polar_r
 		disk_write(&leaf, offset);
 	}
 
-	tree_printf();
+	trace_tree();
 	return polar_race::kSucc;
 }
 
@@ -282,7 +385,8 @@ void bplus_tree::insert_record_no_split(leafNode *leaf, const polar_race::PolarS
 
 	strcpy(where->key, key.data());
 	where->valueSize = value.size();
-	where->valueOff = alloc(where->valueSize);
+	where->valueOff = alloc_value(where->valueSize);
+	FLIGHT_PHASE(polar_race::kPhaseIO);
 	disk_write(value.data(), where->valueOff, where->valueSize);
 	leaf->n++;
 }
@@ -306,10 +410,9 @@ void bplus_tree::insert_key_to_index(off_t offset, const polar_race::PolarString
 		root.children[1].child = old;
 
 		// set last key
-		char maxChar[1] = {(char)127};
-		strcpy(root.children[1].key, maxChar);
+		set_max_key(root.children[1].key);
 
-		disk_write(&meta, OFFSET_META);
+		save_meta();
 		disk_write(&root, meta.root_offset);
 
 		// update children's parent
@@ -320,10 +423,12 @@ void bplus_tree::insert_key_to_index(off_t offset, const polar_race::PolarString
 
 	internalNode node;
 	disk_read(&node, offset);
+	bplus_node_wlock(&node);
 	assert(node.n <= meta.order);
 
 	if (node.n == meta.order) {
 		// split when full
+		++internal_splits;
 
 		internalNode new_node;
 		latch_init(new_node.lock);
@@ -355,9 +460,6 @@ void bplus_tree::insert_key_to_index(off_t offset, const polar_race::PolarString
 
 		// give the middle key to the parent
 		// note: middle key's child is reserved
-		internalNode parent_node;
-		disk_read(&parent_node,node.parent);
-		bplus_node_wlock(&parent_node);
 		insert_key_to_index(node.parent, new_node.children[new_node.n - 1].key, 
 							offset, node.prev);
 	} else {
@@ -389,17 +491,188 @@ void bplus_tree::reset_index_children_parent(index *begin, index *end,
 	// field, but we should ensure that:
 	// 1. sizeof(internalNode) <= sizeof(leafNode)
 	// 2. parent field is placed in the beginning and have same size
+	// It must not latch |node| either: in a leaf, where an internal
+	// node's lock would be, there are keys.
 	internalNode node;
 	while (begin != end) {
 		disk_read(&node, begin->child);
-		bplus_node_rlock(&node);
 		node.parent = parent;
-		bplus_node_unlock(&node);
 		disk_write(&node, begin->child);
 		++begin;
 	}
 }
 
+RetCode bplus_tree::remove(const polar_race::PolarString& key)
+{
+	TRACE(TRACE_OP, "remove key: %.*s\n", (int)key.size(), key.data());
+	off_t parent_off = search_index(key);
+	internalNode parent;
+	disk_read(&parent, parent_off);
+	index *where = lower_bound(begin(parent), end(parent), key);
+	off_t offset = where->child;
+	leafNode leaf;
+	disk_read(&leaf, offset);
+	bplus_node_wlock(&leaf);
+	record *rec = find(leaf, key);
+	if (rec == end(leaf) || rec->key != key) {
+		bplus_node_unlock(&leaf);
+		return polar_race::kNotFound;
+	}
+	unalloc_value(rec->valueOff, rec->valueSize);
+	std::copy(rec + 1, end(leaf), rec);
+	leaf.n--;
+	bplus_node_unlock(&leaf);
+
+	// a lone leaf may run empty
+	size_t min_n = meta.leaf_node_num == 1 ? 0 : meta.order / 2;
+	if (leaf.n >= min_n) {
+		disk_write(&leaf, offset);
+	} else {
+		bplus_node_wlock(&parent);
+		bool merged = borrow_or_merge(offset, leaf, parent,
+									  where - begin(parent), 0);
+		bplus_node_unlock(&parent);
+		if (merged)
+			remove_from_index(parent_off, parent, 1);
+		else
+			disk_write(&parent, parent_off);
+	}
+
+	trace_tree();
+	return polar_race::kSucc;
+}
+
+void bplus_tree::remove_from_index(off_t offset, internalNode &node, size_t level)
+{
+	if (offset == meta.root_offset) {
+		if (node.n == 1 && meta.height > 1) {
+			// the root's only child takes its place
+			off_t child_off = node.children[0].child;
+			internalNode child;
+			disk_read(&child, child_off);
+			bplus_node_wlock(&child);
+			child.parent = 0;
+			bplus_node_unlock(&child);
+			disk_write(&child, child_off);
+			meta.root_offset = child_off;
+			meta.height--;
+			unalloc(&node, offset);
+		} else {
+			disk_write(&node, offset);
+		}
+		return;
+	}
+	if (node.n >= meta.order / 2) {
+		disk_write(&node, offset);
+		return;
+	}
+
+	off_t parent_off = node.parent;
+	internalNode parent;
+	disk_read(&parent, parent_off);
+	size_t j = 0;
+	while (j < parent.n && parent.children[j].child != offset)
+		++j;
+	assert(j < parent.n);
+	bplus_node_wlock(&parent);
+	bool merged = borrow_or_merge(offset, node, parent, j, level);
+	bplus_node_unlock(&parent);
+	if (merged)
+		remove_from_index(parent_off, parent, level + 1);
+	else
+		disk_write(&parent, parent_off);
+}
+
+template<class T>
+bool bplus_tree::borrow_or_merge(off_t offset, T &node, internalNode &parent,
+								 size_t j, size_t level)
+{
+	// a node's key in its parent is the largest one it may hold; for
+	// internal nodes it is the key of their last child too
+	const size_t min_n = meta.order / 2;
+	T sibling;
+	off_t sibling_off = 0;
+
+	if (j > 0) {
+		// borrow the last child of the left sibling
+		sibling_off = parent.children[j - 1].child;
+		disk_read(&sibling, sibling_off);
+		if (sibling.n > min_n) {
+			++borrows;
+			bplus_node_wlock(&node);
+			bplus_node_wlock(&sibling);
+			std::copy_backward(begin(node), end(node), end(node) + 1);
+			node.children[0] = sibling.children[--sibling.n];
+			node.n++;
+			strcpy(parent.children[j - 1].key,
+				   sibling.children[sibling.n - 1].key);
+			bplus_node_unlock(&sibling);
+			bplus_node_unlock(&node);
+			disk_write(&sibling, sibling_off);
+			disk_write(&node, offset);
+			adopt_children(begin(node), begin(node) + 1, offset);
+			return false;
+		}
+	}
+	if (j + 1 < parent.n) {
+		// borrow the first child of the right sibling
+		T right;
+		off_t right_off = parent.children[j + 1].child;
+		disk_read(&right, right_off);
+		if (right.n > min_n) {
+			++borrows;
+			bplus_node_wlock(&node);
+			bplus_node_wlock(&right);
+			node.children[node.n++] = right.children[0];
+			std::copy(begin(right) + 1, end(right), begin(right));
+			right.n--;
+			strcpy(parent.children[j].key, node.children[node.n - 1].key);
+			bplus_node_unlock(&right);
+			bplus_node_unlock(&node);
+			disk_write(&right, right_off);
+			disk_write(&node, offset);
+			adopt_children(end(node) - 1, end(node), offset);
+			return false;
+		}
+		if (j == 0) {
+			sibling = right;
+			sibling_off = right_off;
+		}
+	}
+	if (sibling_off == 0) {
+		// an only child, which only the root's may be
+		disk_write(&node, offset);
+		return false;
+	}
+
+	// merge the right one of the two into the left one, which takes the
+	// right one's place and key in the parent
+	if (level == 0)
+		++leaf_merges;
+	else
+		++internal_merges;
+	size_t left = j > 0 ? j - 1 : j;
+	T *l = j > 0 ? &sibling : &node;
+	T *r = j > 0 ? &node : &sibling;
+	off_t l_off = parent.children[left].child;
+	off_t r_off = parent.children[left + 1].child;
+	bplus_node_wlock(&node);
+	bplus_node_wlock(&sibling);
+	adopt_children(begin(*r), end(*r), l_off);
+	std::copy(begin(*r), end(*r), end(*l));
+	l->n += r->n;
+	parent.children[left + 1].child = l_off;
+	std::copy(begin(parent) + left + 1, end(parent), begin(parent) + left);
+	parent.n--;
+	if (r_off == meta.leaf_offset)
+		meta.leaf_offset = l_off;
+	bplus_node_unlock(&sibling);
+	bplus_node_unlock(&node);
+	node_remove(r_off, r, l);
+	disk_write(l, l_off);
+	return true;
+}
+
 template<class T>
 void bplus_tree::node_create(off_t offset, T *node, T *prev)
 {
@@ -415,7 +688,21 @@ void bplus_tree::node_create(off_t offset, T *node, T *prev)
 		old_prev.next = node->prev;
 		disk_write(&old_prev, prev->prev, SIZE_NO_CHILDREN);
 	}
-	disk_write(&meta, OFFSET_META);
+	save_meta();
+}
+
+template<class T>
+void bplus_tree::node_remove(off_t offset, T *node, T *prev)
+{
+	prev->next = node->next;
+	// update next node's prev
+	if (node->next != 0) {
+		T old_next;
+		disk_read(&old_next, node->next, SIZE_NO_CHILDREN);
+		old_next.prev = node->prev;
+		disk_write(&old_next, node->next, SIZE_NO_CHILDREN);
+	}
+	unalloc(node, offset);
 }
 
 }
@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#include <string>
+
 #include "include/polar_string.h"
 #include "include/engine.h"
 
@@ -19,6 +21,9 @@ namespace b_plus_tree {
 
 const int maxKeyLength = 256;
 const int childSize = 7;
+const off_t slotStep = 1 << 20;  // meta.slot is saved this far ahead
+const size_t valueExtent = 16;   // the space of the smallest values
+const int valueClasses = 40;     // value space comes in valueExtent << class
 
 /* meta data of B+ tree */
 struct metaData{
@@ -29,6 +34,10 @@ struct metaData{
 	off_t slot;        // where to store new block
 	off_t root_offset; // where is the root of internal node
 	off_t leaf_offset; // where is the last leaf node
+	off_t free_leaf;     // freed leaves, linked through their parent field
+	off_t free_internal; // freed internal nodes, the same way
+	off_t free_value[valueClasses]; // freed value space by size class,
+	                                // linked through its first bytes
 };
 
 /* internal nodes' index segment */
@@ -99,7 +108,9 @@ class bplus_tree {
 		char path[512];
 
 	public:
-		bplus_tree(): fp(NULL), fp_level(0) {}
+		bplus_tree(): fp(NULL), fp_level(0), node_reads(0), node_writes(0),
+			leaf_splits(0), internal_splits(0), leaf_merges(0), internal_merges(0),
+			borrows(0), bytes_read(0), bytes_written(0), slot_mark(0) {}
 
 		/* abstract operations */
 		RetCode search(const polar_race::PolarString& key, std::string *value) const;
@@ -107,6 +118,7 @@ class bplus_tree {
 		// int search_range(polar_race::PolarString *left, const polar_race::PolarString &right,
 		//                 value_t *values, size_t max, bool *next = NULL) const;
 		RetCode insert_or_update(const polar_race::PolarString& key, polar_race::PolarString value);
+		RetCode remove(const polar_race::PolarString& key);
 		metaData getMeta() const {
 			return meta;
 		};
@@ -114,6 +126,9 @@ class bplus_tree {
 		/* init empty tree */
 		RetCode init(const char *path);
 
+		/* save meta as it is, so that the next init wastes no space */
+		RetCode close();
+
 		/* find index */
 		off_t search_index(const polar_race::PolarString &key) const;
 
@@ -138,18 +153,58 @@ class bplus_tree {
 		void reset_index_children_parent(index *begin, index *end,
 										off_t parent);
 
+		/* |node| at |offset| and |level| lost a child; borrow one from a
+		 * sibling or merge with it if it has too few left, up to the root */
+		void remove_from_index(off_t offset, internalNode &node, size_t level);
+
+		/* refill |node|, child |j| of |parent|, from a sibling; true if
+		 * they had to be merged, which takes a key out of |parent| */
+		template<class T>
+		bool borrow_or_merge(off_t offset, T &node, internalNode &parent,
+							 size_t j, size_t level);
+
+		/* children of a node moved to the node at |parent| */
+		void adopt_children(index *begin, index *end, off_t parent)
+		{
+			reset_index_children_parent(begin, end, parent);
+		}
+		void adopt_children(record *begin, record *end, off_t parent)
+		{
+			// leaves have none
+		}
+
 		template<class T>
 		void node_create(off_t offset, T *node, T *prev);
+
+		/* unlink |node| at |offset| from its level, |prev| being the node
+		 * before it, and free it */
+		template<class T>
+		void node_remove(off_t offset, T *node, T *prev);
 	
 		mutable FILE *fp;
 		mutable int fp_level;
+
+		/* statistics, counted under the engine's lock */
+		mutable size_t node_reads;  // meta included
+		mutable size_t node_writes;
+		size_t leaf_splits;
+		size_t internal_splits;
+		size_t leaf_merges;
+		size_t internal_merges;
+		size_t borrows;     // children moved between siblings
+		mutable size_t bytes_read;  // nodes and values
+		mutable size_t bytes_written;
+
+		/* share of the leaf slots in use, walking every leaf */
+		double leaf_fill() const;
+
 		RetCode open_file(const char *mode = "rb+") const
 		{
 			// `rb+` will make sure we can write everywhere without truncating file
 			if (fp_level == 0)
 				fp = fopen(path, mode);
 			++fp_level;
-			return fp < 0 ? polar_race::kIOError : polar_race::kSucc;
+			return fp == NULL ? polar_race::kIOError : polar_race::kSucc;
 		}
 
 		RetCode close_file() const
@@ -162,11 +217,40 @@ class bplus_tree {
 			return polar_race::kSucc;
 		}
 
-		// alloc from disk
+		/* meta.slot as saved, up to which space may be handed out without
+		 * saving meta again; a tree reopened after a crash starts there */
+		off_t slot_mark;
+
+		// save meta, with slot_mark for its slot
+		int save_meta()
+		{
+			metaData saved = meta;
+			saved.slot = slot_mark;
+			return disk_write(&saved, OFFSET_META);
+		}
+
+		// alloc from disk; meta is saved a step ahead when the space runs
+		// past slot_mark, or a reopened tree would hand out the same
+		// space again
 		off_t alloc(size_t size)
 		{
 			off_t slot = meta.slot;
 			meta.slot += size;
+			if (meta.slot > slot_mark) {
+				slot_mark = meta.slot + slotStep;
+				save_meta();
+			}
+			return slot;
+		}
+
+		// take |size| bytes off the free list |list|, else from disk
+		off_t alloc_node(off_t *list, size_t size)
+		{
+			if (*list == 0)
+				return alloc(size);
+			off_t slot = *list;
+			disk_read(list, slot, sizeof(off_t));
+			save_meta();
 			return slot;
 		}
 
@@ -174,24 +258,56 @@ class bplus_tree {
 		{
 			leaf->n = 0;
 			meta.leaf_node_num++;
-			return alloc(sizeof(leafNode));
+			return alloc_node(&meta.free_leaf, sizeof(leafNode));
 		}
 
 		off_t alloc(internalNode *node)
 		{
 			node->n = 1;
 			meta.internal_node_num++;
-			return alloc(sizeof(internalNode));
+			return alloc_node(&meta.free_internal, sizeof(internalNode));
+		}
+
+		// the size class of a value of |size| bytes
+		static size_t value_class(size_t size)
+		{
+			size_t c = 0;
+			while ((valueExtent << c) < size)
+				++c;
+			return c;
+		}
+
+		// space for a value of |size| bytes, freed space of its size class
+		// first
+		off_t alloc_value(size_t size)
+		{
+			size_t c = value_class(size);
+			return alloc_node(&meta.free_value[c], valueExtent << c);
+		}
+
+		// put the node or value at |offset| on the free list |list|
+		void unalloc_node(off_t *list, off_t offset)
+		{
+			disk_write(list, offset, sizeof(off_t));
+			*list = offset;
+			save_meta();
 		}
 
 		void unalloc(leafNode *leaf, off_t offset)
 		{
 			--meta.leaf_node_num;
+			unalloc_node(&meta.free_leaf, offset);
 		}
 
 		void unalloc(internalNode *node, off_t offset)
 		{
 			--meta.internal_node_num;
+			unalloc_node(&meta.free_internal, offset);
+		}
+
+		void unalloc_value(off_t offset, size_t size)
+		{
+			unalloc_node(&meta.free_value[value_class(size)], offset);
 		}
 
 		// read block from disk
@@ -201,6 +317,7 @@ class bplus_tree {
 			fseek(fp, offset, SEEK_SET);
 			size_t rd = fread(block, size, 1, fp);
 			close_file();
+			bytes_read += size;
 
 			return rd - 1;
 		}
@@ -208,6 +325,7 @@ class bplus_tree {
 		template<class T>
 		int disk_read(T *block, off_t offset) const
 		{
+			++node_reads;
 			return disk_read(block, offset, sizeof(T));
 		}
 
@@ -218,6 +336,7 @@ class bplus_tree {
 			fseek(fp, offset, SEEK_SET);
 			size_t wd = fwrite(block, size, 1, fp);
 			close_file();
+			bytes_written += size;
 
 			return wd - 1;
 		}
@@ -228,6 +347,7 @@ class bplus_tree {
 			fseek(fp, offset, SEEK_SET);
 			size_t wd = fwrite(block, size, 1, fp);
 			close_file();
+			bytes_written += size;
 
 			return wd - 1;
 		}
@@ -235,52 +355,15 @@ class bplus_tree {
 		template<class T>
 		int disk_write(T *block, off_t offset) const
 		{
+			++node_writes;
 			return disk_write(block, offset, sizeof(T));
 		}
 
-		// debug print
-		template<class T>
-		void node_printf(const T *node) const {
-			printf("node size: %d\n", node->n);
-			for (int i = 0; i < node->n; i++) {
-				printf("%s%c", node->children[i].key, i == node->n - 1 ? '\n' : ' ');
-			}
-		}
+		/* every node, level by level from the root, as text */
+		void dump_tree(std::string *out) const;
 
-		void tree_printf() const {
-			off_t org = meta.root_offset;
-			int height = meta.height;
-			internalNode node, nxtInternal;
-			leafNode nxtLeafNode;
-			disk_read(&node, org);
-			printf("\n--------------------------------\n");
-			printf("internalCnt: %lld leafCnt: %lld\n", meta.internal_node_num, meta.leaf_node_num);
-			while (height > 0) {
-				disk_read(&nxtInternal, node.children[0].child);
-				printf("--------------------------------\n");
-				printf("height: %d\n", height);
-				while (true) {
-					node_printf(&node);
-					if (node.next == 0) {
-						break;
-					}
-					disk_read(&node, node.next);
-				}
-				node = nxtInternal;
-				--height;
-			}
-			disk_read(&nxtLeafNode, meta.leaf_offset);
-			printf("--------------------------------\n");
-			printf("leaf nodes:\n");
-			while (true) {
-				node_printf(&nxtLeafNode);
-				if (nxtLeafNode.prev == 0) {
-					break;
-				}
-				disk_read(&nxtLeafNode, nxtLeafNode.prev);
-			}
-			printf("--------------------------------\n");
-		}
+		/* dump_tree to stderr, when tracing at TRACE_TREE */
+		void trace_tree() const;
 };
 
 inline bool operator < (const record& x, const polar_race::PolarString& y) {
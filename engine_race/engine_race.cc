@@ -6,19 +6,25 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <utility>
+#include <vector>
+
+#include "include/flight_recorder.h"
+#include "trace.h"
 #include "util.h"
 
 namespace polar_race {
+namespace engine_race {
 
 static const char kLockFile[] = "LOCK";
 static const char kDataFile[] = "DATA";
 
-RetCode Engine::Open(const std::string &name, Engine **eptr) {
+// Registered as "engine_race". Values are stored as they are, the options
+// have nothing to tune yet
+RetCode Open(const std::string &name, const Options &options, Engine **eptr) {
 	return EngineRace::Open(name, eptr);
 }
 
-Engine::~Engine() {}
-
 /*
  * Complete the functions below to implement you own engine
  */
@@ -28,8 +34,8 @@ RetCode EngineRace::Open(const std::string &name, Engine **eptr) {
 	*eptr = NULL;
 	EngineRace *engine_race = new EngineRace(name);
 
-	printf("sizeof internal: %d\n", sizeof(b_plus_tree::internalNode));
-	printf("sizeof leaf: %d\n", sizeof(b_plus_tree::leafNode));
+	TRACE(TRACE_INFO, "sizeof internal: %zu\n", sizeof(b_plus_tree::internalNode));
+	TRACE(TRACE_INFO, "sizeof leaf: %zu\n", sizeof(b_plus_tree::leafNode));
 
 	// Check dir
 	if (opendir(name.c_str()) == NULL && 0 != mkdir(name.c_str(), 0755)) {
@@ -60,6 +66,7 @@ RetCode EngineRace::Open(const std::string &name, Engine **eptr) {
 }
  
 EngineRace::~EngineRace() {
+	store.close();
 	if (db_lock_) {
 		UnlockFile(db_lock_);
 	}
@@ -67,17 +74,42 @@ EngineRace::~EngineRace() {
 
 // 3. Write a key-value pair into engine
 RetCode EngineRace::Write(const PolarString& key, const PolarString& value) {
-	pthread_mutex_lock(&mu_);
+	FLIGHT_OP(kFlightWrite);
+	{
+		FLIGHT_PHASE(kPhaseLock);
+		mu_stats_.Lock(&mu_);
+	}
 	RetCode ret = store.insert_or_update(key, value);
-	pthread_mutex_unlock(&mu_);
+	++writes_;
+	mu_stats_.Unlock(&mu_);
 	return ret;
 }
 
 // 4. Read value of a key
 RetCode EngineRace::Read(const PolarString& key, std::string* value) {
-	pthread_mutex_lock(&mu_);
+	FLIGHT_OP(kFlightRead);
+	{
+		FLIGHT_PHASE(kPhaseLock);
+		mu_stats_.Lock(&mu_);
+	}
 	RetCode ret = store.search(key, value);
-	pthread_mutex_unlock(&mu_);
+	++reads_;
+	if (ret == kNotFound)
+		++read_misses_;
+	mu_stats_.Unlock(&mu_);
+	return ret;
+}
+
+// 5. Remove a key and its value
+RetCode EngineRace::Delete(const PolarString& key) {
+	FLIGHT_OP(kFlightDelete);
+	{
+		FLIGHT_PHASE(kPhaseLock);
+		mu_stats_.Lock(&mu_);
+	}
+	RetCode ret = store.remove(key);
+	++deletes_;
+	mu_stats_.Unlock(&mu_);
 	return ret;
 }
 
@@ -85,7 +117,7 @@ RetCode EngineRace::Read(const PolarString& key, std::string* value) {
  * NOTICE: Implement 'Range' in quarter-final,
  *         you can skip it in preliminary.
  */
-// 5. Applies the given Vistor::Visit function to the result
+// 6. Applies the given Vistor::Visit function to the result
 // of every key-value pair in the key range [first, last),
 // in order
 // lower=="" is treated as a key before all keys in the database.
@@ -116,4 +148,72 @@ RetCode EngineRace::Range(const PolarString& lower, const PolarString& upper,
 	return kSucc;
 }
 
+// Reads every node, so never on the way of an operation
+RetCode EngineRace::DumpTree(std::string* out) {
+	mu_stats_.Lock(&mu_);
+	store.dump_tree(out);
+	mu_stats_.Unlock(&mu_);
+	return kSucc;
+}
+
+// 7. Statistics, see Engine::GetProperty. Fill walks every leaf, so
+// asking for it, or for "polar.stats", reads the whole tree.
+RetCode EngineRace::GetProperty(const std::string& property,
+								std::string* value) {
+	if (property == "polar.slow_ops")
+		return FlightSlowOps(kSlowOps, value) ? kSucc : kNotFound;
+	if (property == "polar.tree.dump")
+		return DumpTree(value);
+	std::vector<std::pair<std::string, std::string> > props;
+	auto add = [&props](const std::string& name, const std::string& v) {
+		props.push_back(std::make_pair(name, v));
+	};
+	bool all = property == "polar.stats";
+
+	mu_stats_.Lock(&mu_);
+	b_plus_tree::metaData meta = store.getMeta();
+	add("polar.writes", std::to_string(writes_));
+	add("polar.reads", std::to_string(reads_));
+	add("polar.read_misses", std::to_string(read_misses_));
+	add("polar.deletes", std::to_string(deletes_));
+	add("polar.tree.node_reads", std::to_string(store.node_reads));
+	add("polar.tree.node_writes", std::to_string(store.node_writes));
+	add("polar.tree.leaf_splits", std::to_string(store.leaf_splits));
+	add("polar.tree.internal_splits", std::to_string(store.internal_splits));
+	add("polar.tree.leaf_merges", std::to_string(store.leaf_merges));
+	add("polar.tree.internal_merges", std::to_string(store.internal_merges));
+	add("polar.tree.borrows", std::to_string(store.borrows));
+	add("polar.tree.bytes_read", std::to_string(store.bytes_read));
+	add("polar.tree.bytes_written", std::to_string(store.bytes_written));
+	add("polar.tree.height", std::to_string(meta.height));
+	add("polar.tree.internal_nodes", std::to_string(meta.internal_node_num));
+	add("polar.tree.leaf_nodes", std::to_string(meta.leaf_node_num));
+	add("polar.tree.file_bytes", std::to_string(meta.slot));
+	if (all || property == "polar.tree.leaf_fill") {
+		char fill[32];
+		snprintf(fill, sizeof(fill), "%.4f", store.leaf_fill());
+		add("polar.tree.leaf_fill", fill);
+	}
+	mu_stats_.Unlock(&mu_);
+
+	// Node latches are taken on copies of nodes read under mu_, so they
+	// never wait; whatever waiting there is, is for mu_
+	mu_stats_.GetProperties("polar.lock.engine", &props);
+
+	if (all) {
+		value->clear();
+		for (auto& p : props)
+			value->append(p.first + " " + p.second + "\n");
+		return kSucc;
+	}
+	for (auto& p : props) {
+		if (p.first == property) {
+			*value = p.second;
+			return kSucc;
+		}
+	}
+	return kNotFound;
+}
+
+}  // namespace engine_race
 }  // namespace polar_race
@@ -7,10 +7,12 @@
 #include <unistd.h>
 
 #include "include/engine.h"
+#include "include/lock_stats.h"
 #include "BPlusTree.h"
 #include "util.h"
 
 namespace polar_race {
+namespace engine_race {
 
 class EngineRace : public Engine {
 public:
@@ -18,7 +20,7 @@ public:
 
 	explicit EngineRace(const std::string& dir): 
 		mu_(PTHREAD_MUTEX_INITIALIZER),
-		db_lock_(NULL) {}
+		db_lock_(NULL), writes_(0), reads_(0), read_misses_(0), deletes_(0) {}
 
 	~EngineRace();
 
@@ -26,6 +28,8 @@ public:
 
 	RetCode Read(const PolarString& key, std::string* value) override;
 
+	RetCode Delete(const PolarString& key) override;
+
 	/*
 	 * NOTICE: Implement 'Range' in quarter-final,
 	 *         you can skip it in preliminary.
@@ -33,12 +37,27 @@ public:
 	RetCode Range(const PolarString& lower, const PolarString& upper,
 				  Visitor& visitor) override;
 
+	RetCode GetProperty(const std::string& property,
+						std::string* value) override;
+
+	// Every node of the tree, level by level from the root, as text; the
+	// same as GetProperty("polar.tree.dump")
+	RetCode DumpTree(std::string* out);
+
 private:
 	pthread_mutex_t mu_;
+	LockStats mu_stats_;  // taken and released through this
 	FileLock* db_lock_;
 	b_plus_tree::bplus_tree store;
+	// Every operation holds mu_ anyway, so plain counters do
+	uint64_t writes_;
+	uint64_t reads_;
+	uint64_t read_misses_;
+	uint64_t deletes_;
 };
 
+}  // namespace engine_race
+
 inline bool operator<(const PolarString& x, const PolarString& y) {
 	return x.compare(y) < 0;
 }
@@ -0,0 +1,33 @@
+#ifndef _trace_h_
+#define _trace_h_
+
+#include <stdio.h>
+
+/*
+ * Leveled tracing to stderr. Levels above TRACE_LEVEL compile to nothing
+ * but a format check, so a release build (DEBUG_LEVEL=0, which defines
+ * NDEBUG) traces nothing unless TRACE_LEVEL is given, e.g.
+ * `make TRACE_LEVEL=3`, and a debug build traces up to TRACE_INFO.
+ */
+#define TRACE_ERROR 1  // something went wrong
+#define TRACE_INFO  2  // once per engine, e.g. on open
+#define TRACE_OP    3  // once per operation
+#define TRACE_TREE  4  // the whole tree after every operation, O(tree) I/O
+
+#ifndef TRACE_LEVEL
+#ifdef NDEBUG
+#define TRACE_LEVEL 0
+#else
+#define TRACE_LEVEL TRACE_INFO
+#endif
+#endif
+
+#define TRACE_ON(level) ((level) <= TRACE_LEVEL)
+
+#define TRACE(level, ...) \
+	do { \
+		if (TRACE_ON(level)) \
+			fprintf(stderr, __VA_ARGS__); \
+	} while (0)
+
+#endif /* _trace_h_ */
@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 namespace polar_race {
+namespace engine_race {
 
 static const int kA = 54059;    // a prime
 static const int kB = 76963;    // another prime
@@ -121,4 +122,5 @@ int UnlockFile(FileLock* lock) {
 	return result;
 }
 
+}  // namespace engine_race
 }  // namespace polar_race
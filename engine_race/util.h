@@ -8,6 +8,7 @@
 #include <vector>
 
 namespace polar_race {
+namespace engine_race {
 
 // Hash
 uint32_t StrHash(const char* s, int size);
@@ -37,6 +38,7 @@ int DataFile(const std::string& f);
 int LockFile(const std::string& f, FileLock** l);
 int UnlockFile(FileLock* l);
 
+}  // namespace engine_race
 }  // namespace polar_race
 
 #endif  // ENGINE_SIMPLE_UTIL_H_
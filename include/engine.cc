@@ -0,0 +1,125 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#include "include/engine.h"
+
+#include <pthread.h>
+
+#include <utility>
+
+// The engines the library is built with, default first, as a list of
+// ENGINE(name); the build passes it in. Engine |name| provides
+// polar_race::name::Open.
+#ifndef POLAR_ENGINES
+#define POLAR_ENGINES
+#endif
+
+// Likewise the make variables that change what the engines do
+#ifndef POLAR_BUILD_FLAGS
+#define POLAR_BUILD_FLAGS ""
+#endif
+
+namespace polar_race {
+
+#define ENGINE(e)                                                  \
+    namespace e {                                                  \
+    RetCode Open(const std::string& name, const Options& options, \
+                 Engine** eptr);                                   \
+    }
+POLAR_ENGINES
+#undef ENGINE
+
+namespace {
+
+class Registry {
+public:
+    Registry() : mu_(PTHREAD_MUTEX_INITIALIZER) {
+#define ENGINE(e) Add(#e, e::Open);
+        POLAR_ENGINES
+#undef ENGINE
+    }
+
+    bool Add(const std::string& engine, Engine::Factory factory) {
+        pthread_mutex_lock(&mu_);
+        bool added = Find(engine) == NULL;
+        if (added) {
+            engines_.push_back(std::make_pair(engine, factory));
+        }
+        pthread_mutex_unlock(&mu_);
+        return added;
+    }
+
+    // NULL if there is no such engine; empty is the default one
+    Engine::Factory Get(const std::string& engine) {
+        pthread_mutex_lock(&mu_);
+        Engine::Factory factory = NULL;
+        if (engine.empty()) {
+            if (!engines_.empty()) {
+                factory = engines_[0].second;
+            }
+        } else {
+            factory = Find(engine);
+        }
+        pthread_mutex_unlock(&mu_);
+        return factory;
+    }
+
+    std::vector<std::string> Names() {
+        pthread_mutex_lock(&mu_);
+        std::vector<std::string> names;
+        for (auto& e : engines_) {
+            names.push_back(e.first);
+        }
+        pthread_mutex_unlock(&mu_);
+        return names;
+    }
+
+private:
+    pthread_mutex_t mu_;
+    // Few enough that a search beats a map, and in registration order
+    std::vector<std::pair<std::string, Engine::Factory>> engines_;
+
+    Engine::Factory Find(const std::string& engine) const {
+        for (auto& e : engines_) {
+            if (e.first == engine) {
+                return e.second;
+            }
+        }
+        return NULL;
+    }
+};
+
+Registry* GetRegistry() {
+    static Registry registry;
+    return &registry;
+}
+
+}  // namespace
+
+RetCode Engine::Open(const std::string& name, Engine** eptr) {
+    return Open(name, Options(), eptr);
+}
+
+RetCode Engine::Open(const std::string& name, const Options& options,
+                     Engine** eptr) {
+    *eptr = NULL;
+    Factory factory = GetRegistry()->Get(options.engine);
+    if (factory == NULL) {
+        return kInvalidArgument;
+    }
+    return factory(name, options, eptr);
+}
+
+bool Engine::Register(const std::string& engine, Factory factory) {
+    return GetRegistry()->Add(engine, factory);
+}
+
+std::vector<std::string> Engine::Engines() {
+    return GetRegistry()->Names();
+}
+
+const char* Engine::BuildFlags() {
+    return POLAR_BUILD_FLAGS;
+}
+
+Engine::~Engine() {}
+
+}  // namespace polar_race
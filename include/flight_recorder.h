@@ -0,0 +1,350 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef INCLUDE_FLIGHT_RECORDER_H_
+#define INCLUDE_FLIGHT_RECORDER_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+// Where the time of single slow operations goes. Built with
+// FLIGHT_RECORDER (make FLIGHT_RECORDER=1), every Write, Read and Range
+// stamps the TSC each time it moves from one phase to another, e.g. from
+// the index into a lock wait, and the last kFlightRecords operations of
+// every thread are kept. Engine::GetProperty("polar.slow_ops") gives the
+// slowest of them with the time spent in each phase, and so does SIGUSR2,
+// on stderr. Built without it, FLIGHT_OP and FLIGHT_PHASE are empty.
+//
+// An operation opens with FLIGHT_OP(op), and any function it calls marks
+// a phase with FLIGHT_PHASE(phase), which lasts to the end of the scope
+// and then returns to the phase before. Time in no marked phase is
+// "other".
+
+namespace polar_race {
+
+enum FlightOp {
+    kFlightWrite = 0,
+    kFlightRead,
+    kFlightRange,
+    kFlightDelete,
+    kFlightOps,
+};
+
+enum FlightPhase {
+    kPhaseOther = 0,
+    kPhaseIndex,  // finding the key
+    kPhaseLock,   // waiting for a lock
+    kPhaseIO,     // reading or writing values
+    kPhaseCopy,   // copying values
+    kFlightPhases,
+};
+
+// How many operations Engine::GetProperty("polar.slow_ops") gives
+static const size_t kSlowOps = 20;
+
+}  // namespace polar_race
+
+#ifdef FLIGHT_RECORDER
+
+#include <signal.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "include/tsc.h"
+
+namespace polar_race {
+
+static const uint32_t kFlightRecords = 1024;  // per thread
+
+// One operation. Only the thread that owns the ring writes it, and |seq|
+// is odd while it does, so a reader can tell a torn copy.
+struct FlightRecord {
+    uint64_t seq;
+    uint64_t start;  // tsc
+    uint64_t op;
+    uint64_t ticks[kFlightPhases];
+};
+
+// The records of one thread. Rings are never freed; a thread that ends
+// hands its ring to the next thread to start, records and all.
+struct FlightRing {
+    FlightRing* next;  // in the list of every ring
+    uint32_t id;
+    bool owned;
+    uint64_t count;  // records ever written, only the owner uses it
+    FlightRecord records[kFlightRecords];
+};
+
+class FlightRecorder {
+public:
+    // An operation of |op| that started at |start| and spent |ticks| in
+    // each phase
+    static void Record(FlightOp op, uint64_t start, const uint64_t* ticks) {
+        FlightRing* ring = Owner().ring;
+        FlightRecord* r = &ring->records[ring->count % kFlightRecords];
+        uint64_t seq = __atomic_load_n(&r->seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&r->start, start, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->op, static_cast<uint64_t>(op), __ATOMIC_RELAXED);
+        for (int p = 0; p < kFlightPhases; p++) {
+            __atomic_store_n(&r->ticks[p], ticks[p], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&r->seq, seq + 2, __ATOMIC_RELEASE);
+        ring->count++;
+
+        if (__atomic_load_n(&DumpWanted(), __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&DumpWanted(), 0, __ATOMIC_RELAXED)) {
+            std::string dump;
+            SlowOps(kSlowOps, &dump);
+            fputs(dump.c_str(), stderr);
+        }
+    }
+
+    // The slowest |n| operations any thread recorded, slowest first, one
+    // line each with the time in every phase
+    static void SlowOps(size_t n, std::string* out) {
+        std::vector<std::pair<uint32_t, FlightRecord> > ops;
+        for (FlightRing* ring = __atomic_load_n(&Rings(), __ATOMIC_ACQUIRE);
+             ring != NULL; ring = ring->next) {
+            for (uint32_t i = 0; i < kFlightRecords; i++) {
+                FlightRecord r;
+                if (Copy(ring->records[i], &r)) {
+                    ops.push_back(std::make_pair(ring->id, r));
+                }
+            }
+        }
+        n = std::min(n, ops.size());
+        std::partial_sort(ops.begin(), ops.begin() + n, ops.end(),
+                          [](const std::pair<uint32_t, FlightRecord>& a,
+                             const std::pair<uint32_t, FlightRecord>& b) {
+                              return Total(a.second) > Total(b.second);
+                          });
+
+        static const char* const kOps[kFlightOps] = {"write", "read",
+                                                     "range", "delete"};
+        const double ticks_per_us = TscTicksPerUs();
+        const uint64_t now = ReadTsc();
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "%6s %-6s %10s %10s %9s %9s %9s %9s %9s\n", "thread", "op",
+                 "ago_ms", "total_us", "index", "lock", "io", "copy", "other");
+        out->assign(line);
+        for (size_t i = 0; i < n; i++) {
+            const FlightRecord& r = ops[i].second;
+            const uint64_t* t = r.ticks;
+            snprintf(line, sizeof(line),
+                     "%6u %-6s %10.1f %10.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                     ops[i].first, kOps[r.op % kFlightOps],
+                     now > r.start ? (now - r.start) / ticks_per_us / 1000 : 0,
+                     Total(r) / ticks_per_us, t[kPhaseIndex] / ticks_per_us,
+                     t[kPhaseLock] / ticks_per_us, t[kPhaseIO] / ticks_per_us,
+                     t[kPhaseCopy] / ticks_per_us,
+                     t[kPhaseOther] / ticks_per_us);
+            out->append(line);
+        }
+    }
+
+private:
+    // Holds this thread's ring, and gives it up when the thread ends
+    struct RingOwner {
+        FlightRing* ring;
+
+        RingOwner() : ring(Acquire()) {}
+        ~RingOwner() { __atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE); }
+    };
+
+    static RingOwner& Owner() {
+        static thread_local RingOwner owner;
+        return owner;
+    }
+
+    static FlightRing*& Rings() {
+        static FlightRing* rings = NULL;
+        return rings;
+    }
+
+    static int& DumpWanted() {
+        static int wanted = 0;
+        return wanted;
+    }
+
+    // A ring some thread gave up, or a new one
+    static FlightRing* Acquire() {
+        static bool handler = InstallHandler();
+        (void)handler;
+        for (FlightRing* ring = __atomic_load_n(&Rings(), __ATOMIC_ACQUIRE);
+             ring != NULL; ring = ring->next) {
+            bool owned = false;
+            if (!__atomic_load_n(&ring->owned, __ATOMIC_RELAXED) &&
+                __atomic_compare_exchange_n(&ring->owned, &owned, true, false,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return ring;
+            }
+        }
+        FlightRing* ring = new FlightRing();  // zeroed, so no record is valid
+        ring->owned = true;
+        ring->next = __atomic_load_n(&Rings(), __ATOMIC_RELAXED);
+        ring->id = ring->next == NULL ? 0 : ring->next->id + 1;
+        while (!__atomic_compare_exchange_n(&Rings(), &ring->next, ring, true,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+            ring->id = ring->next == NULL ? 0 : ring->next->id + 1;
+        }
+        return ring;
+    }
+
+    // SIGUSR2 asks for a dump, which the next operation to finish prints.
+    // A handler the program set up itself is left alone.
+    static bool InstallHandler() {
+        struct sigaction old;
+        if (0 == sigaction(SIGUSR2, NULL, &old) && old.sa_handler == SIG_DFL) {
+            struct sigaction sa;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags = SA_RESTART;
+            sa.sa_handler = [](int) {
+                __atomic_store_n(&DumpWanted(), 1, __ATOMIC_RELAXED);
+            };
+            sigaction(SIGUSR2, &sa, NULL);
+        }
+        return true;
+    }
+
+    // False if |r| was never written or changed while we copied it
+    static bool Copy(const FlightRecord& r, FlightRecord* copy) {
+        uint64_t seq = __atomic_load_n(&r.seq, __ATOMIC_ACQUIRE);
+        if (seq == 0 || seq % 2 == 1) {
+            return false;
+        }
+        copy->start = __atomic_load_n(&r.start, __ATOMIC_RELAXED);
+        copy->op = __atomic_load_n(&r.op, __ATOMIC_RELAXED);
+        for (int p = 0; p < kFlightPhases; p++) {
+            copy->ticks[p] = __atomic_load_n(&r.ticks[p], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return seq == __atomic_load_n(&r.seq, __ATOMIC_RELAXED);
+    }
+
+    static uint64_t Total(const FlightRecord& r) {
+        uint64_t total = 0;
+        for (int p = 0; p < kFlightPhases; p++) {
+            total += r.ticks[p];
+        }
+        return total;
+    }
+};
+
+// One operation, from construction to destruction. An operation started
+// inside another, e.g. a Write that hands over to WriteStream, is part of
+// the outer one.
+class FlightOpScope {
+public:
+    explicit FlightOpScope(FlightOp op)
+        : op_(op), phase_(kPhaseOther), outer_(Current()) {
+        for (int p = 0; p < kFlightPhases; p++) {
+            ticks_[p] = 0;
+        }
+        if (outer_ == NULL) {
+            start_ = last_ = ReadTsc();
+            Current() = this;
+        }
+    }
+
+    ~FlightOpScope() {
+        if (outer_ == NULL) {
+            Enter(kPhaseOther);
+            Current() = NULL;
+            FlightRecorder::Record(op_, start_, ticks_);
+        }
+    }
+
+    // Charges the time since the last change to the phase we are in, and
+    // moves to |phase|; returns the phase we were in
+    FlightPhase Enter(FlightPhase phase) {
+        uint64_t now = ReadTsc();
+        ticks_[phase_] += now - last_;
+        last_ = now;
+        FlightPhase was = phase_;
+        phase_ = phase;
+        return was;
+    }
+
+    // The outermost operation under way in this thread, if any
+    static FlightOpScope*& Current() {
+        static thread_local FlightOpScope* current = NULL;
+        return current;
+    }
+
+private:
+    FlightOp op_;
+    FlightPhase phase_;
+    FlightOpScope* outer_;
+    uint64_t start_;
+    uint64_t last_;
+    uint64_t ticks_[kFlightPhases];
+
+    // No copying allowed
+    FlightOpScope(const FlightOpScope&);
+    void operator=(const FlightOpScope&);
+};
+
+// One phase of the operation under way, to the end of the scope
+class FlightPhaseScope {
+public:
+    explicit FlightPhaseScope(FlightPhase phase)
+        : op_(FlightOpScope::Current()), was_(kPhaseOther) {
+        if (op_ != NULL) {
+            was_ = op_->Enter(phase);
+        }
+    }
+
+    ~FlightPhaseScope() {
+        if (op_ != NULL) {
+            op_->Enter(was_);
+        }
+    }
+
+private:
+    FlightOpScope* op_;
+    FlightPhase was_;
+
+    // No copying allowed
+    FlightPhaseScope(const FlightPhaseScope&);
+    void operator=(const FlightPhaseScope&);
+};
+
+// True, and the slowest |n| operations in |out|
+inline bool FlightSlowOps(size_t n, std::string* out) {
+    FlightRecorder::SlowOps(n, out);
+    return true;
+}
+
+}  // namespace polar_race
+
+#define FLIGHT_CONCAT_(a, b) a##b
+#define FLIGHT_CONCAT(a, b) FLIGHT_CONCAT_(a, b)
+#define FLIGHT_OP(op) ::polar_race::FlightOpScope flight_op_(op)
+#define FLIGHT_PHASE(phase) \
+    ::polar_race::FlightPhaseScope FLIGHT_CONCAT(flight_phase_, __LINE__)(phase)
+
+#else  // FLIGHT_RECORDER
+
+namespace polar_race {
+
+// False; there is no recorder
+inline bool FlightSlowOps(size_t n, std::string* out) { return false; }
+
+}  // namespace polar_race
+
+#define FLIGHT_OP(op) \
+    do {              \
+    } while (0)
+#define FLIGHT_PHASE(phase) \
+    do {                    \
+    } while (0)
+
+#endif  // FLIGHT_RECORDER
+
+#endif  // INCLUDE_FLIGHT_RECORDER_H_
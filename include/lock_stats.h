@@ -0,0 +1,231 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef INCLUDE_LOCK_STATS_H_
+#define INCLUDE_LOCK_STATS_H_
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "include/tsc.h"
+
+namespace polar_race {
+
+// How one class of locks is used, e.g. the engine's lock or every leaf
+// latch: acquisitions, the ones that had to wait, how long they waited,
+// as a histogram, and how long the locks were held.
+//
+// Take and release the locks through Lock, ReadLock, WriteLock and
+// Unlock, or for locks of other kinds, e.g. spin locks, report them with
+// Acquired and Released. An acquisition that gets the lock at once costs
+// a try-lock, two TSC reads and a few adds to a cache line of this
+// thread's own, as in engine_example's Counters.
+class LockStats {
+public:
+    LockStats() : slots_(NULL) {
+        void* ptr = NULL;
+        if (0 != posix_memalign(&ptr, alignof(Slot), kSlots * sizeof(Slot))) {
+            abort();
+        }
+        slots_ = reinterpret_cast<Slot*>(ptr);
+        memset(ptr, 0, kSlots * sizeof(Slot));
+    }
+
+    ~LockStats() { free(slots_); }
+
+    void Lock(pthread_mutex_t* mu) {
+        if (0 == pthread_mutex_trylock(mu)) {
+            Acquired(false, 0);
+            return;
+        }
+        uint64_t since = ReadTsc();
+        pthread_mutex_lock(mu);
+        Acquired(true, since);
+    }
+
+    // For locks that are skipped rather than waited for
+    bool TryLock(pthread_mutex_t* mu) {
+        if (0 != pthread_mutex_trylock(mu)) {
+            return false;
+        }
+        Acquired(false, 0);
+        return true;
+    }
+
+    void Unlock(pthread_mutex_t* mu) {
+        Released();
+        pthread_mutex_unlock(mu);
+    }
+
+    void ReadLock(pthread_rwlock_t* rw) {
+        if (0 == pthread_rwlock_tryrdlock(rw)) {
+            Acquired(false, 0);
+            return;
+        }
+        uint64_t since = ReadTsc();
+        pthread_rwlock_rdlock(rw);
+        Acquired(true, since);
+    }
+
+    void WriteLock(pthread_rwlock_t* rw) {
+        if (0 == pthread_rwlock_trywrlock(rw)) {
+            Acquired(false, 0);
+            return;
+        }
+        uint64_t since = ReadTsc();
+        pthread_rwlock_wrlock(rw);
+        Acquired(true, since);
+    }
+
+    void Unlock(pthread_rwlock_t* rw) {
+        Released();
+        pthread_rwlock_unlock(rw);
+    }
+
+    // This thread got the lock, after waiting since |since| if
+    // |contended|
+    void Acquired(bool contended, uint64_t since) {
+        Slot* s = &slots_[ThreadSlot()];
+        uint64_t now = ReadTsc();
+        __atomic_fetch_add(&s->acquisitions, 1, __ATOMIC_RELAXED);
+        if (contended) {
+            uint64_t wait = now > since ? now - since : 0;
+            __atomic_fetch_add(&s->contended, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&s->wait_ticks, wait, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&s->waits[Bucket(wait)], 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&s->locked_at, now, __ATOMIC_RELAXED);
+    }
+
+    // This thread is about to let go of the lock. Hold times are only
+    // counted for the lock the thread took last in this class, and are
+    // rough past kSlots threads, which share slots.
+    void Released() {
+        Slot* s = &slots_[ThreadSlot()];
+        uint64_t locked = __atomic_exchange_n(&s->locked_at, 0,
+                                              __ATOMIC_RELAXED);
+        uint64_t now = ReadTsc();
+        if (locked != 0 && now > locked) {
+            __atomic_fetch_add(&s->hold_ticks, now - locked, __ATOMIC_RELAXED);
+        }
+    }
+
+    uint64_t acquisitions() const { return Sum(&Slot::acquisitions); }
+
+    // "|prefix|.acquisitions" and so on, as Engine::GetProperty reports
+    // them. Waits are in microseconds, the histogram as "up_to_us:count"
+    // for every bucket with waits in it, or "-" if nothing waited.
+    void GetProperties(
+        const std::string& prefix,
+        std::vector<std::pair<std::string, std::string> >* props) const {
+        const double ticks_per_us = TscTicksPerUs();
+        const uint64_t acquisitions = Sum(&Slot::acquisitions);
+        const uint64_t contended = Sum(&Slot::contended);
+        const uint64_t hold_ticks = Sum(&Slot::hold_ticks);
+        uint64_t waits[kBuckets] = {0};
+        for (uint32_t s = 0; s < kSlots; s++) {
+            for (int b = 0; b < kBuckets; b++) {
+                waits[b] +=
+                    __atomic_load_n(&slots_[s].waits[b], __ATOMIC_RELAXED);
+            }
+        }
+
+        char buf[32];
+        auto add = [&](const char* name, const std::string& value) {
+            props->push_back(std::make_pair(prefix + "." + name, value));
+        };
+        auto us = [&](double ticks) {
+            snprintf(buf, sizeof(buf), "%.4f", ticks / ticks_per_us);
+            return std::string(buf);
+        };
+        add("acquisitions", std::to_string(acquisitions));
+        add("contended", std::to_string(contended));
+        add("wait_us", us(Sum(&Slot::wait_ticks)));
+        add("wait_p50_us", us(Percentile(waits, contended, 50)));
+        add("wait_p99_us", us(Percentile(waits, contended, 99)));
+        add("hold_us", us(hold_ticks));
+        add("hold_mean_us", us(acquisitions == 0
+                                   ? 0.0
+                                   : static_cast<double>(hold_ticks) /
+                                         acquisitions));
+        std::string histogram;
+        for (int b = 0; b < kBuckets; b++) {
+            if (waits[b] != 0) {
+                snprintf(buf, sizeof(buf), "%s%.3g:%llu",
+                         histogram.empty() ? "" : " ",
+                         BucketHigh(b) / ticks_per_us,
+                         static_cast<unsigned long long>(waits[b]));
+                histogram += buf;
+            }
+        }
+        add("wait_histogram", histogram.empty() ? "-" : histogram);
+    }
+
+private:
+    static const uint32_t kSlots = 64;
+    // Waits by power of two of ticks, the last one for everything longer
+    static const int kBuckets = 40;
+
+    struct alignas(64) Slot {
+        uint64_t acquisitions;
+        uint64_t contended;
+        uint64_t wait_ticks;
+        uint64_t hold_ticks;
+        uint64_t locked_at;  // tsc, 0 if this thread holds none
+        uint64_t waits[kBuckets];
+    };
+
+    Slot* slots_;  // cache line aligned, which new does not promise
+
+    static uint32_t ThreadSlot() {
+        static uint32_t next_thread = 0;
+        static thread_local uint32_t slot =
+            __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED) % kSlots;
+        return slot;
+    }
+
+    // Waits of up to 2^b ticks, from 2^(b-1)
+    static int Bucket(uint64_t ticks) {
+        int b = ticks == 0 ? 0 : 64 - __builtin_clzll(ticks);
+        return b < kBuckets ? b : kBuckets - 1;
+    }
+
+    static double BucketHigh(int b) { return static_cast<double>(1ull << b); }
+
+    uint64_t Sum(uint64_t Slot::*counter) const {
+        uint64_t sum = 0;
+        for (uint32_t s = 0; s < kSlots; s++) {
+            sum += __atomic_load_n(&(slots_[s].*counter), __ATOMIC_RELAXED);
+        }
+        return sum;
+    }
+
+    // In ticks, to within a bucket
+    static double Percentile(const uint64_t* waits, uint64_t total, double p) {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p / 100 * total + 0.5);
+        rank = rank == 0 ? 1 : rank;
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; b++) {
+            seen += waits[b];
+            if (seen >= rank) {
+                return BucketHigh(b);
+            }
+        }
+        return BucketHigh(kBuckets - 1);
+    }
+
+    // No copying allowed
+    LockStats(const LockStats&);
+    void operator=(const LockStats&);
+};
+
+}  // namespace polar_race
+
+#endif  // INCLUDE_LOCK_STATS_H_
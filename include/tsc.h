@@ -0,0 +1,34 @@
+// Copyright [2018] Alibaba Cloud All rights reserved
+#ifndef INCLUDE_TSC_H_
+#define INCLUDE_TSC_H_
+#include <stdint.h>
+#include <time.h>
+
+namespace polar_race {
+
+// Cycle counter, for timing short stretches of code at a few ns a read
+inline uint64_t ReadTsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+// TSC ticks per microsecond, measured over 10ms the first time
+inline double TscTicksPerUs() {
+    static double ticks_per_us = [] {
+        struct timespec t0, t1, pause = {0, 10 * 1000 * 1000};
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        uint64_t start = ReadTsc();
+        nanosleep(&pause, NULL);
+        uint64_t end = ReadTsc();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double us =
+            (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+        return (end - start) / us;
+    }();
+    return ticks_per_us;
+}
+
+}  // namespace polar_race
+
+#endif  // INCLUDE_TSC_H_
@@ -1,6 +1,6 @@
 #!/bin/bash
 
-test=('single_big_io_test.cc' 'single_thread_test.cc' 'multi_thread_test.cc' 'crash_test.cc')
+test=('single_big_io_test.cc' 'single_thread_test.cc' 'multi_thread_test.cc' 'crash_test.cc' 'delete_test.cc' 'checkpoint_test.cc' 'concurrent_test.cc' 'stream_test.cc' 'range_test.cc')
 
 rm -rf /tmp/ramdisk/data/test-*
 for f in ${test[@]}; do
@@ -8,3 +8,9 @@ for f in ${test[@]}; do
     echo $f
     g++ -std=c++11 -o $exe -g -I.. $f  -L../lib -lengine -lpthread -DMOCK_NVM
 done
+
+# codec_test looks inside engine_example, which the library may not have
+if nm -C ../lib/libengine.a 2>/dev/null | grep -q 'polar_race::GetCodec'; then
+    echo codec_test.cc
+    g++ -std=c++11 -o codec_test -g -I.. codec_test.cc  -L../lib -lengine -lpthread -DMOCK_NVM
+fi
@@ -0,0 +1,206 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+// engine_example saves its index to a checkpoint on a clean close, and
+// replays the data files when there is none or it is damaged. Either way
+// every key has to read back as it was written.
+
+#define KV_CNT 20000
+#define KEY_SIZE 8
+#define VALUE_SIZE 16
+
+// As engine_example/checkpoint.cc lays out the start of the file
+struct CheckpointHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t file_size;
+    uint64_t table_size;
+    uint32_t table_crc;
+    uint32_t header_crc;
+};
+
+struct SectionEntry {
+    uint32_t id;
+    uint32_t chunk_count;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t chunk_size;
+    uint64_t crc_offset;
+};
+
+static const uint32_t kIndexSection = 2;
+
+char k[1024];
+char v[9024];
+std::string ks[KV_CNT];
+std::string vs[KV_CNT];
+
+std::string engine_path;
+Options options;
+
+Engine *open_engine(const char *expected_recovery) {
+    Engine *engine = NULL;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    std::string recovery;
+    ret = engine->GetProperty("polar.recovery", &recovery);
+    assert(ret == kSucc);
+    printf("recovered by %s\n", recovery.c_str());
+    assert(recovery == expected_recovery);
+    return engine;
+}
+
+void check(Engine *engine, int n) {
+    std::string value;
+    for (int i = 0; i < n; ++i) {
+        RetCode ret = engine->Read(ks[i], &value);
+        assert(ret == kSucc);
+        assert(value == vs[i]);
+    }
+}
+
+void flip_byte(uint64_t offset) {
+    std::string path = engine_path + "/CHECKPOINT";
+    int fd = open(path.c_str(), O_RDWR);
+    assert(fd >= 0);
+    char c;
+    assert(pread(fd, &c, 1, offset) == 1);
+    c ^= 0x5a;
+    assert(pwrite(fd, &c, 1, offset) == 1);
+    close(fd);
+}
+
+uint64_t index_section_offset() {
+    std::string path = engine_path + "/CHECKPOINT";
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    CheckpointHeader header;
+    assert(pread(fd, &header, sizeof(header), 0) == sizeof(header));
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < header.section_count; ++i) {
+        SectionEntry e;
+        assert(pread(fd, &e, sizeof(e), sizeof(header) + i * sizeof(e)) ==
+               sizeof(e));
+        if (e.id == kIndexSection) {
+            offset = e.offset;
+        }
+    }
+    close(fd);
+    assert(offset != 0);
+    return offset;
+}
+
+int main() {
+    printf_(
+        "======================= checkpoint test "
+        "============================");
+#ifdef MOCK_NVM
+    engine_path =
+        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
+#else
+    engine_path = "/dev/dax0.0";
+#endif
+    options.engine = "engine_example";
+    Engine *engine = NULL;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    if (ret == kInvalidArgument) {
+        printf("engine_example is not in the library, skipped\n");
+        return 0;
+    }
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    for (int i = 0; i < KV_CNT; ++i) {
+        gen_marked_random(k, std::to_string(i) + "-", KEY_SIZE);
+        ks[i] = k;
+        gen_random(v, VALUE_SIZE);
+        vs[i] = v;
+    }
+
+    /////////////////////////////////
+    // A fresh engine has nothing to recover from
+    std::string recovery;
+    ret = engine->GetProperty("polar.recovery", &recovery);
+    assert(ret == kSucc && recovery == "replay");
+    for (int i = 0; i < KV_CNT / 2; ++i) {
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+    delete engine;
+
+    // A clean close takes the fast path
+    engine = open_engine("checkpoint");
+    check(engine, KV_CNT / 2);
+    delete engine;
+    printf("checkpoint OK\n");
+
+    // A process killed before it closes leaves no checkpoint
+    pid_t fpid = fork();
+    if (fpid == 0) {  // child
+        engine = open_engine("checkpoint");
+        for (int i = KV_CNT / 2; i < KV_CNT; ++i) {
+            ret = engine->Write(ks[i], vs[i]);
+            assert(ret == kSucc);
+        }
+        kill(getpid(), 9);
+    }
+    assert(fpid > 0);
+    int res;
+    waitpid(fpid, &res, 0);
+
+    engine = open_engine("replay");
+    check(engine, KV_CNT);
+    delete engine;
+    printf("replay OK\n");
+
+    // A damaged header is caught on open and the files are replayed
+    flip_byte(0);
+    engine = open_engine("replay");
+    check(engine, KV_CNT);
+    delete engine;
+    printf("damaged header OK\n");
+
+    // A damaged chunk of the index is only caught when it is touched.
+    // Keys in it report kCorruption, never a wrong value.
+    flip_byte(index_section_offset());
+    engine = open_engine("checkpoint");
+    std::string value;
+    int corrupted = 0;
+    for (int i = 0; i < KV_CNT; ++i) {
+        ret = engine->Read(ks[i], &value);
+        if (ret == kCorruption) {
+            corrupted++;
+            continue;
+        }
+        assert(ret == kSucc);
+        assert(value == vs[i]);
+    }
+    printf("%d of %d keys in the damaged chunk\n", corrupted, KV_CNT);
+    assert(corrupted > 0);
+    // No checkpoint is saved from a damaged index, so the next open
+    // replays
+    delete engine;
+    engine = open_engine("replay");
+    check(engine, KV_CNT);
+    delete engine;
+    printf("damaged chunk OK\n");
+
+    printf_(
+        "======================= checkpoint test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+#include "engine_example/codec.h"
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+// Round trips engine_example's codecs through values of every kind, and
+// feeds them damaged input, which must be refused, never overrun the
+// output or crash; then writes compressed values through the engine.
+// Needs engine_example in the library.
+
+#define ROUNDS 2000
+
+unsigned int seed = 1;
+
+// JSON-like text, runs, random bytes and mixtures of them
+std::string make_value(int kind, size_t size) {
+    std::string value;
+    while (value.size() < size) {
+        switch (kind) {
+            case 0:
+                value += "{\"id\":" + std::to_string(rand_r(&seed) % 1000) +
+                         ",\"name\":\"user\",\"tags\":[\"a\",\"b\"]}";
+                break;
+            case 1:
+                value.append(1 + rand_r(&seed) % 300,
+                             "ab"[rand_r(&seed) % 2]);
+                break;
+            case 2:
+                value.push_back(static_cast<char>(rand_r(&seed)));
+                break;
+            default:
+                value += make_value(rand_r(&seed) % 3, 1 + rand_r(&seed) % 64);
+                break;
+        }
+    }
+    value.resize(size);
+    return value;
+}
+
+void round_trip(const Codec *codec, const std::string &value) {
+    std::string stored;
+    bool smaller = CompressValue(codec, value, &stored);
+    assert(smaller == (stored.size() < value.size()));
+    std::string back = "stale";
+    RetCode ret = DecompressValue(stored.data(), stored.size(), &back);
+    assert(ret == kSucc);
+    assert(back == value);
+}
+
+// A damaged |stored| is refused or decodes to some value, and nothing is
+// written past the value either way
+void damaged(const std::string &stored) {
+    std::string back;
+    RetCode ret = DecompressValue(stored.data(), stored.size(), &back);
+    assert(ret == kSucc || ret == kCorruption || ret == kNotSupported);
+}
+
+int main() {
+    printf_(
+        "======================= codec test "
+        "============================");
+
+    assert(GetCodec(kNoCompression) == NULL);
+    const Codec *codec = GetCodec(kLZCompression);
+    assert(codec != NULL && codec->type() == kLZCompression);
+
+    /////////////////////////////////
+    // Edge sizes and then random ones
+    const size_t sizes[] = {0, 1, 4, 5, 15, 16, 19, 20, 255, 270, 65535,
+                            65536, 65537, 1024 * 1024};
+    for (size_t size : sizes) {
+        for (int kind = 0; kind < 4; ++kind) {
+            round_trip(codec, make_value(kind, size));
+        }
+    }
+    for (int i = 0; i < ROUNDS; ++i) {
+        round_trip(codec, make_value(i % 4, rand_r(&seed) % 20000));
+    }
+    std::string stored;
+    assert(CompressValue(codec, make_value(0, 4096), &stored));
+    assert(stored.size() * 3 < 4096);
+    printf("round trip OK\n");
+
+    /////////////////////////////////
+    for (int i = 0; i < ROUNDS; ++i) {
+        std::string value = make_value(i % 4, 1 + rand_r(&seed) % 5000);
+        CompressValue(codec, value, &stored);
+        std::string bad = stored;
+        switch (i % 5) {
+            case 0:  // flipped bytes
+                for (int j = 0; j < 1 + i % 4; ++j) {
+                    bad[rand_r(&seed) % bad.size()] ^=
+                        1 + rand_r(&seed) % 255;
+                }
+                break;
+            case 1:  // cut short
+                bad.resize(rand_r(&seed) % bad.size());
+                break;
+            case 2:  // raw size claimed too small or too large
+                bad[1 + rand_r(&seed) % 4] ^= 1 + rand_r(&seed) % 255;
+                break;
+            case 3:  // garbage after the header
+                for (size_t j = 5; j < bad.size(); ++j) {
+                    bad[j] = static_cast<char>(rand_r(&seed));
+                }
+                break;
+            default:  // unknown codec
+                bad[0] = 0x7e;
+                break;
+        }
+        damaged(bad);
+    }
+    // A raw size of 4GB must not be taken at its word
+    stored.assign("\x01\xff\xff\xff\xff\x10" "a", 7);
+    std::string back;
+    assert(DecompressValue(stored.data(), stored.size(), &back) ==
+           kCorruption);
+    printf("damaged input OK\n");
+
+    /////////////////////////////////
+    // Values written compressed read back the same under any options
+#ifdef MOCK_NVM
+    std::string engine_path =
+        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
+#else
+    std::string engine_path = "/dev/dax0.0";
+#endif
+    Options options;
+    options.engine = "engine_example";
+    options.compression = kLZCompression;
+    Engine *engine = NULL;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+    std::vector<std::string> values;
+    for (int i = 0; i < 400; ++i) {
+        values.push_back(make_value(i % 4, rand_r(&seed) % 8000));
+        ret = engine->Write("key" + std::to_string(i), values.back());
+        assert(ret == kSucc);
+    }
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 400; ++i) {
+            ret = engine->Read("key" + std::to_string(i), &back);
+            assert(ret == kSucc);
+            assert(back == values[i]);
+        }
+        delete engine;
+        options.compression = kNoCompression;
+        ret = Engine::Open(engine_path, options, &engine);
+        assert(ret == kSucc);
+    }
+    delete engine;
+    printf("engine OK\n");
+
+    printf_(
+        "======================= codec test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+// Readers run against writers that keep overwriting keys and adding new
+// ones, so that the index grows under them. Every key has one writer,
+// which writes it with rising versions; a reader must only ever see a
+// whole value of the key it asked for, and never an older version than
+// it saw before.
+
+#define KV_CNT 40000
+#define KEY_SIZE 16
+#define VALUE_SIZE 32
+#define WRITER_NUM 4
+#define READER_NUM 4
+#define ROUNDS 5
+
+std::string ks[KV_CNT];
+Engine *engine = NULL;
+std::atomic<int> writers_done(0);
+
+std::string make_value(int i, int version) {
+    char v[VALUE_SIZE + 1];
+    int n = snprintf(v, sizeof(v), "%08d:%08d:", i, version);
+    for (int j = n; j < VALUE_SIZE; ++j) {
+        v[j] = 'a' + (i + version + j) % 26;
+    }
+    v[VALUE_SIZE] = 0;
+    return std::string(v, VALUE_SIZE);
+}
+
+// -1 if |value| is not a whole value of key |i|
+int version_of(int i, const std::string &value) {
+    int key = -1, version = -1;
+    if (value.size() != VALUE_SIZE ||
+        sscanf(value.c_str(), "%08d:%08d:", &key, &version) != 2 ||
+        key != i || version < 0 || make_value(i, version) != value) {
+        return -1;
+    }
+    return version;
+}
+
+void writer(int id) {
+    for (int round = 0; round < ROUNDS; ++round) {
+        // The first round adds the keys, the others overwrite them
+        for (int i = id; i < KV_CNT; i += WRITER_NUM) {
+            RetCode ret = engine->Write(ks[i], make_value(i, round));
+            assert(ret == kSucc);
+        }
+    }
+    writers_done++;
+}
+
+void reader(int id) {
+    std::vector<int> seen(KV_CNT, -1);
+    unsigned int seed = id;
+    std::string value;
+    uint64_t reads = 0;
+    while (writers_done.load() < WRITER_NUM) {
+        int i = rand_r(&seed) % KV_CNT;
+        RetCode ret = engine->Read(ks[i], &value);
+        reads++;
+        if (ret == kNotFound) {
+            assert(seen[i] == -1);
+            continue;
+        }
+        assert(ret == kSucc);
+        int version = version_of(i, value);
+        assert(version >= 0);
+        assert(version >= seen[i]);
+        seen[i] = version;
+    }
+    printf("reader %d: %llu reads\n", id, (unsigned long long)reads);
+}
+
+int main() {
+    printf_(
+        "======================= concurrent test "
+        "============================");
+#ifdef MOCK_NVM
+    std::string engine_path =
+        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
+#else
+    std::string engine_path = "/dev/dax0.0";
+#endif
+    RetCode ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    char k[1024];
+    for (int i = 0; i < KV_CNT; ++i) {
+        gen_marked_random(k, std::to_string(i) + "-", KEY_SIZE);
+        ks[i] = k;
+    }
+
+    /////////////////////////////////
+    std::vector<std::thread> threads;
+    for (int i = 0; i < READER_NUM; ++i) {
+        threads.push_back(std::thread(reader, i));
+    }
+    for (int i = 0; i < WRITER_NUM; ++i) {
+        threads.push_back(std::thread(writer, i));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::string value;
+    for (int i = 0; i < KV_CNT; ++i) {
+        ret = engine->Read(ks[i], &value);
+        assert(ret == kSucc);
+        assert(version_of(i, value) == ROUNDS - 1);
+    }
+    delete engine;
+
+    printf_(
+        "======================= concurrent test pass :) "
+        "======================");
+
+    return 0;
+}
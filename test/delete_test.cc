@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+// Enough keys for the index to split many times over
+#define KV_CNT 10000
+#define KEY_SIZE 8
+#define VALUE_SIZE 16
+#define BIG_CNT 512
+#define BIG_VALUE_SIZE (64 * 1024)
+
+char k[1024];
+char v[9024];
+std::string ks[KV_CNT];
+std::string ks_more[KV_CNT];
+std::string vs_1[KV_CNT];
+std::string vs_2[KV_CNT];
+
+// Keys i % 3 == 0 keep their first value, i % 3 == 1 are deleted and
+// written again, i % 3 == 2 stay deleted
+void check(Engine *engine, bool more) {
+    std::string value;
+    for (int i = 0; i < KV_CNT; ++i) {
+        RetCode ret = engine->Read(ks[i], &value);
+        if (i % 3 == 2) {
+            assert(ret == kNotFound);
+            continue;
+        }
+        assert(ret == kSucc);
+        assert(value == (i % 3 == 0 ? vs_1[i] : vs_2[i]));
+    }
+    for (int i = 0; more && i < KV_CNT; ++i) {
+        RetCode ret = engine->Read(ks_more[i], &value);
+        if (i % 2 == 0) {
+            assert(ret == kSucc);
+            assert(value == vs_1[i]);
+        } else {
+            assert(ret == kNotFound);
+        }
+    }
+}
+
+int main() {
+    Engine *engine = NULL;
+    printf_(
+        "======================= delete test "
+        "============================");
+#ifdef MOCK_NVM
+    std::string engine_path =
+        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
+#else
+    std::string engine_path = "/dev/dax0.0";
+#endif
+    RetCode ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    for (int i = 0; i < KV_CNT; ++i) {
+        gen_marked_random(k, std::to_string(i) + "-", KEY_SIZE);
+        ks[i] = k;
+        gen_marked_random(k, std::to_string(i) + "+", KEY_SIZE);
+        ks_more[i] = k;
+        gen_random(v, VALUE_SIZE);
+        vs_1[i] = v;
+        gen_random(v, VALUE_SIZE);
+        vs_2[i] = v;
+    }
+
+    /////////////////////////////////
+    ret = engine->Delete(ks[0]);
+    assert(ret == kNotFound);
+
+    for (int i = 0; i < KV_CNT; ++i) {
+        ret = engine->Write(ks[i], vs_1[i]);
+        assert(ret == kSucc);
+    }
+    for (int i = 0; i < KV_CNT; ++i) {
+        if (i % 3 != 0) {
+            ret = engine->Delete(ks[i]);
+            assert(ret == kSucc);
+            ret = engine->Delete(ks[i]);
+            assert(ret == kNotFound);
+        }
+    }
+    for (int i = 0; i < KV_CNT; ++i) {
+        if (i % 3 == 1) {
+            ret = engine->Write(ks[i], vs_2[i]);
+            assert(ret == kSucc);
+        }
+    }
+    check(engine, false);
+
+    // Grow the index past the deleted keys, then delete some of the new
+    // keys again
+    for (int i = 0; i < KV_CNT; ++i) {
+        ret = engine->Write(ks_more[i], vs_1[i]);
+        assert(ret == kSucc);
+    }
+    for (int i = 1; i < KV_CNT; i += 2) {
+        ret = engine->Delete(ks_more[i]);
+        assert(ret == kSucc);
+    }
+    check(engine, true);
+
+    delete engine;
+
+    // re-open
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check(engine, true);
+    delete engine;
+
+    // Deletes that were never closed cleanly are not lost either
+    pid_t fpid = fork();
+    if (fpid == 0) {  // child
+        ret = Engine::Open(engine_path, &engine);
+        assert(ret == kSucc);
+        for (int i = 0; i < KV_CNT; ++i) {
+            if (i % 3 == 2) {
+                ret = engine->Write(ks[i], vs_1[i]);
+                assert(ret == kSucc);
+                ret = engine->Delete(ks[i]);
+                assert(ret == kSucc);
+            }
+        }
+        kill(getpid(), 9);
+    }
+    assert(fpid > 0);
+    int res;
+    waitpid(fpid, &res, 0);
+
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check(engine, true);
+
+    /////////////////////////////////
+    // Deleting what was written gives the space back, even when it all
+    // sits in the data file still being appended to
+    std::string stored;
+    if (engine->GetProperty("polar.store.stored_bytes", &stored) == kSucc) {
+        std::string big(BIG_VALUE_SIZE, 'x');
+        for (int i = 0; i < BIG_CNT; ++i) {
+            ret = engine->Write("big-" + std::to_string(i), big);
+            assert(ret == kSucc);
+        }
+        for (int i = 0; i < BIG_CNT; ++i) {
+            ret = engine->Delete("big-" + std::to_string(i));
+            assert(ret == kSucc);
+        }
+        // Compaction runs in the background
+        for (int i = 0; i < 100; ++i) {
+            ret = engine->GetProperty("polar.store.stored_bytes", &stored);
+            assert(ret == kSucc);
+            if (std::stoull(stored) < BIG_CNT * BIG_VALUE_SIZE / 4) {
+                break;
+            }
+            usleep(100 * 1000);
+        }
+        printf("%s bytes stored after deleting %d big values\n",
+               stored.c_str(), BIG_CNT);
+        assert(std::stoull(stored) < BIG_CNT * BIG_VALUE_SIZE / 4);
+        check(engine, true);
+    }
+    delete engine;
+
+    printf_(
+        "======================= delete test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -0,0 +1,241 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+// Checks Range against a std::map holding what was written: keys in
+// order, each once, lower bound included, upper bound excluded, deleted
+// keys left out. Then scans run while other threads keep deleting and
+// writing back keys around a set that stays put.
+
+#define KV_CNT 5000
+#define VALUE_SIZE 16
+#define RANGE_CNT 200
+#define CHURN_THREADS 4
+#define CHURN_ROUNDS 20
+
+typedef std::map<std::string, std::string> Model;
+
+class Collector : public Visitor {
+public:
+    void Visit(const PolarString &key, const PolarString &value) override {
+        got.push_back(std::make_pair(key.ToString(), value.ToString()));
+    }
+
+    std::vector<std::pair<std::string, std::string> > got;
+};
+
+unsigned int seed = 1;
+
+// 1 to 32 bytes, some above 0x7f, which must sort after the rest
+std::string random_key() {
+    std::string key(1 + rand_r(&seed) % 32, 0);
+    for (size_t i = 0; i < key.size(); ++i) {
+        key[i] = "abc\x01\x7f\x80\xfe"[rand_r(&seed) % 7];
+    }
+    return key;
+}
+
+void check_range(Engine *engine, const Model &model,
+                 const std::string &lower, const std::string &upper) {
+    Collector c;
+    RetCode ret = engine->Range(lower, upper, c);
+    assert(ret == kSucc);
+    Model::const_iterator it = model.lower_bound(lower);
+    Model::const_iterator end =
+        upper.empty() ? model.end() : model.lower_bound(upper);
+    if (!upper.empty() && upper <= lower) {
+        end = it;
+    }
+    size_t i = 0;
+    for (; it != end; ++it, ++i) {
+        assert(i < c.got.size());
+        assert(c.got[i].first == it->first);
+        assert(c.got[i].second == it->second);
+    }
+    assert(i == c.got.size());
+}
+
+void check(Engine *engine, const Model &model) {
+    check_range(engine, model, "", "");
+    std::vector<std::string> keys;
+    for (auto &kv : model) {
+        keys.push_back(kv.first);
+    }
+    for (int i = 0; i < RANGE_CNT; ++i) {
+        // Bounds on written keys and between them
+        std::string lower = i % 2 == 0 ? keys[rand_r(&seed) % keys.size()]
+                                       : random_key();
+        std::string upper = i % 3 == 0 ? keys[rand_r(&seed) % keys.size()]
+                                       : random_key();
+        if (i % 10 == 0) {
+            lower = "";
+        } else if (i % 10 == 1) {
+            upper = "";
+        }
+        check_range(engine, model, lower, upper);
+    }
+    check_range(engine, model, keys[keys.size() / 2], keys[keys.size() / 2]);
+    check_range(engine, model, keys.back(), keys.front());
+}
+
+std::atomic<int> churners_done(0);
+
+// Deletes and writes back the keys of |keys| that are its own, round
+// after round
+void churn(Engine *engine, const std::vector<std::string> *keys, int id) {
+    for (int round = 0; round < CHURN_ROUNDS; ++round) {
+        for (size_t i = id; i < keys->size(); i += CHURN_THREADS) {
+            RetCode ret = engine->Delete((*keys)[i]);
+            assert(ret == kSucc);
+        }
+        for (size_t i = id; i < keys->size(); i += CHURN_THREADS) {
+            RetCode ret = engine->Write((*keys)[i], "churn");
+            assert(ret == kSucc);
+        }
+    }
+    churners_done++;
+}
+
+// Every scan is in order and holds every key of |stable|
+void scan(Engine *engine, const Model *stable) {
+    int scans = 0;
+    while (churners_done.load() < CHURN_THREADS || scans == 0) {
+        Collector c;
+        RetCode ret = engine->Range("", "", c);
+        assert(ret == kSucc);
+        Model::const_iterator it = stable->begin();
+        for (size_t i = 0; i < c.got.size(); ++i) {
+            assert(i == 0 || c.got[i - 1].first < c.got[i].first);
+            if (it != stable->end() && c.got[i].first == it->first) {
+                assert(c.got[i].second == it->second);
+                ++it;
+            }
+        }
+        assert(it == stable->end());
+        scans++;
+    }
+    printf("%d scans\n", scans);
+}
+
+int main() {
+    printf_(
+        "======================= range test "
+        "============================");
+#ifdef MOCK_NVM
+    std::string engine_path =
+        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
+#else
+    std::string engine_path = "/dev/dax0.0";
+#endif
+    Engine *engine = NULL;
+    RetCode ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    /////////////////////////////////
+    Model model;
+    char v[1024];
+    for (int i = 0; i < KV_CNT; ++i) {
+        std::string key = random_key();
+        gen_random(v, VALUE_SIZE);
+        ret = engine->Write(key, v);
+        assert(ret == kSucc);
+        model[key] = v;
+    }
+
+    Collector all;
+    ret = engine->Range("", "", all);
+    assert(ret == kSucc);
+    if (all.got.empty()) {
+        printf("the engine's Range visits nothing, skipped\n");
+        delete engine;
+        return 0;
+    }
+
+    // Overwrite some keys and delete others
+    int n = 0;
+    for (Model::iterator it = model.begin(); it != model.end(); ++n) {
+        if (n % 5 == 0) {
+            gen_random(v, VALUE_SIZE);
+            ret = engine->Write(it->first, v);
+            assert(ret == kSucc);
+            it->second = v;
+            ++it;
+        } else if (n % 5 == 1) {
+            ret = engine->Delete(it->first);
+            if (ret == kNotSupported) {
+                ++it;
+                continue;
+            }
+            assert(ret == kSucc);
+            it = model.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    printf("%d keys\n", (int)model.size());
+    check(engine, model);
+    printf("range OK\n");
+    delete engine;
+
+    // re-open
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check(engine, model);
+
+    /////////////////////////////////
+    // Every other key stays, the rest come and go
+    if (engine->Delete(model.begin()->first) != kNotSupported) {
+        model.erase(model.begin());
+        Model stable;
+        std::vector<std::string> moving;
+        int n = 0;
+        for (auto &kv : model) {
+            if (n++ % 2 == 0) {
+                stable.insert(kv);
+            } else {
+                moving.push_back(kv.first);
+            }
+        }
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 2; ++i) {
+            threads.push_back(std::thread(scan, engine, &stable));
+        }
+        for (int i = 0; i < CHURN_THREADS; ++i) {
+            threads.push_back(std::thread(churn, engine, &moving, i));
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        for (auto &key : moving) {
+            model[key] = "churn";
+        }
+        check(engine, model);
+        printf("concurrent range OK\n");
+    }
+    delete engine;
+
+    // re-open after the churn
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check(engine, model);
+    delete engine;
+
+    printf_(
+        "======================= range test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -7,3 +7,15 @@
 # ./multi_thread_test
 # echo --------------------------------------
 # ./crash_test
+# echo --------------------------------------
+# ./delete_test
+# echo --------------------------------------
+# ./checkpoint_test
+# echo --------------------------------------
+# ./concurrent_test
+# echo --------------------------------------
+# ./stream_test
+# echo --------------------------------------
+# ./range_test
+# echo --------------------------------------
+# ./codec_test
@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+// Streams values through WriteStream and reads slices of them back with
+// ReadStream, the biggest one past 4GB so that offsets and sizes must not
+// be cut to 32 bits anywhere.
+
+#define KEY_SIZE 16
+#define BIG_SIZE ((1ull << 32) + 300 * 1024 * 1024 + 12345)
+
+// Byte |offset| of the value of key |id|. Bytes 4GB apart differ, so a
+// slice read from a truncated offset does not pass.
+inline char byte_at(int id, uint64_t offset) {
+    return static_cast<char>(offset ^ (offset >> 9) ^ ((offset >> 32) * 0x9d) ^
+                             id);
+}
+
+// Produces the value of key |id|, |size| bytes long, in pieces of
+// uneven size
+class PatternSource : public ValueSource {
+public:
+    PatternSource(int id, uint64_t size) : id_(id), size_(size), pos_(0) {}
+
+    RetCode Read(char *buf, size_t size, size_t *n) override {
+        uint64_t left = size_ - pos_;
+        *n = std::min<uint64_t>(std::min<uint64_t>(size, left),
+                                1000 + (pos_ % 77777));
+        for (size_t i = 0; i < *n; ++i) {
+            buf[i] = byte_at(id_, pos_ + i);
+        }
+        pos_ += *n;
+        return kSucc;
+    }
+
+private:
+    int id_;
+    uint64_t size_;
+    uint64_t pos_;
+};
+
+// Checks what it receives against the value of key |id| from |offset|
+class PatternSink : public ValueSink {
+public:
+    PatternSink(int id, uint64_t offset) : id_(id), pos_(offset), got_(0) {}
+
+    RetCode Write(const PolarString &piece) override {
+        for (size_t i = 0; i < piece.size(); ++i) {
+            assert(piece.data()[i] == byte_at(id_, pos_ + i));
+        }
+        pos_ += piece.size();
+        got_ += piece.size();
+        return kSucc;
+    }
+
+    uint64_t got() const { return got_; }
+
+private:
+    int id_;
+    uint64_t pos_;
+    uint64_t got_;
+};
+
+void check_slice(Engine *engine, const std::string &key, int id,
+                 uint64_t size, uint64_t offset, uint64_t len) {
+    PatternSink sink(id, offset);
+    RetCode ret = engine->ReadStream(key, offset, len, sink);
+    assert(ret == kSucc);
+    uint64_t expected = offset + len > size ? size - offset : len;
+    assert(sink.got() == expected);
+}
+
+const uint64_t sizes[] = {100, 3 * 1024 * 1024 + 17, BIG_SIZE};
+const int kValues = sizeof(sizes) / sizeof(sizes[0]);
+std::string ks[kValues];
+
+// |whole| reads every value from end to end as well
+void check(Engine *engine, bool whole) {
+    for (int id = 0; id < kValues; ++id) {
+        const uint64_t size = sizes[id];
+        if (whole) {
+            check_slice(engine, ks[id], id, size, 0, size);
+        }
+        check_slice(engine, ks[id], id, size, size / 3, 4096);
+        // Clamped at the end of the value
+        check_slice(engine, ks[id], id, size, size - 10, 1000);
+        check_slice(engine, ks[id], id, size, size, 10);
+        PatternSink sink(id, 0);
+        RetCode ret = engine->ReadStream(ks[id], size + 1, 10, sink);
+        assert(ret == kInvalidArgument);
+    }
+
+    // Around and past the 4GB mark, within and across extents
+    const int big = kValues - 1;
+    const uint64_t marks[] = {(1ull << 32) - 100, 1ull << 32,
+                              (1ull << 32) + 1024 * 1024 - 7,
+                              (1ull << 32) + 200 * 1024 * 1024};
+    for (uint64_t offset : marks) {
+        check_slice(engine, ks[big], big, BIG_SIZE, offset, 3 * 1024 * 1024);
+    }
+    check_slice(engine, ks[big], big, BIG_SIZE, BIG_SIZE - 4096, 1ull << 33);
+}
+
+int main() {
+    printf_(
+        "======================= stream test "
+        "============================");
+#ifdef MOCK_NVM
+    std::string engine_path =
+        std::string("/tmp/ramdisk/data/test-") + std::to_string(asm_rdtsc());
+#else
+    std::string engine_path = "/dev/dax0.0";
+#endif
+    Engine *engine = NULL;
+    RetCode ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    char k[1024];
+    for (int id = 0; id < kValues; ++id) {
+        gen_marked_random(k, std::to_string(id) + "-", KEY_SIZE);
+        ks[id] = k;
+    }
+
+    /////////////////////////////////
+    PatternSource probe(0, sizes[0]);
+    ret = engine->WriteStream(ks[0], probe);
+    if (ret == kNotSupported) {
+        printf("the engine does not stream values, skipped\n");
+        delete engine;
+        return 0;
+    }
+    assert(ret == kSucc);
+    for (int id = 1; id < kValues; ++id) {
+        PatternSource source(id, sizes[id]);
+        ret = engine->WriteStream(ks[id], source);
+        assert(ret == kSucc);
+    }
+    printf("write OK\n");
+
+    // A small value streamed in reads back whole through Read too
+    std::string value;
+    ret = engine->Read(ks[0], &value);
+    assert(ret == kSucc);
+    assert(value.size() == sizes[0]);
+    for (uint64_t i = 0; i < sizes[0]; ++i) {
+        assert(value[i] == byte_at(0, i));
+    }
+
+    check(engine, true);
+    printf("read OK\n");
+    delete engine;
+
+    // re-open
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check(engine, false);
+    delete engine;
+
+#ifdef MOCK_NVM
+    // Do not leave over 4GB behind
+    assert(system(("rm -rf " + engine_path).c_str()) == 0);
+#endif
+
+    printf_(
+        "======================= stream test pass :) "
+        "======================");
+
+    return 0;
+}